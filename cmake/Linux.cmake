@@ -27,6 +27,20 @@ if (USE_TRACE)
   add_compile_definitions(USE_TRACE)
 endif()
 
+option (USE_IO_URING
+  "Use io_uring to receive on server sockets and for socket events"
+  OFF)
+
+if (USE_IO_URING)
+  include(CheckSymbolExists)
+  check_symbol_exists(IORING_RECV_MULTISHOT linux/io_uring.h
+    HAVE_IORING_RECV_MULTISHOT)
+  if (NOT HAVE_IORING_RECV_MULTISHOT)
+    message(FATAL_ERROR "USE_IO_URING requires Linux 6.0 headers or later")
+  endif()
+  target_compile_definitions(mbus PRIVATE USE_IO_URING)
+endif()
+
 target_include_directories(mbus
   PRIVATE
   src/ports/linux
@@ -34,8 +48,13 @@ target_include_directories(mbus
 
 target_sources(mbus
   PRIVATE
+  include/mb_tcp_pool.h
+  include/mb_tcp_server.h
+  src/mb_tcp_pool.c
+  src/mb_tcp_server.c
   src/ports/linux/mbal_tcp.c
   src/ports/linux/mbal_rtu.c
+  $<$<BOOL:${USE_IO_URING}>:src/ports/linux/mbal_poll_uring.c>
   $<$<BOOL:${USE_TRACE}>:src/ports/linux/mb-tp.c>
   )
 
@@ -75,6 +94,22 @@ target_sources(mb_rtu_slave
   src/ports/linux/rtu_slave.c
   )
 
+install (FILES
+  include/mb_tcp_pool.h
+  include/mb_tcp_server.h
+  DESTINATION include
+  )
+
 if (BUILD_TESTING)
   set(GOOGLE_TEST_INDIVIDUAL TRUE)
 endif()
+
+if (TARGET mbus_test)
+  # Tests that require the Linux port
+  target_sources(mbus_test
+    PRIVATE
+    test/test_tcp.cpp
+    test/test_tcp_pool.cpp
+    test/test_tcp_server.cpp
+    )
+endif()
@@ -38,6 +38,8 @@ extern "C" {
 #define ESLAVE_ID          -103 /**< Unexpected slave ID */
 #define ETIMEOUT           -104 /**< Receive timed out */
 #define EUNKNOWN_EXCEPTION -105 /**< Modbus exception code not recognised */
+#define EWINDOW_FULL       -106 /**< No room for another pending request */
+#define ECONNECTION        -107 /**< Connection failed or closed */
 
 static inline const char * mb_error_literal (int error)
 {
@@ -61,6 +63,10 @@ static inline const char * mb_error_literal (int error)
       return "ETIMEOUT";
    case EUNKNOWN_EXCEPTION:
       return "EUNKNOWN_EXCEPTION";
+   case EWINDOW_FULL:
+      return "EWINDOW_FULL";
+   case ECONNECTION:
+      return "ECONNECTION";
    default:
       return "Unknown error";
    }
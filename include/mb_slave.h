@@ -30,6 +30,21 @@ extern "C" {
 
 #include "mb_export.h"
 
+/**
+ * Sequence lock for memory images
+ *
+ * A sequence lock makes it possible to read a memory image that is
+ * updated by another thread, without blocking the writer. Readers
+ * copy the data and retry if it was changed while they copied it. See
+ * mb_seqlock_write_begin() and mb_seqlock_read_begin().
+ */
+typedef struct mb_seqlock
+{
+   volatile uint32_t sequence; /**< Odd while a write is in progress */
+} mb_seqlock_t;
+
+typedef struct mb_iosegment mb_iosegment_t;
+
 typedef struct mb_iotable
 {
    /**
@@ -82,8 +97,59 @@ typedef struct mb_iotable
     */
    int (*set) (uint16_t address, uint8_t * data, size_t quantity);
 
+   /**
+    * Memory image. If not NULL, the table is served directly from
+    * this memory and the get and set callbacks are not used.
+    *
+    * For coils and input status the image is a packed bit array of
+    * at least (size + 7) / 8 bytes, where bit n is found with
+    * mb_slave_bit_get (image, n). For registers the image is an
+    * array of size uint16_t values in host byte order.
+    *
+    * The image is accessed by the slave task without locking, unless
+    * a lock is given.
+    */
+   void * image;
+
+   /**
+    * Sequence lock for the image, or NULL. If set, the slave reads
+    * the image in a read section and writes it in a write section, so
+    * that multi-register values are never torn. The application
+    * should update the image in a write section.
+    */
+   mb_seqlock_t * lock;
+
+   /**
+    * Number of segments, or 0 if the table is not segmented.
+    */
+   size_t num_segments;
+
+   /**
+    * Segments of a sparse table, sorted by base address and not
+    * overlapping. If not NULL, the table is served from the segments
+    * and the other members are not used. A request must lie within
+    * one segment, requests to addresses between segments fail with
+    * EILLEGAL_DATA_ADDRESS. Segments are found by binary search.
+    */
+   const mb_iosegment_t * segments;
+
 } mb_iotable_t;
 
+struct mb_iosegment
+{
+   /**
+    * First address of the segment.
+    */
+   uint16_t base;
+
+   /**
+    * Segment definition. The segment is served as a table of its own:
+    * addresses passed to the callbacks, and offsets in the image, are
+    * relative to \a base. The table can not be segmented.
+    */
+   mb_iotable_t table;
+};
+
 typedef struct mb_vendor_func
 {
    /**
@@ -130,20 +196,39 @@ typedef struct mb_iomap
    const mb_vendor_func_t * vendor_funcs; /**< Vendor-defined functions */
 } mb_iomap_t;
 
+typedef struct mb_slave_unit
+{
+   uint8_t id;               /**< Unit ID, 1-255 */
+   const mb_iomap_t * iomap; /**< Unit iomap */
+} mb_slave_unit_t;
+
 typedef struct mb_slave_cfg
 {
    uint8_t id;               /**< Slave ID */
    uint32_t priority;        /**< Priority of slave task */
    size_t stack_size;        /**< Stack size of slave task*/
    const mb_iomap_t * iomap; /**< Slave iomap */
+   size_t num_units;         /**< Number of additional units */
+   const mb_slave_unit_t * units; /**< Additional units, or NULL */
 } mb_slave_cfg_t;
 
+typedef struct mb_slave_map
+{
+   const mb_iomap_t * iomap;
+   uint8_t vendor_ix[256]; /**< Index + 1 of vendor function */
+} mb_slave_map_t;
+
 typedef struct mb_slave
 {
    uint8_t id;
    int running;
    mb_transport_t * transport;
-   const mb_iomap_t * iomap;
+   mb_slave_map_t map;              /**< Map for slave ID */
+   size_t num_units;                /**< Number of additional units */
+   mb_slave_map_t * units;          /**< Maps for additional units */
+   uint8_t unit_ix[256];            /**< Index + 1 of unit map */
+   volatile uint32_t requests[256]; /**< Requests per function code */
+   mb_diag_t * diag;                /**< Diagnostic counters, or NULL */
 } mb_slave_t;
 
 /**
@@ -300,13 +385,23 @@ typedef struct mb_slave
  * documented in mb_error.h, except for the vendor function callback
  * which returns the size of the response or a modbus exception code.
  *
+ * A slave can serve several unit IDs on the same transport, for
+ * instance when acting as a gateway for devices that are not on the
+ * bus themselves. The additional units are given by the \a units
+ * table in \a cfg, each with its own iomap. Requests are routed by
+ * unit ID in constant time, requests to other unit IDs are ignored
+ * and broadcast writes are applied to all units. A slave without
+ * additional units answers a Modbus/TCP request regardless of its
+ * unit ID, as before.
+ *
  * This function returns a handle to the slave which can be used for
  * further operations as documented below.
  *
  * \param cfg           Slave configuration
  * \param transport     Handle to transport data layer
  *
- * \return slave handle to be used in further operations
+ * \return slave handle to be used in further operations, or NULL if
+ *         the units are invalid
  */
 MB_EXPORT mb_slave_t * mb_slave_init (
    const mb_slave_cfg_t * cfg,
@@ -315,7 +410,8 @@ MB_EXPORT mb_slave_t * mb_slave_init (
 /**
  * Shutdown a running slave.
  *
- * The slave will exit after serving pending requests.
+ * The slave will exit after serving pending requests. A slave that
+ * is waiting for a request is woken up, see mb_slave_wakeup().
  *
  * \param slave         slave handle
  */
@@ -333,11 +429,27 @@ MB_EXPORT void * mb_slave_transport_get (mb_slave_t * slave);
 /**
  * Change the slave ID.
  *
+ * The new ID is used from the next request. A request that is being
+ * received is still served with the old ID.
+ *
  * \param slave         handle
  * \param id            new ID
  */
 MB_EXPORT void mb_slave_id_set (mb_slave_t * slave, uint8_t id);
 
+/**
+ * Wake up the slave task if it is waiting for a request
+ *
+ * The slave task checks its state and waits again. This is done by
+ * mb_slave_shutdown() and mb_slave_id_set(), and can be used by the
+ * application after other changes that should take effect at once.
+ * Transports that can not be woken up end the wait on a timeout of a
+ * few seconds.
+ *
+ * \param slave         handle
+ */
+MB_EXPORT void mb_slave_wakeup (mb_slave_t * slave);
+
 /**
  * Get a bit in the bit-string \a data
  *
@@ -394,6 +506,109 @@ MB_EXPORT uint16_t mb_slave_reg_get (void * data, uint32_t address);
  */
 MB_EXPORT void mb_slave_reg_set (void * data, uint32_t address, uint16_t value);
 
+/**
+ * Get the number of requests received with function code \a function
+ *
+ * Requests are counted whether they succeed or not, including those
+ * with function codes that are not supported.
+ *
+ * \param slave         slave handle
+ * \param function      function code
+ *
+ * \return number of requests, wraps at 2^32
+ */
+MB_EXPORT uint32_t mb_slave_request_count (
+   mb_slave_t * slave,
+   uint8_t function);
+
+/**
+ * Get a diagnostic counter
+ *
+ * The counters are also returned by the diagnostics function (8),
+ * truncated to 16 bits. Bus counters include messages to other
+ * slaves on the same serial line.
+ *
+ * \param slave         slave handle
+ * \param counter       counter to get
+ *
+ * \return counter value, wraps at 2^32
+ */
+MB_EXPORT uint32_t mb_slave_diag_get (
+   mb_slave_t * slave,
+   mb_diag_counter_t counter);
+
+/**
+ * Clear all diagnostic counters
+ *
+ * \param slave         slave handle
+ */
+MB_EXPORT void mb_slave_diag_clear (mb_slave_t * slave);
+
+/**
+ * Initialise a sequence lock
+ *
+ * \param lock          sequence lock
+ */
+MB_EXPORT void mb_seqlock_init (mb_seqlock_t * lock);
+
+/**
+ * Begin a write section
+ *
+ * Data protected by the lock may be updated until
+ * mb_seqlock_write_end() is called. Writers wait for each other, but
+ * never for readers. Write sections should be short.
+ *
+ * \code
+ * mb_seqlock_write_begin (&lock);
+ * hold[0] = value >> 16;
+ * hold[1] = value & 0xFFFF;
+ * mb_seqlock_write_end (&lock);
+ * \endcode
+ *
+ * \param lock          sequence lock
+ */
+MB_EXPORT void mb_seqlock_write_begin (mb_seqlock_t * lock);
+
+/**
+ * End a write section
+ *
+ * \param lock          sequence lock
+ */
+MB_EXPORT void mb_seqlock_write_end (mb_seqlock_t * lock);
+
+/**
+ * Begin a read section
+ *
+ * The data protected by the lock should be copied, and the copy
+ * discarded if mb_seqlock_read_retry() returns true:
+ *
+ * \code
+ * do
+ * {
+ *    seq = mb_seqlock_read_begin (&lock);
+ *    value = ((uint32_t)hold[0] << 16) | hold[1];
+ * } while (mb_seqlock_read_retry (&lock, seq));
+ * \endcode
+ *
+ * \param lock          sequence lock
+ *
+ * \return sequence number to pass to mb_seqlock_read_retry()
+ */
+MB_EXPORT uint32_t mb_seqlock_read_begin (const mb_seqlock_t * lock);
+
+/**
+ * End a read section
+ *
+ * \param lock          sequence lock
+ * \param sequence      value returned by mb_seqlock_read_begin()
+ *
+ * \return true if the data was changed during the read section and
+ *         must be read again
+ */
+MB_EXPORT bool mb_seqlock_read_retry (
+   const mb_seqlock_t * lock,
+   uint32_t sequence);
+
 /**
  * \internal
  */
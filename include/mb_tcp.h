@@ -32,6 +32,14 @@ extern "C" {
 
 #define MODBUS_DEFAULT_PORT 502
 
+/**
+ * Maximum number of peers that can be connected through one transport
+ * at the same time. Each peer has its own receive buffer and state, so
+ * that transactions with different peers can run in parallel from
+ * different tasks.
+ */
+#define MB_TCP_MAX_PEERS 8
+
 typedef struct mb_tcp_cfg
 {
    uint16_t port;
@@ -48,6 +56,10 @@ typedef struct mb_tcp mb_tcp_t;
  */
 MB_EXPORT mb_transport_t * mb_tcp_init (const mb_tcp_cfg_t * cfg);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* MB_TCP_H */
 
 /**
@@ -0,0 +1,226 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/**
+ * \addtogroup mb_tcp_pool Modbus TCP master connection pool
+ * \{
+ */
+
+#ifndef MB_TCP_POOL_H
+#define MB_TCP_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mbus.h"
+
+#include "mb_export.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mb_tcp_pool_cfg
+{
+   uint16_t port;          /**< Slave TCP port */
+   size_t max_connections; /**< Maximum number of connections */
+   uint32_t timeout;       /**< Response timeout [ms], 0 is forever */
+   size_t send_buffer;     /**< Socket send buffer [bytes], 0 is default */
+} mb_tcp_pool_cfg_t;
+
+typedef struct mb_tcp_pool mb_tcp_pool_t;
+
+/**
+ * Create a Modbus/TCP connection pool
+ *
+ * The pool holds many connections to Modbus/TCP slaves and serves
+ * them all from the thread that calls mb_tcp_pool_process(). Sockets
+ * are non-blocking and readiness is signalled by the operating system
+ * (epoll on Linux), so no call blocks on a single slave.
+ *
+ * Each connection has its own transmit and receive buffers and can
+ * have one request outstanding. Requests complete through a callback,
+ * as for mbus_read_async().
+ *
+ * \param cfg           pool configuration
+ *
+ * \return pool handle, or NULL on failure
+ */
+MB_EXPORT mb_tcp_pool_t * mb_tcp_pool_create (const mb_tcp_pool_cfg_t * cfg);
+
+/**
+ * Destroy a connection pool
+ *
+ * All connections are closed. Outstanding requests are not
+ * completed.
+ *
+ * \param pool          pool handle
+ */
+MB_EXPORT void mb_tcp_pool_destroy (mb_tcp_pool_t * pool);
+
+/**
+ * Connect to a slave
+ *
+ * This function starts connecting and returns immediately. Requests
+ * may be submitted right away, they are sent when the connection has
+ * been established.
+ *
+ * \param pool          pool handle
+ * \param name          IP address of slave
+ *
+ * \return connection handle on success, -1 if no connection could be
+ *         started or the pool is full
+ */
+MB_EXPORT int mb_tcp_pool_connect (mb_tcp_pool_t * pool, const char * name);
+
+/**
+ * Close a connection
+ *
+ * The connection handle is released. An outstanding request is not
+ * completed.
+ *
+ * \param pool          pool handle
+ * \param conn          connection handle
+ */
+MB_EXPORT void mb_tcp_pool_close (mb_tcp_pool_t * pool, int conn);
+
+/**
+ * Return true if the connection has failed or been closed by the
+ * slave. The connection should then be closed, and a new connection
+ * started if required.
+ *
+ * \param pool          pool handle
+ * \param conn          connection handle
+ *
+ * \return true if connection is down
+ */
+MB_EXPORT bool mb_tcp_pool_is_down (mb_tcp_pool_t * pool, int conn);
+
+/**
+ * Read modbus addresses
+ *
+ * This function sends a read request on the given connection and
+ * returns immediately. The arguments are the same as for
+ * mbus_read_async(), with the addition of the Modbus/TCP unit
+ * identifier.
+ *
+ * \param pool          pool handle
+ * \param conn          connection handle
+ * \param unit          unit identifier
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to read
+ * \param buffer        output buffer
+ * \param callback      completion callback
+ * \param arg           callback argument
+ *
+ * \return 0 on success, EWINDOW_FULL if a request is outstanding on
+ *         the connection, ECONNECTION if the connection is down, or
+ *         -1 if the arguments are invalid
+ */
+MB_EXPORT int mb_tcp_pool_read (
+   mb_tcp_pool_t * pool,
+   int conn,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Write modbus addresses
+ *
+ * See mb_tcp_pool_read() and mbus_write(). The contents of \a buffer
+ * are consumed before the function returns.
+ *
+ * \param pool          pool handle
+ * \param conn          connection handle
+ * \param unit          unit identifier
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to write
+ * \param buffer        input buffer
+ * \param callback      completion callback
+ * \param arg           callback argument
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mb_tcp_pool_write (
+   mb_tcp_pool_t * pool,
+   int conn,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Write single modbus address
+ *
+ * See mb_tcp_pool_read() and mbus_write_single().
+ *
+ * \param pool          pool handle
+ * \param conn          connection handle
+ * \param unit          unit identifier
+ * \param address       1-based address
+ * \param value         value to write
+ * \param callback      completion callback
+ * \param arg           callback argument
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mb_tcp_pool_write_single (
+   mb_tcp_pool_t * pool,
+   int conn,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t value,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Process connection events
+ *
+ * This function waits for socket events for at most \a tmo ms, and
+ * then completes connects, sends pending requests, receives
+ * responses and times out requests. Completion callbacks are called
+ * from this function. If a request times out when only part of it has
+ * been sent, the connection is closed and connected again. The
+ * application should call this function in a loop:
+ *
+ * \code
+ * for (;;)
+ * {
+ *    mb_tcp_pool_process (pool, 100);
+ * }
+ * \endcode
+ *
+ * \param pool          pool handle
+ * \param tmo           maximum time to wait [ms]
+ *
+ * \return number of requests still outstanding, or -1 on error
+ */
+MB_EXPORT int mb_tcp_pool_process (mb_tcp_pool_t * pool, uint32_t tmo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_TCP_POOL_H */
+
+/**
+ * \}
+ */
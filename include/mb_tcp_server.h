@@ -0,0 +1,175 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/**
+ * \addtogroup mb_tcp_server Modbus TCP multi-client server
+ * \{
+ */
+
+#ifndef MB_TCP_SERVER_H
+#define MB_TCP_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mb_slave.h"
+
+#include "mb_export.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mb_tcp_server_cfg
+{
+   uint16_t port;            /**< TCP port to listen on */
+   size_t max_clients;       /**< Maximum number of connected clients */
+   int backlog;              /**< Listen backlog, 0 for default */
+   size_t num_workers;       /**< Number of worker tasks, 0 for none */
+   uint32_t priority;        /**< Priority of server and worker tasks */
+   size_t stack_size;        /**< Stack size of server and worker tasks */
+   const mb_iomap_t * iomap; /**< Slave iomap */
+   size_t num_units;         /**< Number of additional units */
+   const mb_slave_unit_t * units; /**< Additional units, or NULL */
+   size_t num_shards;        /**< Number of shards, 0 for one */
+   const int * cpus;         /**< CPU of each shard, or NULL */
+} mb_tcp_server_cfg_t;
+
+typedef struct mb_tcp_server mb_tcp_server_t;
+
+/**
+ * Create a Modbus/TCP server
+ *
+ * The server keeps its listening socket open and serves many
+ * Modbus/TCP clients from the thread that calls
+ * mb_tcp_server_process(). Sockets are non-blocking and readiness is
+ * signalled by the operating system (epoll on Linux), so a slow
+ * client does not hold up the others.
+ *
+ * Requests are handled as for mb_slave_init(), using the callbacks in
+ * the iomap. If \a cfg->units is set, requests are routed by unit ID
+ * as for a slave with additional units, where unit ID 0 selects the
+ * iomap in \a cfg->iomap. Responses echo the transaction and unit
+ * identifiers of the request. Each client has one request in progress; further
+ * requests are read when the response has been sent.
+ *
+ * If \a cfg->num_workers is 0, the iomap callbacks are called from
+ * mb_tcp_server_process(). Otherwise they are called from a pool of
+ * worker tasks, so that a slow callback only delays its own client.
+ * Requests from different clients are then handled in parallel and
+ * the callbacks must be thread-safe. Responses to each client are
+ * still sent in the order the requests were received.
+ *
+ * If \a cfg->num_shards is larger than 1, the listening socket shares
+ * its port with other servers (SO_REUSEPORT) and the operating system
+ * spreads new connections across them. Servers created with the same
+ * configuration can then be processed by one thread each, see
+ * mb_tcp_server_init().
+ *
+ * \param cfg           server configuration
+ *
+ * \return server handle, or NULL on failure
+ */
+MB_EXPORT mb_tcp_server_t * mb_tcp_server_create (
+   const mb_tcp_server_cfg_t * cfg);
+
+/**
+ * Destroy a server
+ *
+ * All client connections and the listening socket are closed.
+ *
+ * \param server        server handle
+ */
+MB_EXPORT void mb_tcp_server_destroy (mb_tcp_server_t * server);
+
+/**
+ * Process server events
+ *
+ * This function waits for socket events for at most \a tmo ms, and
+ * then accepts new clients, receives requests and sends
+ * responses. The iomap callbacks are called from this function, unless
+ * there are worker tasks. The application should call it in a loop:
+ *
+ * \code
+ * for (;;)
+ * {
+ *    mb_tcp_server_process (server, 100);
+ * }
+ * \endcode
+ *
+ * \param server        server handle
+ * \param tmo           maximum time to wait [ms]
+ *
+ * \return number of connected clients, or -1 on error
+ */
+MB_EXPORT int mb_tcp_server_process (mb_tcp_server_t * server, uint32_t tmo);
+
+/**
+ * Get a diagnostic counter
+ *
+ * See mb_slave_diag_get(). The counters cover all clients, and all
+ * shards of a server started by mb_tcp_server_init().
+ *
+ * \param server        server handle
+ * \param counter       counter to get
+ *
+ * \return counter value, wraps at 2^32
+ */
+MB_EXPORT uint32_t mb_tcp_server_diag_get (
+   mb_tcp_server_t * server,
+   mb_diag_counter_t counter);
+
+/**
+ * Create a server and start a task that processes it
+ *
+ * See mb_tcp_server_create(). The task is created with the priority
+ * and stack size given in \a cfg.
+ *
+ * If \a cfg->num_shards is larger than 1, that many servers are
+ * created on the same port, each with its own task, so that requests
+ * are served on several cores. All shards serve the same iomap, whose
+ * callbacks must then be thread-safe. Each shard accepts up to \a
+ * cfg->max_clients clients and has \a cfg->num_workers workers. If \a
+ * cfg->cpus is set, the task of shard i only runs on CPU \a
+ * cfg->cpus[i].
+ *
+ * \param cfg           server configuration
+ *
+ * \return server handle, or NULL on failure
+ */
+MB_EXPORT mb_tcp_server_t * mb_tcp_server_init (
+   const mb_tcp_server_cfg_t * cfg);
+
+/**
+ * Stop the server task
+ *
+ * The tasks of all shards are stopped. A task with workers is woken
+ * at once, other tasks stop within 100 ms. This function waits for
+ * them to exit and then destroys the server. The handle is invalid
+ * when it returns.
+ *
+ * \param server        server handle
+ */
+MB_EXPORT void mb_tcp_server_shutdown (mb_tcp_server_t * server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_TCP_SERVER_H */
+
+/**
+ * \}
+ */
@@ -30,6 +30,23 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 
+/**
+ * Transaction flag for servers. Accept requests to any unit ID and
+ * report the received unit ID in the transaction.
+ */
+#define PDU_TXN_ANY_UNIT 0x01
+
+/**
+ * Transaction flag. The data buffer has PDU_HEADROOM free bytes in
+ * front of the PDU, and room for PDU_TAILROOM bytes after a PDU of
+ * maximum size, so that transports can build the ADU in place and send
+ * it without copying.
+ */
+#define PDU_TXN_HEADROOM 0x02
+
+#define PDU_HEADROOM 7 /**< Space for the largest ADU header (MBAP) */
+#define PDU_TAILROOM 2 /**< Space for the largest ADU trailer (CRC) */
+
 typedef struct pdu_txn
 {
    int arg;       /**< Transport peer identifier */
@@ -39,6 +56,25 @@ typedef struct pdu_txn
    void * data;   /**< Data for transaction */
 } pdu_txn_t;
 
+/**
+ * Diagnostic counters, as returned by the diagnostics function (8)
+ */
+typedef enum mb_diag_counter
+{
+   MB_DIAG_BUS_MESSAGES,   /**< Messages detected on the bus */
+   MB_DIAG_BUS_ERRORS,     /**< CRC or framing errors */
+   MB_DIAG_EXCEPTIONS,     /**< Exception responses */
+   MB_DIAG_SLAVE_MESSAGES, /**< Messages addressed to the slave */
+   MB_DIAG_NO_RESPONSES,   /**< Messages not responded to */
+   MB_DIAG_OVERRUNS,       /**< Messages too long for the buffer */
+   MB_DIAG_NUM_COUNTERS
+} mb_diag_counter_t;
+
+typedef struct mb_diag
+{
+   volatile uint32_t counter[MB_DIAG_NUM_COUNTERS];
+} mb_diag_t;
+
 typedef struct mb_transport mb_transport_t;
 struct mb_transport
 {
@@ -52,7 +88,10 @@ struct mb_transport
    int (*rx) (mb_transport_t * transport, pdu_txn_t * transaction, uint32_t tmo);
    bool (*rx_is_bc) (mb_transport_t * transport);
    bool (*rx_avail) (mb_transport_t * transport);
+   void (*wakeup) (mb_transport_t * transport); /**< Optional */
    bool is_server;
+   bool has_txn_id; /**< ADU carries a transaction ID */
+   mb_diag_t diag;  /**< Diagnostic counters */
 };
 
 int mb_transport_bringup (mb_transport_t * transport, const char * name);
@@ -61,6 +100,16 @@ int mb_transport_shutdown (mb_transport_t * transport, int arg);
 
 bool mb_transport_is_down (mb_transport_t * transport);
 
+/**
+ * Wake up the task waiting in mb_pdu_rx() or mb_transport_bringup(),
+ * which then returns as on timeout. If no task is waiting, the next
+ * wait returns at once. Does nothing if the transport does not
+ * support wakeup.
+ *
+ * \param transport     handle
+ */
+void mb_transport_wakeup (mb_transport_t * transport);
+
 /**
  * Transmit modbus protocol data unit (PDU). The PDU will be formatted
  * according to the application data unit protocol (ADU) of the
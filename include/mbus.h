@@ -30,14 +30,54 @@ extern "C" {
 
 #include "mb_export.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+/**
+ * Maximum number of transactions that can be outstanding at the same
+ * time. The effective window is configured by mbus_cfg_t.window.
+ */
+#define MBUS_MAX_PENDING 32
+
+/**
+ * Completion callback for asynchronous requests. The callback is
+ * called from the thread that drives the modbus instance, see
+ * mbus_process().
+ *
+ * \param result        result of the transaction, as for the
+ *                      corresponding blocking call
+ * \param arg           user argument given when submitting
+ */
+typedef void (*mbus_callback_t) (int result, void * arg);
+
+typedef struct mbus_pending
+{
+   uint8_t state;      /**< Transaction state */
+   uint8_t function;   /**< Function code of request */
+   uint16_t id;        /**< Transaction ID */
+   int slave;          /**< Slave handle */
+   uint32_t address;   /**< Starting address of request */
+   uint16_t quantity;  /**< Size of buffer, where relevant */
+   void * buffer;      /**< Caller buffer */
+   int result;         /**< Result of completed transaction */
+   uint32_t timestamp; /**< Time of transmission [us] */
+   uint32_t cache_seq; /**< Cache sequence number at transmission */
+   mbus_callback_t callback; /**< Completion callback, if asynchronous */
+   void * arg;               /**< Completion callback argument */
+} mbus_pending_t;
+
 typedef struct mbus
 {
    uint32_t timeout;
    mb_transport_t * transport;
    pdu_txn_t transaction;
+   uint16_t next_id; /**< Last transaction ID used */
    void * scratch;
+   uint8_t scratch_flags; /**< PDU_TXN_HEADROOM if scratch has headroom */
+   uint16_t window;
+   mbus_pending_t pending[MBUS_MAX_PENDING];
+   struct mbus_cache * cache; /**< Response cache, see mbus_cache.h */
+   uint32_t cycle_time;       /**< Duration of last batch [us] */
 } mbus_t;
 
 typedef uint32_t mb_address_t;
@@ -55,9 +95,33 @@ typedef uint32_t mb_address_t;
  */
 #define MB_ADDRESS(table, address) ((table) << 16 | ((address)&0xFFFF))
 
+typedef enum mbus_op_type
+{
+   MBUS_OP_READ,
+   MBUS_OP_WRITE,
+} mbus_op_type_t;
+
+typedef struct mbus_op
+{
+   uint8_t type;         /**< MBUS_OP_READ or MBUS_OP_WRITE */
+   int slave;            /**< Slave handle */
+   mb_address_t address; /**< 1-based starting address */
+   uint16_t quantity;    /**< Number of addresses */
+   void * buffer;        /**< Output or input buffer */
+   int result;           /**< Result of operation */
+} mbus_op_t;
+
 typedef struct mbus_cfg
 {
-   uint32_t timeout;
+   uint32_t timeout; /**< Response timeout [ms] */
+
+   /**
+    * Maximum number of requests in flight at the same time. Requests
+    * are pipelined only if the transport carries a transaction ID
+    * (Modbus/TCP), otherwise the window is always 1. A value of 0 is
+    * treated as 1. The window is limited to MBUS_MAX_PENDING.
+    */
+   uint16_t window;
 } mbus_cfg_t;
 
 /**
@@ -198,6 +262,371 @@ MB_EXPORT int mbus_write (
    uint16_t quantity,
    void * buffer);
 
+/**
+ * Read a range of modbus addresses
+ *
+ * This function reads a range of any size, up to the full 65535
+ * addresses of a table. The range is split into the largest requests
+ * allowed by mbus_read(), and the results are reassembled in \a
+ * buffer. Requests are pipelined if the transport allows it, see
+ * mbus_read_submit().
+ *
+ * The buffer format is the same as for mbus_read(). If a request
+ * fails, no further requests are sent, and the contents of the
+ * buffer are undefined.
+ *
+ * \param mbus          modbus handle
+ * \param slave         slave handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to read
+ * \param buffer        output buffer
+ *
+ * \return 0 on success, error code of the first failed request
+ *         otherwise
+ */
+MB_EXPORT int mbus_read_range (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint32_t quantity,
+   void * buffer);
+
+/**
+ * Write a range of modbus addresses
+ *
+ * This function writes a range of any size, up to the full 65535
+ * addresses of a table, in the largest requests allowed by
+ * mbus_write(). See mbus_read_range().
+ *
+ * If a request fails, no further requests are sent. Earlier requests
+ * may have taken effect.
+ *
+ * \param mbus          modbus handle
+ * \param slave         slave handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to write
+ * \param buffer        input buffer
+ *
+ * \return 0 on success, error code of the first failed request
+ *         otherwise
+ */
+MB_EXPORT int mbus_write_range (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint32_t quantity,
+   void * buffer);
+
+/**
+ * Mask write a holding register
+ *
+ * This function modifies a holding register in the slave using an
+ * AND mask and an OR mask (function code 22). The new value of the
+ * register is:
+ *
+ * \code
+ * value = (value & and_mask) | (or_mask & ~and_mask)
+ * \endcode
+ *
+ * Individual bits can thus be set or cleared in one transaction,
+ * without the race between a separate read and write:
+ *
+ * \code
+ * // Set bit 3 and clear bit 0
+ * result = mbus_mask_write (mbus, slave, MB_ADDRESS (4, 1), 0xFFF6, 0x0008);
+ * \endcode
+ *
+ * \param mbus          modbus handle
+ * \param slave         slave handle
+ * \param address       1-based holding register address
+ * \param and_mask      AND mask
+ * \param or_mask       OR mask
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mbus_mask_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t and_mask,
+   uint16_t or_mask);
+
+/**
+ * Read and write holding registers
+ *
+ * This function writes a number of holding registers and then reads
+ * a number of holding registers in a single transaction (function
+ * code 23). The write is performed before the read. This takes one
+ * round trip instead of two for a separate mbus_write() and
+ * mbus_read().
+ *
+ * Both addresses must be holding register addresses:
+ *
+ * \code
+ * result = mbus_read_write (
+ *    mbus,
+ *    slave,
+ *    MB_ADDRESS (4, 101),
+ *    4,
+ *    feedback,
+ *    MB_ADDRESS (4, 1),
+ *    2,
+ *    setpoints);
+ * \endcode
+ *
+ * The buffer formats are the same as for mbus_read() and
+ * mbus_write().
+ *
+ * \param mbus           modbus handle
+ * \param slave          slave handle
+ * \param read_address   1-based starting address to read
+ * \param read_quantity  number of registers to read (max 125)
+ * \param read_buffer    output buffer
+ * \param write_address  1-based starting address to write
+ * \param write_quantity number of registers to write (max 121)
+ * \param write_buffer   input buffer
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mbus_read_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t read_address,
+   uint16_t read_quantity,
+   void * read_buffer,
+   mb_address_t write_address,
+   uint16_t write_quantity,
+   const void * write_buffer);
+
+/**
+ * Submit a read request
+ *
+ * This function sends a read request but does not wait for the
+ * response. The arguments are the same as for mbus_read(). The \a
+ * buffer must remain valid until the transaction has been completed
+ * by mbus_wait().
+ *
+ * Several requests may be in flight at the same time on a transport
+ * that carries a transaction ID (Modbus/TCP), up to the window given
+ * in mbus_cfg_t. Responses are matched to requests by transaction
+ * ID. If the window is full, this function blocks until a response
+ * has been received or a request has timed out.
+ *
+ * \code
+ * h1 = mbus_read_submit (mbus, slave, MB_ADDRESS (4, 1), 10, buffer1);
+ * h2 = mbus_read_submit (mbus, slave, MB_ADDRESS (4, 101), 10, buffer2);
+ * result1 = mbus_wait (mbus, h1);
+ * result2 = mbus_wait (mbus, h2);
+ * \endcode
+ *
+ * \param mbus          modbus handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to read
+ * \param buffer        output buffer
+ *
+ * \return transaction handle on success, error code otherwise
+ */
+MB_EXPORT int mbus_read_submit (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer);
+
+/**
+ * Submit a write request
+ *
+ * This function sends a write request but does not wait for the
+ * response. The arguments are the same as for mbus_write(). The
+ * contents of \a buffer are consumed before the function returns.
+ *
+ * See mbus_read_submit() for a description of pipelining.
+ *
+ * \param mbus          modbus handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to write
+ * \param buffer        input buffer
+ *
+ * \return transaction handle on success, error code otherwise
+ */
+MB_EXPORT int mbus_write_submit (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer);
+
+/**
+ * Wait for completion of a submitted transaction
+ *
+ * This function receives responses until the transaction given by \a
+ * handle has completed or timed out. Responses to other outstanding
+ * transactions that arrive in the meantime are also processed. The
+ * handle is released and must not be used again.
+ *
+ * \param mbus          modbus handle
+ * \param handle        transaction handle
+ *
+ * \return result of the transaction, as for mbus_read() or
+ *         mbus_write()
+ */
+MB_EXPORT int mbus_wait (mbus_t * mbus, int handle);
+
+/**
+ * Read modbus addresses asynchronously
+ *
+ * This function sends a read request and returns immediately. The
+ * arguments are the same as for mbus_read(). When the transaction
+ * completes or times out, \a callback is called with the result. The
+ * \a buffer must remain valid until then.
+ *
+ * The function does not block if the window is full, but returns
+ * EWINDOW_FULL. The caller should then call mbus_process() and try
+ * again.
+ *
+ * A single thread can drive many outstanding requests across many
+ * modbus instances, e.g. one instance per transport:
+ *
+ * \code
+ * for (i = 0; i < n; i++)
+ * {
+ *    mbus_read_async (mbus[i], slave[i], address, 10, buf[i], done, &ctx[i]);
+ * }
+ *
+ * do
+ * {
+ *    pending = 0;
+ *    for (i = 0; i < n; i++)
+ *    {
+ *       pending += mbus_process (mbus[i], 1);
+ *    }
+ * } while (pending > 0);
+ * \endcode
+ *
+ * \param mbus          modbus handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to read
+ * \param buffer        output buffer
+ * \param callback      completion callback
+ * \param arg           completion callback argument
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mbus_read_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Write modbus addresses asynchronously
+ *
+ * This function sends a write request and returns immediately. The
+ * arguments are the same as for mbus_write(). When the transaction
+ * completes or times out, \a callback is called with the result. The
+ * contents of \a buffer are consumed before the function returns.
+ *
+ * See mbus_read_async() for further details.
+ *
+ * \param mbus          modbus handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to write
+ * \param buffer        input buffer
+ * \param callback      completion callback
+ * \param arg           completion callback argument
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mbus_write_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Write a single modbus address asynchronously
+ *
+ * This function sends a write request and returns immediately. The
+ * arguments are the same as for mbus_write_single(). When the
+ * transaction completes or times out, \a callback is called with the
+ * result.
+ *
+ * See mbus_read_async() for further details.
+ *
+ * \param mbus          modbus handle
+ * \param address       1-based address to be written to
+ * \param value         the value to be written
+ * \param callback      completion callback
+ * \param arg           completion callback argument
+ *
+ * \return 0 on success, error code otherwise
+ */
+MB_EXPORT int mbus_write_single_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t value,
+   mbus_callback_t callback,
+   void * arg);
+
+/**
+ * Process outstanding requests
+ *
+ * This function receives at most one response, waiting at most \a
+ * tmo ms for it to arrive, and calls the completion callbacks of
+ * finished asynchronous requests. Requests that have not been
+ * answered within the configured timeout are completed with ETIMEOUT.
+ *
+ * A \a tmo of 0 is treated as 1 ms, since a zero timeout would wait
+ * forever on some transports.
+ *
+ * \param mbus          modbus handle
+ * \param tmo           max time to wait for a response [ms]
+ *
+ * \return number of requests still in flight
+ */
+MB_EXPORT int mbus_process (mbus_t * mbus, uint32_t tmo);
+
+/**
+ * Execute a batch of operations
+ *
+ * This function runs the reads and writes in \a ops in order and
+ * returns when all have completed. The result of each operation is
+ * stored in its \a result field, as for mbus_read() or mbus_write().
+ * A failed operation does not stop the batch.
+ *
+ * On a transport that carries a transaction ID (Modbus/TCP) the
+ * operations are pipelined, up to the window given in mbus_cfg_t. On
+ * other transports the operations are sent back to back.
+ *
+ * The duration of the batch can be read with mbus_cycle_time().
+ *
+ * \param mbus          modbus handle
+ * \param ops           operations
+ * \param num_ops       number of operations
+ *
+ * \return number of failed operations
+ */
+MB_EXPORT int mbus_execute_batch (
+   mbus_t * mbus,
+   mbus_op_t * ops,
+   size_t num_ops);
+
+/**
+ * Return the duration of the last batch
+ *
+ * \param mbus          modbus handle
+ *
+ * \return duration of last call to mbus_execute_batch() [us]
+ */
+MB_EXPORT uint32_t mbus_cycle_time (mbus_t * mbus);
+
 /**
  * Write a single modbus address
  *
@@ -0,0 +1,188 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/**
+ * \addtogroup mbus_cache Modbus master response cache
+ * \{
+ */
+
+#ifndef MBUS_CACHE_H
+#define MBUS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mbus.h"
+
+#include "mb_export.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/** Maximum time to live [ms] */
+#define MBUS_CACHE_MAX_TTL 3600000
+
+typedef struct mbus_cache_entry
+{
+   int slave;            /**< Slave handle */
+   mb_address_t address; /**< 1-based address */
+   uint32_t timestamp;   /**< Time of last update [us] */
+   uint16_t value;       /**< Register value, or 0/1 for bits */
+   uint32_t seq;         /**< Sequence number of last update */
+   bool valid;
+} mbus_cache_entry_t;
+
+typedef struct mbus_cache_cfg
+{
+   /**
+    * Time to live of cached values [ms], indexed by modbus table
+    * (0, 1, 3 and 4). A value of 0 disables caching for that table.
+    * Values larger than MBUS_CACHE_MAX_TTL are limited to
+    * MBUS_CACHE_MAX_TTL.
+    */
+   uint32_t ttl[5];
+
+   size_t size; /**< Number of addresses that can be cached */
+} mbus_cache_cfg_t;
+
+typedef struct mbus_cache
+{
+   uint32_t ttl[5];
+   mbus_cache_entry_t * entries;
+   size_t size;
+   uint32_t hits;    /**< Reads served from the cache */
+   uint32_t misses;  /**< Reads sent to the slave */
+   uint32_t seq;     /**< Incremented by each write and invalidation */
+   uint32_t cleared; /**< Sequence number of last clear */
+} mbus_cache_t;
+
+/**
+ * Create a response cache
+ *
+ * \param cfg           cache configuration
+ *
+ * \return cache handle
+ */
+MB_EXPORT mbus_cache_t * mbus_cache_create (const mbus_cache_cfg_t * cfg);
+
+/**
+ * Initialise a response cache
+ *
+ * \param cache         cache handle
+ * \param cfg           cache configuration
+ * \param entries       entry array (cfg->size entries)
+ */
+MB_EXPORT void mbus_cache_init (
+   mbus_cache_t * cache,
+   const mbus_cache_cfg_t * cfg,
+   mbus_cache_entry_t * entries);
+
+/**
+ * Attach a response cache to a modbus instance
+ *
+ * When a cache is attached, mbus_read() returns cached values without
+ * a bus transaction if all requested addresses are cached and younger
+ * than the time to live of their table. Values returned by successful
+ * reads are stored in the cache.
+ *
+ * Only mbus_read() is served from the cache. mbus_read_submit(),
+ * mbus_read_async(), mbus_read_range() and mbus_execute_batch() always
+ * read from the slave, but their responses are stored in the cache.
+ *
+ * Writes update the cached values when they are sent, so that
+ * subsequent reads return the written values. If the write fails,
+ * the written addresses are removed from the cache. A broadcast write
+ * clears the whole cache. A read response is not stored for addresses
+ * that were written, invalidated or cleared after the read was sent.
+ *
+ * The cache is keyed by slave handle and address. When the cache is
+ * full, the oldest of a small set of candidate entries is replaced.
+ *
+ * \param mbus          modbus handle
+ * \param cache         cache handle, or NULL to detach
+ */
+MB_EXPORT void mbus_cache_attach (mbus_t * mbus, mbus_cache_t * cache);
+
+/**
+ * Remove all values from the cache
+ *
+ * \param cache         cache handle
+ */
+MB_EXPORT void mbus_cache_clear (mbus_cache_t * cache);
+
+/**
+ * Read values from the cache
+ *
+ * The buffer format is the same as for mbus_read(). The buffer is
+ * not modified unless all addresses are found.
+ *
+ * \param cache         cache handle
+ * \param slave         slave handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to read
+ * \param buffer        output buffer
+ *
+ * \return 0 if all addresses were found, -1 otherwise
+ */
+MB_EXPORT int mbus_cache_read (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer);
+
+/**
+ * Store values in the cache
+ *
+ * The buffer format is the same as for mbus_read().
+ *
+ * \param cache         cache handle
+ * \param slave         slave handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to store
+ * \param buffer        input buffer
+ */
+MB_EXPORT void mbus_cache_store (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer);
+
+/**
+ * Remove values from the cache
+ *
+ * \param cache         cache handle
+ * \param slave         slave handle
+ * \param address       1-based starting address
+ * \param quantity      number of addresses to remove
+ */
+MB_EXPORT void mbus_cache_invalidate (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBUS_CACHE_H */
+
+/**
+ * \}
+ */
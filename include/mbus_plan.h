@@ -0,0 +1,128 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/**
+ * \addtogroup mbus_plan Modbus read planner
+ * \{
+ */
+
+#ifndef MBUS_PLAN_H
+#define MBUS_PLAN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mbus.h"
+
+#include "mb_export.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct mbus_tag
+{
+   mb_address_t address; /**< 1-based address, see MB_ADDRESS */
+   uint16_t quantity;    /**< Number of addresses, e.g. 2 for a float */
+   void * buffer;        /**< Output buffer, as for mbus_read() */
+   int result;           /**< Result of last read */
+} mbus_tag_t;
+
+typedef struct mbus_plan_cfg
+{
+   /**
+    * Cost of one additional request, expressed as bytes of response
+    * data. Two neighbouring tags are read with a single request if
+    * the unused addresses between them cost less to read than a new
+    * request. A register costs 2 bytes and 8 coils or inputs cost 1
+    * byte.
+    *
+    * The value should reflect the framing overhead and turnaround
+    * time of a round trip. On a serial line it is typically a few
+    * tens of bytes. A value of 0 never reads unused addresses.
+    */
+   uint16_t request_cost;
+} mbus_plan_cfg_t;
+
+typedef struct mbus_plan mbus_plan_t;
+
+/**
+ * Create a read plan
+ *
+ * This function sorts \a tags by address and merges them, in order,
+ * into read requests. A tag is added to the current request if the
+ * unused addresses before it cost less than a new request, as given
+ * by \a cfg, and a new request is started otherwise. This is a single
+ * greedy pass; the result is not guaranteed to be the smallest
+ * possible set of requests. Requests never exceed the maximum
+ * quantity of mbus_read(). Tags may be given in any order and may
+ * overlap.
+ *
+ * The \a tags array is owned by the caller and must remain valid for
+ * the lifetime of the plan.
+ *
+ * \param cfg           planner configuration
+ * \param tags          tags to read
+ * \param num_tags      number of tags
+ *
+ * \return plan handle, or NULL if a tag is invalid
+ */
+MB_EXPORT mbus_plan_t * mbus_plan_create (
+   const mbus_plan_cfg_t * cfg,
+   mbus_tag_t * tags,
+   size_t num_tags);
+
+/**
+ * Destroy a read plan
+ *
+ * \param plan          plan handle
+ */
+MB_EXPORT void mbus_plan_destroy (mbus_plan_t * plan);
+
+/**
+ * Return the number of read requests in the plan
+ *
+ * \param plan          plan handle
+ *
+ * \return number of requests
+ */
+MB_EXPORT size_t mbus_plan_num_requests (const mbus_plan_t * plan);
+
+/**
+ * Execute a read plan
+ *
+ * This function reads all requests in the plan from \a slave and
+ * copies the results to the buffer of each tag. Requests are
+ * pipelined if the transport allows it. The result of each tag is
+ * set to the result of the request that covers it.
+ *
+ * \param mbus          modbus handle
+ * \param slave         slave handle
+ * \param plan          plan handle
+ *
+ * \return 0 if all requests succeeded, error code of the first failed
+ *         request otherwise
+ */
+MB_EXPORT int mbus_plan_execute (mbus_t * mbus, int slave, mbus_plan_t * plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBUS_PLAN_H */
+
+/**
+ * \}
+ */
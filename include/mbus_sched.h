@@ -0,0 +1,133 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/**
+ * \addtogroup mbus_sched Modbus poll scheduler
+ * \{
+ */
+
+#ifndef MBUS_SCHED_H
+#define MBUS_SCHED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mbus.h"
+
+#include "mb_export.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Returned by mbus_sched_run_once() when there are no polls */
+#define MBUS_SCHED_IDLE UINT32_MAX
+
+typedef struct mbus_poll mbus_poll_t;
+
+struct mbus_poll
+{
+   int slave;            /**< Slave handle */
+   mb_address_t address; /**< 1-based starting address */
+   uint16_t quantity;    /**< Number of addresses to read */
+   void * buffer;        /**< Output buffer */
+   uint32_t period;      /**< Poll period [ms] */
+   uint8_t priority;     /**< Tie-break for equal deadlines, higher first */
+
+   /**
+    * Optional callback, called after each transaction. The \a late
+    * flag in \a poll is set if the transaction completed after its
+    * deadline.
+    *
+    * \param poll          poll entry
+    * \param result        result of mbus_read()
+    */
+   void (*callback) (mbus_poll_t * poll, int result);
+   void * arg; /**< User argument */
+
+   /* Managed by the scheduler */
+   uint32_t release; /**< Start of current period [us] */
+   uint32_t missed;  /**< Number of missed deadlines */
+   bool late;        /**< Last transaction missed its deadline */
+};
+
+typedef struct mbus_sched
+{
+   mbus_t * mbus;
+   mbus_poll_t * polls;
+   size_t num_polls;
+} mbus_sched_t;
+
+/**
+ * Initialise a poll scheduler
+ *
+ * The scheduler runs the reads in \a polls periodically on the given
+ * modbus instance. The deadline of each read is the end of its
+ * current period. Of the reads that have been released, the read
+ * with the earliest deadline is run first (earliest deadline first).
+ *
+ * Reads are run back to back while any read is due, so on an RTU bus
+ * the only gap between frames is the mandatory T3.5 silent interval.
+ * A read that completes after its deadline is counted as missed. If
+ * the scheduler falls more than one period behind, the skipped
+ * periods are also counted as missed.
+ *
+ * All reads are released immediately.
+ *
+ * \param sched         scheduler
+ * \param mbus          modbus handle
+ * \param polls         poll list, owned by the caller
+ * \param num_polls     number of entries in poll list
+ */
+MB_EXPORT void mbus_sched_init (
+   mbus_sched_t * sched,
+   mbus_t * mbus,
+   mbus_poll_t * polls,
+   size_t num_polls);
+
+/**
+ * Run the most urgent read
+ *
+ * This function runs the released read with the earliest deadline,
+ * if any. The application should call this function in a loop,
+ * sleeping for the returned time when it is non-zero:
+ *
+ * \code
+ * for (;;)
+ * {
+ *    uint32_t delay = mbus_sched_run_once (&sched);
+ *    if (delay == MBUS_SCHED_IDLE)
+ *       break;
+ *    if (delay > 0)
+ *       os_usleep (delay);
+ * }
+ * \endcode
+ *
+ * \param sched         scheduler
+ *
+ * \return 0 if a read was run, MBUS_SCHED_IDLE if there are no polls,
+ *         otherwise the time until the next read is released [us]
+ */
+MB_EXPORT uint32_t mbus_sched_run_once (mbus_sched_t * sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBUS_SCHED_H */
+
+/**
+ * \}
+ */
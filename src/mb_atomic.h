@@ -0,0 +1,81 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2011 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#ifndef MB_ATOMIC_H
+#define MB_ATOMIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Minimal atomic operations on 32-bit words, mapped to compiler
+   builtins. Loads acquire and stores release unless noted. */
+
+#if defined(__GNUC__) || defined(__clang__)
+
+#define mb_atomic_load(p)         __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define mb_atomic_load_relaxed(p) __atomic_load_n (p, __ATOMIC_RELAXED)
+#define mb_atomic_store(p, v)     __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define mb_atomic_fence_acquire() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define mb_atomic_fence_release() __atomic_thread_fence (__ATOMIC_RELEASE)
+#define mb_atomic_inc(p)          __atomic_fetch_add (p, 1, __ATOMIC_RELAXED)
+
+static inline int mb_atomic_cas (
+   volatile uint32_t * p,
+   uint32_t expected,
+   uint32_t desired)
+{
+   return __atomic_compare_exchange_n (
+      p,
+      &expected,
+      desired,
+      0,
+      __ATOMIC_ACQUIRE,
+      __ATOMIC_RELAXED);
+}
+
+#elif defined(_MSC_VER)
+
+#include <intrin.h>
+
+/* Volatile accesses have acquire/release semantics with /volatile:ms,
+   which is the default on x86 and x64 */
+#define mb_atomic_load(p)         (*(p))
+#define mb_atomic_load_relaxed(p) (*(p))
+#define mb_atomic_store(p, v)     (*(p) = (v))
+#define mb_atomic_fence_acquire() _ReadWriteBarrier()
+#define mb_atomic_fence_release() _ReadWriteBarrier()
+#define mb_atomic_inc(p)          _InterlockedIncrement ((volatile long *)(p))
+
+static __inline int mb_atomic_cas (
+   volatile uint32_t * p,
+   uint32_t expected,
+   uint32_t desired)
+{
+   return _InterlockedCompareExchange ((volatile long *)p, desired, expected) ==
+          (long)expected;
+}
+
+#else
+#error "Atomic operations not available for this compiler"
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_ATOMIC_H */
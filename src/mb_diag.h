@@ -0,0 +1,40 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2011 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#ifndef MB_DIAG_H
+#define MB_DIAG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mb_transport.h"
+#include "mb_atomic.h"
+
+#include <stddef.h>
+
+/* Count an event. The counters are only read for diagnostics, so no
+   ordering is needed. */
+static inline void mb_diag_count (mb_diag_t * diag, mb_diag_counter_t counter)
+{
+   if (diag != NULL)
+      mb_atomic_inc (&diag->counter[counter]);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_DIAG_H */
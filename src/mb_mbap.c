@@ -0,0 +1,143 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_mbap.h"
+
+#include <string.h>
+
+size_t mb_mbap_encode (
+   mbap_t * mbap,
+   const pdu_txn_t * transaction,
+   size_t size)
+{
+   mbap->id       = CC_TO_BE16 (transaction->id);
+   mbap->length   = CC_TO_BE16 ((uint16_t)size + 1); /* Includes unit id */
+   mbap->protocol = 0;
+   mbap->unit     = transaction->unit;
+
+   if (mbap->data != transaction->data)
+      memcpy (mbap->data, transaction->data, size);
+
+   return MBAP_HEADER_SIZE + size;
+}
+
+void mb_mbap_rx_reset (mb_mbap_rx_t * rx)
+{
+   rx->count = 0;
+}
+
+size_t mb_mbap_rx_pdu_size (const mb_mbap_rx_t * rx)
+{
+   /* The length includes the unit id, which is part of the header */
+   return CC_FROM_BE16 (rx->frame.length) - 1;
+}
+
+size_t mb_mbap_rx_needed (const mb_mbap_rx_t * rx)
+{
+   if (rx->count < MBAP_HEADER_SIZE)
+      return MBAP_HEADER_SIZE - rx->count;
+
+   return MBAP_HEADER_SIZE + mb_mbap_rx_pdu_size (rx) - rx->count;
+}
+
+void * mb_mbap_rx_next (mb_mbap_rx_t * rx)
+{
+   return (uint8_t *)&rx->frame + rx->count;
+}
+
+int mb_mbap_rx_commit (mb_mbap_rx_t * rx, size_t count)
+{
+   bool had_header = rx->count >= MBAP_HEADER_SIZE;
+
+   rx->count += count;
+
+   if (rx->count < MBAP_HEADER_SIZE)
+      return 0;
+
+   if (!had_header)
+   {
+      uint16_t length = CC_FROM_BE16 (rx->frame.length);
+
+      /* Reject frames that do not fit, or that lack a function code */
+      if (rx->frame.protocol != 0 || length < 2 || length > MAX_PDU_SIZE + 1)
+         return -1;
+   }
+
+   return (mb_mbap_rx_needed (rx) == 0) ? 1 : 0;
+}
+
+void mb_mbap_buffer_reset (mb_mbap_buffer_t * buffer)
+{
+   buffer->head = 0;
+   buffer->tail = 0;
+}
+
+bool mb_mbap_buffer_is_empty (const mb_mbap_buffer_t * buffer)
+{
+   return buffer->head == buffer->tail;
+}
+
+size_t mb_mbap_buffer_space (mb_mbap_buffer_t * buffer)
+{
+   size_t count = buffer->tail - buffer->head;
+
+   /* Move an incomplete frame to the start of the buffer. It is
+      shorter than a frame, so this is rare and cheap. */
+   if (buffer->head > 0)
+   {
+      memmove (buffer->data, buffer->data + buffer->head, count);
+      buffer->head = 0;
+      buffer->tail = count;
+   }
+
+   return sizeof (buffer->data) - buffer->tail;
+}
+
+void * mb_mbap_buffer_next (mb_mbap_buffer_t * buffer)
+{
+   return buffer->data + buffer->tail;
+}
+
+void mb_mbap_buffer_commit (mb_mbap_buffer_t * buffer, size_t count)
+{
+   buffer->tail += count;
+}
+
+int mb_mbap_buffer_frame (mb_mbap_buffer_t * buffer, const mbap_t ** frame)
+{
+   size_t count = buffer->tail - buffer->head;
+   const mbap_t * mbap = (const mbap_t *)(buffer->data + buffer->head);
+   uint16_t length;
+
+   if (count < MBAP_HEADER_SIZE)
+      return 0;
+
+   *frame = mbap;
+
+   /* Reject frames that do not fit, or that lack a function code. The
+      length includes the unit id, which is part of the header. */
+   length = CC_FROM_BE16 (mbap->length);
+   if (length < 2 || length > MAX_PDU_SIZE + 1)
+      return -1;
+
+   if (count < MBAP_HEADER_SIZE + length - 1)
+      return 0;
+
+   buffer->head += MBAP_HEADER_SIZE + length - 1;
+   if (buffer->head == buffer->tail)
+      mb_mbap_buffer_reset (buffer);
+
+   return 1;
+}
@@ -0,0 +1,186 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#ifndef MB_MBAP_H
+#define MB_MBAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mb_pdu.h"
+#include "mb_transport.h"
+#include "osal.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mbap
+{
+   uint16_t id;
+   uint16_t protocol;
+   uint16_t length;
+   uint8_t unit;
+   uint8_t data[MAX_PDU_SIZE];
+} CC_PACKED mbap_t;
+
+#define MBAP_HEADER_SIZE offsetof (mbap_t, data)
+
+/* Reassembly of MBAP frames from a byte stream */
+typedef struct mb_mbap_rx
+{
+   mbap_t frame;
+   size_t count;
+} mb_mbap_rx_t;
+
+/* Size of the stream buffer. Holds a few frames of maximum size, and
+   many more of the short frames that are typical. */
+#define MBAP_BUFFER_SIZE (4 * sizeof (mbap_t))
+
+/* Buffered reception of MBAP frames from a byte stream. Bytes are
+   received in large chunks and parsed into as many frames as they
+   hold. The buffer is linear, so that frames are always contiguous;
+   an incomplete frame is moved to the start when more space is
+   needed. */
+typedef struct mb_mbap_buffer
+{
+   uint8_t data[MBAP_BUFFER_SIZE];
+   size_t head; /* Start of bytes not yet parsed */
+   size_t tail; /* End of received bytes */
+} mb_mbap_buffer_t;
+
+/**
+ * Encode an MBAP frame
+ *
+ * \param mbap          frame
+ * \param transaction   transaction ID, unit and PDU
+ * \param size          size of PDU
+ *
+ * \return size of frame
+ */
+size_t mb_mbap_encode (
+   mbap_t * mbap,
+   const pdu_txn_t * transaction,
+   size_t size);
+
+/**
+ * Reset frame reassembly
+ *
+ * \param rx            reassembly state
+ */
+void mb_mbap_rx_reset (mb_mbap_rx_t * rx);
+
+/**
+ * Return the number of bytes needed to complete the header, or the
+ * frame if the header is complete. The bytes should be received to
+ * the address returned by mb_mbap_rx_next().
+ *
+ * \param rx            reassembly state
+ *
+ * \return number of bytes needed
+ */
+size_t mb_mbap_rx_needed (const mb_mbap_rx_t * rx);
+
+/**
+ * Return the address where the next byte should be received
+ *
+ * \param rx            reassembly state
+ *
+ * \return receive address
+ */
+void * mb_mbap_rx_next (mb_mbap_rx_t * rx);
+
+/**
+ * Add received bytes to the frame
+ *
+ * \param rx            reassembly state
+ * \param count         number of bytes received
+ *
+ * \return 1 if the frame is complete, 0 if more bytes are needed, or
+ *         -1 if the header is invalid
+ */
+int mb_mbap_rx_commit (mb_mbap_rx_t * rx, size_t count);
+
+/**
+ * Return the size of the PDU in a complete frame
+ *
+ * \param rx            reassembly state
+ *
+ * \return size of PDU
+ */
+size_t mb_mbap_rx_pdu_size (const mb_mbap_rx_t * rx);
+
+/**
+ * Discard all buffered bytes
+ *
+ * \param buffer        stream buffer
+ */
+void mb_mbap_buffer_reset (mb_mbap_buffer_t * buffer);
+
+/**
+ * Return true if the buffer holds no bytes that have not been parsed
+ *
+ * \param buffer        stream buffer
+ *
+ * \return true if empty
+ */
+bool mb_mbap_buffer_is_empty (const mb_mbap_buffer_t * buffer);
+
+/**
+ * Return the number of bytes that can be received to the address
+ * returned by mb_mbap_buffer_next(). This may move buffered bytes,
+ * invalidating frames returned by mb_mbap_buffer_frame().
+ *
+ * \param buffer        stream buffer
+ *
+ * \return number of bytes that fit in the buffer
+ */
+size_t mb_mbap_buffer_space (mb_mbap_buffer_t * buffer);
+
+/**
+ * Return the address where the next byte should be received
+ *
+ * \param buffer        stream buffer
+ *
+ * \return receive address
+ */
+void * mb_mbap_buffer_next (mb_mbap_buffer_t * buffer);
+
+/**
+ * Add received bytes to the buffer
+ *
+ * \param buffer        stream buffer
+ * \param count         number of bytes received
+ */
+void mb_mbap_buffer_commit (mb_mbap_buffer_t * buffer, size_t count);
+
+/**
+ * Get the next complete frame from the buffer. The frame is consumed,
+ * and stays valid until mb_mbap_buffer_space() is called. The protocol
+ * identifier is not checked.
+ *
+ * \param buffer        stream buffer
+ * \param frame         set to the frame, or to the header if invalid
+ *
+ * \return 1 if a frame was returned, 0 if more bytes are needed, or
+ *         -1 if the length in the header is invalid
+ */
+int mb_mbap_buffer_frame (mb_mbap_buffer_t * buffer, const mbap_t ** frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_MBAP_H */
@@ -20,10 +20,14 @@
 extern "C" {
 #endif
 
+#include "mb_transport.h"
 #include "osal.h"
 
 #define MAX_PDU_SIZE 253
 
+/* Size of a PDU buffer with headroom, see PDU_TXN_HEADROOM */
+#define PDU_BUFFER_SIZE (PDU_HEADROOM + MAX_PDU_SIZE + PDU_TAILROOM)
+
 /* PDU function codes */
 #define PDU_READ_COILS                   1
 #define PDU_READ_INPUTS                  2
@@ -34,10 +38,19 @@ extern "C" {
 #define PDU_DIAGNOSTICS                  8
 #define PDU_WRITE_COILS                  15
 #define PDU_WRITE_HOLDING_REGISTERS      16
+#define PDU_MASK_WRITE_HOLDING_REGISTER  22
 #define PDU_READ_WRITE_HOLDING_REGISTERS 23
 
 /* Diagnostic sub-functions */
-#define PDU_DIAG_LOOPBACK 0
+#define PDU_DIAG_LOOPBACK       0
+#define PDU_DIAG_CLEAR_COUNTERS 10
+#define PDU_DIAG_BUS_MESSAGES   11
+#define PDU_DIAG_BUS_ERRORS     12
+#define PDU_DIAG_EXCEPTIONS     13
+#define PDU_DIAG_SLAVE_MESSAGES 14
+#define PDU_DIAG_NO_RESPONSES   15
+#define PDU_DIAG_OVERRUNS       18
+#define PDU_DIAG_CLEAR_OVERRUNS 20
 
 typedef struct pdu_exception
 {
@@ -109,6 +122,20 @@ CC_PACKED_END
 
 CC_STATIC_ASSERT (sizeof (pdu_write_response_t) == 5);
 
+CC_PACKED_BEGIN
+typedef struct pdu_mask_write
+{
+   uint8_t function;
+   uint16_t address;
+   uint16_t and_mask;
+   uint16_t or_mask;
+} CC_PACKED pdu_mask_write_t;
+CC_PACKED_END
+
+CC_STATIC_ASSERT (sizeof (pdu_mask_write_t) == 7);
+
+typedef pdu_mask_write_t pdu_mask_write_response_t;
+
 CC_PACKED_BEGIN
 typedef struct pdu_read_write
 {
@@ -152,6 +179,7 @@ typedef union
    pdu_write_single_response_t write_single_response;
    pdu_write_t write;
    pdu_write_response_t write_response;
+   pdu_mask_write_t mask_write;
    pdu_read_write_t read_write;
    pdu_diag_t diag;
    pdu_vendor_t vendor;
@@ -16,6 +16,7 @@
 #include "mb_rtu.h"
 #include "mb_pdu.h"
 #include "mb_crc.h"
+#include "mb_diag.h"
 #include "mbal_rtu.h"
 #include "options.h"
 
@@ -23,6 +24,7 @@
 #include "osal_log.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #if defined(__linux__) && defined (USE_TRACE)
@@ -35,6 +37,7 @@
 #define FLAG_RX_AVAIL BIT (1)
 #define FLAG_T1P5     BIT (2)
 #define FLAG_T3P5     BIT (3)
+#define FLAG_WAKEUP   BIT (4)
 
 struct mb_rtu /* Typedef in mb_rtu.h */
 {
@@ -50,6 +53,7 @@ struct mb_rtu /* Typedef in mb_rtu.h */
       void * arg);
    bool broadcast;
    uint32_t char_time_us;
+   uint8_t adu[1 + MAX_PDU_SIZE + sizeof (crc_t)]; /**< If no headroom */
 };
 
 int mb_tx_hook (void * arg, void * data)
@@ -184,28 +188,35 @@ static void mb_rtu_tx (
    mb_rtu_t * rtu = (mb_rtu_t *)transport;
    uint32_t flags;
    crc_t crc;
-   uint8_t slave = transaction->unit;
+   uint8_t * adu;
 
    tracepoint (mb, tx_trace, 1);
    mb_rtu_dump ("Tx:\n", transaction->data, size);
 
-   /* Compute CRC */
-   crc = mb_crc (&slave, 1, 0xFFFF);
-   crc = mb_crc (transaction->data, (uint8_t)size, crc);
+   /* Build the ADU around the PDU if there is room, otherwise in the
+      transmit buffer */
+   if (transaction->flags & PDU_TXN_HEADROOM)
+   {
+      adu = (uint8_t *)transaction->data - 1;
+   }
+   else
+   {
+      adu = rtu->adu;
+      memcpy (adu + 1, transaction->data, size);
+   }
+
+   /* Slave address, PDU and CRC */
+   adu[0] = transaction->unit;
+   crc    = mb_crc (adu, (uint8_t)(size + 1), 0xFFFF);
+   memcpy (adu + 1 + size, &crc, sizeof (crc));
 
    /* Enable Tx */
    if (rtu->tx_enable)
       rtu->tx_enable (1);
 
-   /* Send slave address */
-   mb_rtu_write (rtu, &slave, 1);
-
-   /* Send PDU */
+   /* Send ADU */
    os_event_clr (rtu->flags, FLAG_TX_EMPTY);
-   mb_rtu_write (rtu, transaction->data, size);
-
-   /* Send CRC */
-   mb_rtu_write (rtu, &crc, sizeof (crc_t));
+   mb_rtu_write (rtu, adu, 1 + size + sizeof (crc));
    tracepoint (mb, tx_trace, 2);
 
    /* Wait for emission of last character */
@@ -241,6 +252,12 @@ static bool mb_rtu_rx_avail (mb_transport_t * transport)
    return navail > 0;
 }
 
+static void mb_rtu_wakeup (mb_transport_t * transport)
+{
+   mb_rtu_t * rtu = (mb_rtu_t *)transport;
+   os_event_set (rtu->flags, FLAG_WAKEUP);
+}
+
 static int mb_rtu_rx (
    mb_transport_t * transport,
    pdu_txn_t * transaction,
@@ -248,6 +265,7 @@ static int mb_rtu_rx (
 {
    mb_rtu_t * rtu = (mb_rtu_t *)transport;
    bool frame_ok  = true;
+   bool overrun   = false;
    size_t count   = 0;
    uint32_t flags;
    crc_t crc;
@@ -262,8 +280,11 @@ static int mb_rtu_rx (
    {
       int timedout;
 
-      timedout =
-         os_event_wait (rtu->flags, FLAG_T1P5 | FLAG_RX_AVAIL, &flags, tmo);
+      timedout = os_event_wait (
+         rtu->flags,
+         FLAG_T1P5 | FLAG_RX_AVAIL | FLAG_WAKEUP,
+         &flags,
+         tmo);
       if (timedout)
       {
          tracepoint (mb, rx_trace, 2);
@@ -274,11 +295,18 @@ static int mb_rtu_rx (
    {
       os_event_wait (
          rtu->flags,
-         FLAG_T1P5 | FLAG_RX_AVAIL,
+         FLAG_T1P5 | FLAG_RX_AVAIL | FLAG_WAKEUP,
          &flags,
          OS_WAIT_FOREVER);
    }
 
+   /* Woken up, return as on timeout unless a frame is arriving */
+   if ((flags & (FLAG_T1P5 | FLAG_RX_AVAIL)) == 0)
+   {
+      os_event_clr (rtu->flags, FLAG_WAKEUP);
+      return ETIMEOUT;
+   }
+
    /* Get slave ID */
    mb_rtu_read (rtu, &slave_rx, 1);
    crc = mb_crc (&slave_rx, 1, 0xFFFF);
@@ -293,7 +321,15 @@ static int mb_rtu_rx (
          FLAG_T1P5 | FLAG_RX_AVAIL,
          &flags,
          OS_WAIT_FOREVER);
-      if (flags & FLAG_RX_AVAIL)
+      if ((flags & FLAG_RX_AVAIL) && count == MAX_PDU_SIZE)
+      {
+         uint8_t discard[16];
+
+         /* Buffer is full, drop the remainder of the frame */
+         mb_rtu_read (rtu, discard, sizeof (discard));
+         overrun = true;
+      }
+      else if (flags & FLAG_RX_AVAIL)
       {
          nread = mb_rtu_read (rtu, p, MAX_PDU_SIZE - count);
          p += nread;
@@ -301,16 +337,29 @@ static int mb_rtu_rx (
       }
    } while ((flags & FLAG_T1P5) == 0);
 
+   mb_diag_count (&transport->diag, MB_DIAG_BUS_MESSAGES);
+
    /* Verify message */
    crc = mb_crc (transaction->data, (uint8_t)count, crc);
-   if (crc != 0)
+   if (overrun)
+   {
+      mb_diag_count (&transport->diag, MB_DIAG_OVERRUNS);
+      error    = EFRAME_NOK;
+      frame_ok = false;
+   }
+   else if (crc != 0)
    {
+      mb_diag_count (&transport->diag, MB_DIAG_BUS_ERRORS);
       error    = ECRC_FAIL;
       frame_ok = false;
    }
 
    /* Match station ID with our ID or the broadcast ID */
-   if ((slave_rx != transaction->unit) && (slave_rx != 0))
+   if (transaction->flags & PDU_TXN_ANY_UNIT)
+   {
+      transaction->unit = slave_rx;
+   }
+   else if ((slave_rx != transaction->unit) && (slave_rx != 0))
    {
       error    = ESLAVE_ID;
       frame_ok = false;
@@ -423,6 +472,10 @@ mb_transport_t * mb_rtu_init (const mb_rtu_cfg_t * cfg)
    rtu->transport.rx       = mb_rtu_rx;
    rtu->transport.rx_is_bc = mb_rtu_rx_bc;
    rtu->transport.rx_avail = mb_rtu_rx_avail;
+   rtu->transport.wakeup   = mb_rtu_wakeup;
+
+   rtu->transport.has_txn_id = false;
+   memset (&rtu->transport.diag, 0, sizeof (rtu->transport.diag));
 
    rtu->tx_enable = cfg->tx_enable;
    rtu->tmr_init  = cfg->tmr_init;
@@ -21,16 +21,21 @@
 #endif
 
 #include "mb_slave.h"
+#include "mb_slave_internal.h"
 #include "mb_transport.h"
 #include "mb_pdu.h"
 #include "mb_crc.h"
+#include "mb_atomic.h"
+#include "mb_diag.h"
 #include "osal.h"
 
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 
-#define PDU_TIMEOUT 5000 /* Timeout for rx retries (ticks) */
+/* Timeout for rx retries (ticks). Only needed for transports that
+   can not be woken up. */
+#define PDU_TIMEOUT 5000
 
 int mb_slave_bit_get (void * data, uint32_t address)
 {
@@ -67,6 +72,289 @@ void mb_slave_reg_set (void * data, uint32_t address, uint16_t value)
    p[1] = value & 0xFF;
 }
 
+void mb_seqlock_init (mb_seqlock_t * lock)
+{
+   lock->sequence = 0;
+}
+
+void mb_seqlock_write_begin (mb_seqlock_t * lock)
+{
+   uint32_t sequence;
+
+   /* Make the sequence odd, unless another writer already has */
+   for (;;)
+   {
+      sequence = mb_atomic_load_relaxed (&lock->sequence);
+      if ((sequence & 1) == 0 &&
+          mb_atomic_cas (&lock->sequence, sequence, sequence + 1))
+         break;
+   }
+
+   /* Order the sequence update before the data updates */
+   mb_atomic_fence_release();
+}
+
+void mb_seqlock_write_end (mb_seqlock_t * lock)
+{
+   uint32_t sequence = mb_atomic_load_relaxed (&lock->sequence);
+
+   mb_atomic_store (&lock->sequence, sequence + 1);
+}
+
+uint32_t mb_seqlock_read_begin (const mb_seqlock_t * lock)
+{
+   uint32_t sequence;
+
+   /* Wait for a write in progress to finish */
+   do
+   {
+      sequence = mb_atomic_load (&lock->sequence);
+   } while (sequence & 1);
+
+   return sequence;
+}
+
+bool mb_seqlock_read_retry (const mb_seqlock_t * lock, uint32_t sequence)
+{
+   /* Order the data reads before the sequence check */
+   mb_atomic_fence_acquire();
+   return mb_atomic_load_relaxed (&lock->sequence) != sequence;
+}
+
+/* Copy quantity bits starting at bit address in image to data,
+   starting at bit 0. Bits past quantity in the last byte of data are
+   undefined. */
+static void mb_slave_image_get_bits (
+   const uint8_t * image,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   const uint8_t * src = image + address / 8;
+   unsigned int shift = address % 8;
+   size_t count = (quantity + 7) / 8;
+   size_t ix;
+
+   if (shift == 0)
+   {
+      memcpy (data, src, count);
+      return;
+   }
+
+   for (ix = 0; ix < count; ix++)
+   {
+      uint8_t value = src[ix] >> shift;
+
+      /* Never read past the last byte of the range */
+      if (8 * ix + 8 - shift < quantity)
+         value |= src[ix + 1] << (8 - shift);
+
+      data[ix] = value;
+   }
+}
+
+/* Copy quantity bits from data, starting at bit 0, to image starting
+   at bit address. Other bits in image are left unchanged. */
+static void mb_slave_image_set_bits (
+   uint8_t * image,
+   uint16_t address,
+   const uint8_t * data,
+   uint16_t quantity)
+{
+   uint8_t * dst = image + address / 8;
+   unsigned int shift = address % 8;
+   uint32_t remain = quantity;
+   size_t ix;
+
+   for (ix = 0; remain > 0; ix++)
+   {
+      uint32_t n = (remain < 8) ? remain : 8;
+      uint32_t mask = (BIT (n) - 1) << shift;
+      uint32_t value = (uint32_t)data[ix] << shift;
+
+      dst[ix] = (dst[ix] & ~mask) | (value & mask);
+
+      /* Source byte straddles two image bytes */
+      mask >>= 8;
+      if (mask != 0)
+         dst[ix + 1] = (dst[ix + 1] & ~mask) | ((value >> 8) & mask);
+
+      remain -= n;
+   }
+}
+
+static void mb_slave_image_get_registers (
+   const uint16_t * image,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   uint16_t ix;
+
+   for (ix = 0; ix < quantity; ix++)
+   {
+      uint16_t value = CC_TO_BE16 (image[address + ix]);
+      memcpy (data + 2 * ix, &value, sizeof (value));
+   }
+}
+
+static void mb_slave_image_set_registers (
+   uint16_t * image,
+   uint16_t address,
+   const uint8_t * data,
+   uint16_t quantity)
+{
+   uint16_t ix;
+
+   for (ix = 0; ix < quantity; ix++)
+   {
+      uint16_t value;
+
+      memcpy (&value, data + 2 * ix, sizeof (value));
+      image[address + ix] = CC_FROM_BE16 (value);
+   }
+}
+
+/* Find the table serving quantity addresses from *address, and make
+   *address relative to it. Returns NULL if the addresses are not all
+   in the table. */
+static const mb_iotable_t * mb_slave_iotable_find (
+   const mb_iotable_t * iotable,
+   uint16_t * address,
+   uint16_t quantity)
+{
+   const mb_iosegment_t * segment;
+   size_t low = 0;
+   size_t high = iotable->num_segments;
+   uint16_t offset;
+
+   if (iotable->segments == NULL)
+   {
+      if (*address + quantity > iotable->size)
+         return NULL;
+
+      return iotable;
+   }
+
+   /* Find the last segment starting at or below address */
+   while (low < high)
+   {
+      size_t mid = low + (high - low) / 2;
+
+      if (iotable->segments[mid].base <= *address)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   if (low == 0)
+      return NULL;
+
+   segment = &iotable->segments[low - 1];
+   offset = *address - segment->base;
+   if (offset + quantity > segment->table.size)
+      return NULL;
+
+   *address = offset;
+   return &segment->table;
+}
+
+static bool mb_slave_can_get (const mb_iotable_t * iotable)
+{
+   return iotable->image != NULL || iotable->get != NULL;
+}
+
+static bool mb_slave_can_set (const mb_iotable_t * iotable)
+{
+   return iotable->image != NULL || iotable->set != NULL;
+}
+
+static int mb_slave_get_bits (
+   const mb_iotable_t * iotable,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   uint32_t sequence = 0;
+
+   if (iotable->image == NULL)
+      return iotable->get (address, data, quantity);
+
+   do
+   {
+      if (iotable->lock != NULL)
+         sequence = mb_seqlock_read_begin (iotable->lock);
+
+      mb_slave_image_get_bits (iotable->image, address, data, quantity);
+   } while (iotable->lock != NULL &&
+            mb_seqlock_read_retry (iotable->lock, sequence));
+
+   return 0;
+}
+
+static int mb_slave_set_bits (
+   const mb_iotable_t * iotable,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   if (iotable->image == NULL)
+      return iotable->set (address, data, quantity);
+
+   if (iotable->lock != NULL)
+      mb_seqlock_write_begin (iotable->lock);
+
+   mb_slave_image_set_bits (iotable->image, address, data, quantity);
+
+   if (iotable->lock != NULL)
+      mb_seqlock_write_end (iotable->lock);
+
+   return 0;
+}
+
+static int mb_slave_get_registers (
+   const mb_iotable_t * iotable,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   uint32_t sequence = 0;
+
+   if (iotable->image == NULL)
+      return iotable->get (address, data, quantity);
+
+   do
+   {
+      if (iotable->lock != NULL)
+         sequence = mb_seqlock_read_begin (iotable->lock);
+
+      mb_slave_image_get_registers (iotable->image, address, data, quantity);
+   } while (iotable->lock != NULL &&
+            mb_seqlock_read_retry (iotable->lock, sequence));
+
+   return 0;
+}
+
+static int mb_slave_set_registers (
+   const mb_iotable_t * iotable,
+   uint16_t address,
+   uint8_t * data,
+   uint16_t quantity)
+{
+   if (iotable->image == NULL)
+      return iotable->set (address, data, quantity);
+
+   if (iotable->lock != NULL)
+      mb_seqlock_write_begin (iotable->lock);
+
+   mb_slave_image_set_registers (iotable->image, address, data, quantity);
+
+   if (iotable->lock != NULL)
+      mb_seqlock_write_end (iotable->lock);
+
+   return 0;
+}
+
 static int mb_slave_read_bits (
    mb_transport_t * transport,
    const mb_iotable_t * iotable,
@@ -91,16 +379,17 @@ static int mb_slave_read_bits (
    if (quantity == 0 || quantity > 0x7D0)
       return EILLEGAL_DATA_VALUE;
 
-   if (address + quantity > iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, quantity);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
-   if (iotable->get == NULL)
+   if (!mb_slave_can_get (iotable))
       return EILLEGAL_FUNCTION;
 
    /* Build response */
    response->count = count;
 
-   error = iotable->get (address, pData, quantity);
+   error = mb_slave_get_bits (iotable, address, pData, quantity);
    if (error)
       return error;
 
@@ -131,16 +420,17 @@ static int mb_slave_read_registers (
    if (quantity == 0 || quantity > 0x7D)
       return EILLEGAL_DATA_VALUE;
 
-   if (address + quantity > iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, quantity);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
-   if (iotable->get == NULL)
+   if (!mb_slave_can_get (iotable))
       return EILLEGAL_FUNCTION;
 
    /* Build response */
    response->count = 2 * quantity;
 
-   error = iotable->get (address, pData, quantity);
+   error = mb_slave_get_registers (iotable, address, pData, quantity);
    if (error)
       return error;
 
@@ -164,15 +454,16 @@ static int mb_slave_write_bit (
    if (value != 0 && value != 0xFF00)
       return EILLEGAL_DATA_VALUE;
 
-   if (address >= iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, 1);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
-   if (iotable->set == NULL)
+   if (!mb_slave_can_set (iotable))
       return EILLEGAL_FUNCTION;
 
    bit = (value == 0xFF00) ? 1 : 0;
 
-   error = iotable->set (address, &bit, 1);
+   error = mb_slave_set_bits (iotable, address, &bit, 1);
    if (error)
       return error;
 
@@ -206,16 +497,17 @@ static int mb_slave_write_bits (
    if (count != request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (address + quantity > iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, quantity);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
    if (rx_count != sizeof (*request) + request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (iotable->set == NULL)
+   if (!mb_slave_can_set (iotable))
       return EILLEGAL_FUNCTION;
 
-   error = iotable->set (address, pData, quantity);
+   error = mb_slave_set_bits (iotable, address, pData, quantity);
    if (error)
       return error;
 
@@ -234,13 +526,18 @@ static int mb_slave_write_register (
 
    address = CC_FROM_BE16 (request->address);
 
-   if (address >= iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, 1);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
-   if (iotable->set == NULL)
+   if (!mb_slave_can_set (iotable))
       return EILLEGAL_FUNCTION;
 
-   error = iotable->set (address, (uint8_t *)&request->value, 1);
+   error = mb_slave_set_registers (
+      iotable,
+      address,
+      (uint8_t *)&request->value,
+      1);
    if (error)
       return error;
 
@@ -269,16 +566,17 @@ static int mb_slave_write_registers (
    if (2 * quantity != request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (address + quantity > iotable->size)
+   iotable = mb_slave_iotable_find (iotable, &address, quantity);
+   if (iotable == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
    if (rx_count != sizeof (*request) + request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (iotable->set == NULL)
+   if (!mb_slave_can_set (iotable))
       return EILLEGAL_FUNCTION;
 
-   error = iotable->set (address, pData, quantity);
+   error = mb_slave_set_registers (iotable, address, pData, quantity);
    if (error)
       return error;
 
@@ -286,6 +584,62 @@ static int mb_slave_write_registers (
    return sizeof (pdu_write_response_t);
 }
 
+static int mb_slave_mask_write_register (
+   mb_transport_t * transport,
+   const mb_iotable_t * iotable,
+   pdu_t * pdu)
+{
+   pdu_mask_write_t * request = &pdu->mask_write;
+   uint16_t address;
+   uint16_t and_mask;
+   uint16_t or_mask;
+   uint16_t value;
+   uint8_t data[2];
+   int error;
+
+   address = CC_FROM_BE16 (request->address);
+   and_mask = CC_FROM_BE16 (request->and_mask);
+   or_mask = CC_FROM_BE16 (request->or_mask);
+
+   iotable = mb_slave_iotable_find (iotable, &address, 1);
+   if (iotable == NULL)
+      return EILLEGAL_DATA_ADDRESS;
+
+   if (!mb_slave_can_get (iotable) || !mb_slave_can_set (iotable))
+      return EILLEGAL_FUNCTION;
+
+   if (iotable->image != NULL)
+   {
+      uint16_t * image = iotable->image;
+
+      /* Modify in one write section, so that no update is lost */
+      if (iotable->lock != NULL)
+         mb_seqlock_write_begin (iotable->lock);
+
+      image[address] = (image[address] & and_mask) | (or_mask & ~and_mask);
+
+      if (iotable->lock != NULL)
+         mb_seqlock_write_end (iotable->lock);
+
+      return sizeof (pdu_mask_write_response_t);
+   }
+
+   error = mb_slave_get_registers (iotable, address, data, 1);
+   if (error)
+      return error;
+
+   value = mb_slave_reg_get (data, 0);
+   value = (value & and_mask) | (or_mask & ~and_mask);
+   mb_slave_reg_set (data, 0, value);
+
+   error = mb_slave_set_registers (iotable, address, data, 1);
+   if (error)
+      return error;
+
+   /* Echo request */
+   return sizeof (pdu_mask_write_response_t);
+}
+
 static int mb_slave_read_write_registers (
    mb_transport_t * transport,
    const mb_iotable_t * iotable,
@@ -294,6 +648,8 @@ static int mb_slave_read_write_registers (
 {
    pdu_read_write_t * request = &pdu->read_write;
    pdu_read_response_t * response = &pdu->read_response;
+   const mb_iotable_t * write_table;
+   const mb_iotable_t * read_table;
    uint16_t write_address;
    uint16_t write_quantity;
    uint16_t read_address;
@@ -309,13 +665,17 @@ static int mb_slave_read_write_registers (
    if (2 * write_quantity != request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (write_address + write_quantity > iotable->size)
+   write_table = mb_slave_iotable_find (
+      iotable,
+      &write_address,
+      write_quantity);
+   if (write_table == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
    if (rx_count != sizeof (*request) + request->count)
       return EILLEGAL_DATA_VALUE;
 
-   if (iotable->set == NULL)
+   if (!mb_slave_can_set (write_table))
       return EILLEGAL_FUNCTION;
 
    read_address = CC_FROM_BE16 (request->read_address);
@@ -324,72 +684,503 @@ static int mb_slave_read_write_registers (
    if (read_quantity == 0 || read_quantity > 0x7D)
       return EILLEGAL_DATA_VALUE;
 
-   if (read_address + read_quantity > iotable->size)
+   read_table = mb_slave_iotable_find (iotable, &read_address, read_quantity);
+   if (read_table == NULL)
       return EILLEGAL_DATA_ADDRESS;
 
-   if (iotable->get == NULL)
+   if (!mb_slave_can_get (read_table))
       return EILLEGAL_FUNCTION;
 
    /* Perform write */
-   error = iotable->set (write_address, request->data, write_quantity);
+   error = mb_slave_set_registers (
+      write_table,
+      write_address,
+      request->data,
+      write_quantity);
    if (error)
       return error;
 
    /* Build response */
    response->count = 2 * read_quantity;
-   error = iotable->get (read_address, response->data, read_quantity);
+   error = mb_slave_get_registers (
+      read_table,
+      read_address,
+      response->data,
+      read_quantity);
    if (error)
       return error;
 
    return sizeof (*response) + response->count;
 }
 
+static void mb_slave_diag_reset (mb_diag_t * diag, mb_diag_counter_t counter)
+{
+   if (diag != NULL)
+      mb_atomic_store (&diag->counter[counter], 0);
+}
+
 static int mb_slave_diagnostics (
-   mb_transport_t * transport,
+   mb_diag_t * diag,
    pdu_t * pdu,
    size_t rx_count)
 {
    pdu_diag_t * request = &pdu->diag;
    uint16_t sub_function;
+   uint16_t value;
+   int counter;
 
    sub_function = CC_FROM_BE16 (request->sub_function);
    switch (sub_function)
    {
    case PDU_DIAG_LOOPBACK:
       return (int)rx_count;
-   default:
+   case PDU_DIAG_CLEAR_COUNTERS:
+   case PDU_DIAG_CLEAR_OVERRUNS:
+      counter = -1;
+      break;
+   case PDU_DIAG_BUS_MESSAGES:
+      counter = MB_DIAG_BUS_MESSAGES;
+      break;
+   case PDU_DIAG_BUS_ERRORS:
+      counter = MB_DIAG_BUS_ERRORS;
       break;
+   case PDU_DIAG_EXCEPTIONS:
+      counter = MB_DIAG_EXCEPTIONS;
+      break;
+   case PDU_DIAG_SLAVE_MESSAGES:
+      counter = MB_DIAG_SLAVE_MESSAGES;
+      break;
+   case PDU_DIAG_NO_RESPONSES:
+      counter = MB_DIAG_NO_RESPONSES;
+      break;
+   case PDU_DIAG_OVERRUNS:
+      counter = MB_DIAG_OVERRUNS;
+      break;
+   default:
+      return EILLEGAL_FUNCTION;
    }
 
-   return EILLEGAL_FUNCTION;
+   /* The remaining sub-functions take a zero data field */
+   if (rx_count != sizeof (*request) + sizeof (value))
+      return EILLEGAL_DATA_VALUE;
+
+   if (request->data[0] != 0 || request->data[1] != 0)
+      return EILLEGAL_DATA_VALUE;
+
+   if (sub_function == PDU_DIAG_CLEAR_COUNTERS)
+   {
+      for (counter = 0; counter < MB_DIAG_NUM_COUNTERS; counter++)
+      {
+         mb_slave_diag_reset (diag, counter);
+      }
+   }
+   else if (sub_function == PDU_DIAG_CLEAR_OVERRUNS)
+   {
+      mb_slave_diag_reset (diag, MB_DIAG_OVERRUNS);
+   }
+   else
+   {
+      /* Counters are returned modulo 2^16 */
+      value = (diag != NULL)
+                 ? (uint16_t)mb_atomic_load_relaxed (&diag->counter[counter])
+                 : 0;
+      mb_slave_reg_set (request->data, 0, value);
+   }
+
+   /* Echo sub-function and data */
+   return (int)rx_count;
 }
 
 static int mb_slave_vendor (
-   mb_transport_t * transport,
-   const mb_iomap_t * iomap,
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
    pdu_t * pdu,
-   size_t rx_count)
+   size_t rx_count,
+   bool is_bc)
 {
    pdu_vendor_t * request = &pdu->vendor;
+   uint8_t ix = map->vendor_ix[request->function];
+
+   if (ix == 0)
+      return EILLEGAL_FUNCTION;
+
+   return map->iomap->vendor_funcs[ix - 1].callback (
+      &request->function,
+      rx_count);
+}
+
+/* Handlers for the standard function codes */
+
+static int mb_slave_read_coils (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   if (is_bc)
+      return 0;
+
+   return mb_slave_read_bits (slave->transport, &map->iomap->coils, pdu);
+}
+
+static int mb_slave_read_inputs (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   if (is_bc)
+      return 0;
+
+   return mb_slave_read_bits (slave->transport, &map->iomap->inputs, pdu);
+}
+
+static int mb_slave_read_holding_registers (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   if (is_bc)
+      return 0;
+
+   return mb_slave_read_registers (
+      slave->transport,
+      &map->iomap->holding_registers,
+      pdu);
+}
+
+static int mb_slave_read_input_registers (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   if (is_bc)
+      return 0;
+
+   return mb_slave_read_registers (
+      slave->transport,
+      &map->iomap->input_registers,
+      pdu);
+}
+
+static int mb_slave_write_coil (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_write_bit (slave->transport, &map->iomap->coils, pdu);
+}
+
+static int mb_slave_write_holding_register (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_write_register (
+      slave->transport,
+      &map->iomap->holding_registers,
+      pdu);
+}
+
+static int mb_slave_write_coils (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_write_bits (
+      slave->transport,
+      &map->iomap->coils,
+      pdu,
+      rx_count);
+}
+
+static int mb_slave_write_holding_registers (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_write_registers (
+      slave->transport,
+      &map->iomap->holding_registers,
+      pdu,
+      rx_count);
+}
+
+static int mb_slave_mask_write_holding_register (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_mask_write_register (
+      slave->transport,
+      &map->iomap->holding_registers,
+      pdu);
+}
+
+static int mb_slave_read_write_holding_registers (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_read_write_registers (
+      slave->transport,
+      &map->iomap->holding_registers,
+      pdu,
+      rx_count);
+}
+
+static int mb_slave_diagnostics_request (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   return mb_slave_diagnostics (slave->diag, pdu, rx_count);
+}
+
+typedef int (*mb_slave_handler_t) (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc);
+
+/* Function codes not in this table are handled by the vendor-defined
+   functions in the iomap */
+static const mb_slave_handler_t mb_slave_handlers[256] = {
+   [PDU_READ_COILS]                   = mb_slave_read_coils,
+   [PDU_READ_INPUTS]                  = mb_slave_read_inputs,
+   [PDU_READ_HOLDING_REGISTERS]       = mb_slave_read_holding_registers,
+   [PDU_READ_INPUT_REGISTERS]         = mb_slave_read_input_registers,
+   [PDU_WRITE_COIL]                   = mb_slave_write_coil,
+   [PDU_WRITE_HOLDING_REGISTER]       = mb_slave_write_holding_register,
+   [PDU_DIAGNOSTICS]                  = mb_slave_diagnostics_request,
+   [PDU_WRITE_COILS]                  = mb_slave_write_coils,
+   [PDU_WRITE_HOLDING_REGISTERS]      = mb_slave_write_holding_registers,
+   [PDU_MASK_WRITE_HOLDING_REGISTER]  = mb_slave_mask_write_holding_register,
+   [PDU_READ_WRITE_HOLDING_REGISTERS] = mb_slave_read_write_holding_registers,
+};
+
+static void mb_slave_map_init (mb_slave_map_t * map, const mb_iomap_t * iomap)
+{
    size_t i;
+
+   map->iomap = iomap;
+   memset (map->vendor_ix, 0, sizeof (map->vendor_ix));
+
+   if (iomap->vendor_funcs == NULL)
+      return;
+
+   /* Index vendor-defined functions by function code. The first
+      definition of a function code is used. */
+   i = iomap->num_vendor_funcs;
+   if (i > UINT8_MAX)
+      i = UINT8_MAX;
+
+   while (i-- > 0)
+   {
+      uint8_t function = iomap->vendor_funcs[i].function;
+
+      if (mb_slave_handlers[function] == NULL)
+         map->vendor_ix[function] = (uint8_t)(i + 1);
+   }
+}
+
+void mb_slave_iomap_set (mb_slave_t * slave, const mb_iomap_t * iomap)
+{
+   mb_slave_map_init (&slave->map, iomap);
+}
+
+int mb_slave_units_set (
+   mb_slave_t * slave,
+   const mb_slave_unit_t * units,
+   size_t num_units)
+{
+   size_t i;
+
+   if (num_units > UINT8_MAX)
+      return -1;
+
+   for (i = 0; i < num_units; i++)
+   {
+      if (units[i].id == 0 || units[i].iomap == NULL)
+         return -1;
+   }
+
+   free (slave->units);
+   slave->units = NULL;
+   slave->num_units = 0;
+   memset (slave->unit_ix, 0, sizeof (slave->unit_ix));
+
+   if (num_units == 0)
+      return 0;
+
+   slave->units = calloc (num_units, sizeof (mb_slave_map_t));
+   if (slave->units == NULL)
+      return -1;
+
+   /* Index units by unit ID. The first definition of a unit ID is
+      used. */
+   i = num_units;
+   while (i-- > 0)
+   {
+      mb_slave_map_init (&slave->units[i], units[i].iomap);
+      slave->unit_ix[units[i].id] = (uint8_t)(i + 1);
+   }
+
+   slave->num_units = num_units;
+   return 0;
+}
+
+uint32_t mb_slave_request_count (mb_slave_t * slave, uint8_t function)
+{
+   return mb_atomic_load_relaxed (&slave->requests[function]);
+}
+
+uint32_t mb_slave_diag_get (mb_slave_t * slave, mb_diag_counter_t counter)
+{
+   if (slave->diag == NULL)
+      return 0;
+
+   return mb_atomic_load_relaxed (&slave->diag->counter[counter]);
+}
+
+void mb_slave_diag_clear (mb_slave_t * slave)
+{
+   int counter;
+
+   for (counter = 0; counter < MB_DIAG_NUM_COUNTERS; counter++)
+   {
+      mb_slave_diag_reset (slave->diag, counter);
+   }
+}
+
+static const mb_slave_map_t * mb_slave_map_find (
+   const mb_slave_t * slave,
+   uint8_t unit)
+{
+   uint8_t ix;
+
+   /* A slave without units serves its iomap on any unit ID that
+      reaches it */
+   if (slave->num_units == 0 || unit == slave->id)
+      return &slave->map;
+
+   ix = slave->unit_ix[unit];
+   if (ix == 0)
+      return NULL;
+
+   return &slave->units[ix - 1];
+}
+
+static int mb_slave_map_dispatch (
+   mb_slave_t * slave,
+   const mb_slave_map_t * map,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   uint8_t function = pdu->request.function;
+   mb_slave_handler_t handler = mb_slave_handlers[function];
    int tx_count;
 
-   if (iomap->num_vendor_funcs == 0 || iomap->vendor_funcs == NULL)
-      return EILLEGAL_FUNCTION;
+   mb_atomic_inc (&slave->requests[function]);
+
+   if (handler == NULL)
+      handler = mb_slave_vendor;
+
+   tx_count = handler (slave, map, pdu, rx_count, is_bc);
 
-   /* Find matching vendor-defined function */
-   for (i = 0; i < iomap->num_vendor_funcs; i++)
+   /* Check for exception */
+   if (tx_count < 0)
    {
-      if (iomap->vendor_funcs[i].function == request->function)
-      {
-         tx_count =
-            iomap->vendor_funcs[i].callback (&request->function, rx_count);
+      pdu_exception_t * exception = &pdu->exception;
 
-         return tx_count;
-      }
+      if (!is_bc)
+         mb_diag_count (slave->diag, MB_DIAG_EXCEPTIONS);
+
+      exception->function |= BIT (7);
+      exception->code = -tx_count;
+
+      tx_count = sizeof (*exception);
+   }
+
+   return tx_count;
+}
+
+static void mb_slave_broadcast (
+   mb_slave_t * slave,
+   pdu_t * pdu,
+   size_t rx_count)
+{
+   uint8_t request[MAX_PDU_SIZE];
+   size_t i;
+
+   /* A broadcast is addressed to every unit. Handlers may modify the
+      PDU, so each unit gets a fresh copy of the request. */
+   memcpy (request, pdu, rx_count);
+
+   (void)mb_slave_map_dispatch (slave, &slave->map, pdu, rx_count, true);
+   for (i = 0; i < slave->num_units; i++)
+   {
+      memcpy (pdu, request, rx_count);
+      (void)mb_slave_map_dispatch (
+         slave,
+         &slave->units[i],
+         pdu,
+         rx_count,
+         true);
    }
+}
 
-   return EILLEGAL_FUNCTION;
+int mb_slave_dispatch (
+   mb_slave_t * slave,
+   uint8_t unit,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc)
+{
+   const mb_slave_map_t * map;
+   int tx_count;
+
+   if (is_bc && slave->num_units > 0)
+   {
+      mb_diag_count (slave->diag, MB_DIAG_SLAVE_MESSAGES);
+      mb_diag_count (slave->diag, MB_DIAG_NO_RESPONSES);
+      mb_slave_broadcast (slave, pdu, rx_count);
+      return 0;
+   }
+
+   map = mb_slave_map_find (slave, unit);
+   if (map == NULL)
+      return 0;
+
+   mb_diag_count (slave->diag, MB_DIAG_SLAVE_MESSAGES);
+
+   tx_count = mb_slave_map_dispatch (slave, map, pdu, rx_count, is_bc);
+   if (is_bc || tx_count == 0)
+      mb_diag_count (slave->diag, MB_DIAG_NO_RESPONSES);
+
+   return tx_count;
 }
 
 void mb_slave_handle_request (mb_slave_t * slave, pdu_txn_t * transaction)
@@ -397,93 +1188,20 @@ void mb_slave_handle_request (mb_slave_t * slave, pdu_txn_t * transaction)
    mb_transport_t * transport = slave->transport;
    pdu_t * pdu = transaction->data;
    int rx_count;
-   int tx_count = 0;
+   int tx_count;
 
-   /* Wait for incoming request. Set a timeout to be able to retry
-      the call if the slave ID changes. */
+   /* Wait for incoming request. The wait ends early if the slave is
+      woken up, for instance when the slave ID changes. */
    rx_count = mb_pdu_rx (transport, transaction, PDU_TIMEOUT);
 
    if (rx_count > 0)
    {
-      switch (pdu->request.function)
-      {
-      case PDU_READ_COILS:
-         if (!mb_pdu_rx_bc (transport))
-         {
-            tx_count =
-               mb_slave_read_bits (transport, &slave->iomap->coils, pdu);
-         }
-         break;
-      case PDU_READ_INPUTS:
-         if (!mb_pdu_rx_bc (transport))
-         {
-            tx_count =
-               mb_slave_read_bits (transport, &slave->iomap->inputs, pdu);
-         }
-         break;
-      case PDU_READ_INPUT_REGISTERS:
-         if (!mb_pdu_rx_bc (transport))
-         {
-            tx_count = mb_slave_read_registers (
-               transport,
-               &slave->iomap->input_registers,
-               pdu);
-         }
-         break;
-      case PDU_READ_HOLDING_REGISTERS:
-         if (!mb_pdu_rx_bc (transport))
-         {
-            tx_count = mb_slave_read_registers (
-               transport,
-               &slave->iomap->holding_registers,
-               pdu);
-         }
-         break;
-      case PDU_WRITE_COIL:
-         tx_count = mb_slave_write_bit (transport, &slave->iomap->coils, pdu);
-         break;
-      case PDU_WRITE_HOLDING_REGISTER:
-         tx_count = mb_slave_write_register (
-            transport,
-            &slave->iomap->holding_registers,
-            pdu);
-         break;
-      case PDU_WRITE_COILS:
-         tx_count =
-            mb_slave_write_bits (transport, &slave->iomap->coils, pdu, rx_count);
-         break;
-      case PDU_WRITE_HOLDING_REGISTERS:
-         tx_count = mb_slave_write_registers (
-            transport,
-            &slave->iomap->holding_registers,
-            pdu,
-            rx_count);
-         break;
-      case PDU_READ_WRITE_HOLDING_REGISTERS:
-         tx_count = mb_slave_read_write_registers (
-            transport,
-            &slave->iomap->holding_registers,
-            pdu,
-            rx_count);
-         break;
-      case PDU_DIAGNOSTICS:
-         tx_count = mb_slave_diagnostics (transport, pdu, rx_count);
-         break;
-      default:
-         tx_count = mb_slave_vendor (transport, slave->iomap, pdu, rx_count);
-         break;
-      }
-
-      /* Check for exception */
-      if (tx_count < 0)
-      {
-         pdu_exception_t * exception = &pdu->exception;
-
-         exception->function |= BIT (7);
-         exception->code = -tx_count;
-
-         tx_count = sizeof (*exception);
-      }
+      tx_count = mb_slave_dispatch (
+         slave,
+         transaction->unit,
+         pdu,
+         rx_count,
+         mb_pdu_rx_bc (transport));
 
       /* Respond only if no further messages have appeared on bus */
       if (mb_pdu_rx_avail (transport))
@@ -496,9 +1214,13 @@ void mb_slave_handle_request (mb_slave_t * slave, pdu_txn_t * transaction)
 
          rx_count = mb_pdu_rx (transport, transaction, 0);
          (void)rx_count;
+
+         if (tx_count > 0 && !mb_pdu_rx_bc (transport))
+            mb_diag_count (slave->diag, MB_DIAG_NO_RESPONSES);
       }
-      /* No response to broadcast messages. */
-      else if (!mb_pdu_rx_bc (transport))
+      /* No response to broadcast messages, or to units that are not
+         served. */
+      else if (!mb_pdu_rx_bc (transport) && tx_count > 0)
       {
          /* Send response */
          mb_pdu_tx (transport, transaction, tx_count);
@@ -511,11 +1233,11 @@ static void mb_slave (void * arg)
    mb_slave_t * slave = arg;
    mb_transport_t * transport = slave->transport;
    pdu_txn_t transaction;
-   uint8_t buffer[MAX_PDU_SIZE];
+   uint8_t buffer[PDU_BUFFER_SIZE];
 
    memset (buffer, 0x55, sizeof (buffer));
 
-   transaction.data = buffer;
+   transaction.data = buffer + PDU_HEADROOM;
    transaction.arg = 0;
 
    while (slave->running)
@@ -531,6 +1253,9 @@ static void mb_slave (void * arg)
          continue;
 
       transaction.unit = slave->id;
+      transaction.flags = PDU_TXN_HEADROOM;
+      if (slave->num_units > 0)
+         transaction.flags |= PDU_TXN_ANY_UNIT;
 
       mb_slave_handle_request (slave, &transaction);
    }
@@ -541,14 +1266,22 @@ void * mb_slave_transport_get (mb_slave_t * slave)
    return slave->transport;
 }
 
+void mb_slave_wakeup (mb_slave_t * slave)
+{
+   if (slave->transport != NULL)
+      mb_transport_wakeup (slave->transport);
+}
+
 void mb_slave_id_set (mb_slave_t * slave, uint8_t id)
 {
    slave->id = id;
+   mb_slave_wakeup (slave);
 }
 
 void mb_slave_shutdown (mb_slave_t * slave)
 {
    slave->running = 0;
+   mb_slave_wakeup (slave);
 }
 
 mb_slave_t * mb_slave_init (
@@ -561,10 +1294,18 @@ mb_slave_t * mb_slave_init (
    slave = malloc (sizeof (mb_slave_t));
    CC_ASSERT (slave != NULL);
 
-   slave->iomap = cfg->iomap;
+   memset (slave, 0, sizeof (*slave));
+   mb_slave_iomap_set (slave, cfg->iomap);
+   if (mb_slave_units_set (slave, cfg->units, cfg->num_units) != 0)
+   {
+      free (slave);
+      return NULL;
+   }
 
-   /* Set transport layer */
+   /* Set transport layer. The slave counters are kept with the bus
+      counters of the transport. */
    slave->transport = transport;
+   slave->diag = &transport->diag;
    transport->is_server = true;
 
    slave->id = cfg->id;
@@ -0,0 +1,57 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#ifndef MB_SLAVE_INTERNAL_H
+#define MB_SLAVE_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mb_slave.h"
+#include "mb_pdu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Set the iomap and index its vendor-defined functions. Must be called
+   before mb_slave_dispatch(). */
+void mb_slave_iomap_set (mb_slave_t * slave, const mb_iomap_t * iomap);
+
+/* Set the additional units served by the slave, replacing any
+   previous units. Returns 0 on success or -1 if a unit is invalid or
+   memory could not be allocated. */
+int mb_slave_units_set (
+   mb_slave_t * slave,
+   const mb_slave_unit_t * units,
+   size_t num_units);
+
+/* Handle the request to unit in pdu and build the response in place,
+   shared by the slave implementations. Read requests are ignored if
+   is_bc is set. Returns the size of the response PDU, which is an
+   exception response if the request failed, or 0 if there is no
+   response, including when the slave does not serve the unit. */
+int mb_slave_dispatch (
+   mb_slave_t * slave,
+   uint8_t unit,
+   pdu_t * pdu,
+   size_t rx_count,
+   bool is_bc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MB_SLAVE_INTERNAL_H */
@@ -16,6 +16,8 @@
 #include "mb_tcp.h"
 #include "mb_transport.h"
 #include "mb_pdu.h"
+#include "mb_mbap.h"
+#include "mb_diag.h"
 #include "osal.h"
 #include "mbal_tcp.h"
 #include "osal_log.h"
@@ -31,25 +33,125 @@
 
 #define RCV_TIMEOUT 500 /* max time to wait for message in progress [ms] */
 
-typedef struct mbap
-{
-   uint16_t id;
-   uint16_t protocol;
-   uint16_t length;
-   uint8_t unit;
-   uint8_t data[MAX_PDU_SIZE];
-} CC_PACKED mbap_t;
+#define LISTEN_BACKLOG 16 /* pending connections kept while serving one */
 
-#define MBAP_HEADER_SIZE offsetof (mbap_t, data)
+/* Connection state, looked up by the peer socket passed in the
+   transaction argument */
+typedef struct mb_tcp_peer
+{
+   int fd;
+   uint32_t refs;       /**< Peer table entry and tasks using the peer */
+   mbap_t mbap;         /**< Transmit frame, if no headroom */
+   mb_mbap_buffer_t rx; /**< Receive stream */
+} mb_tcp_peer_t;
 
 struct mb_tcp /* Typedef in mb_tcp.h */
 {
    mb_transport_t transport;
    uint16_t port;
-   bool is_down;
-   mbap_t mbap;
+   int listener;
+   int wakeup;
+   os_mutex_t * mutex; /**< Protects the peer table and references */
+   mb_tcp_peer_t * peers[MB_TCP_MAX_PEERS];
 };
 
+/* Find the peer and take a reference to it, so that it remains valid
+   until released with mb_tcp_peer_put() */
+static mb_tcp_peer_t * mb_tcp_peer_get (mb_tcp_t * mb_tcp, int fd)
+{
+   mb_tcp_peer_t * peer = NULL;
+   size_t i;
+
+   os_mutex_lock (mb_tcp->mutex);
+   for (i = 0; i < MB_TCP_MAX_PEERS; i++)
+   {
+      if (mb_tcp->peers[i] != NULL && mb_tcp->peers[i]->fd == fd)
+      {
+         peer = mb_tcp->peers[i];
+         peer->refs++;
+         break;
+      }
+   }
+   os_mutex_unlock (mb_tcp->mutex);
+
+   return peer;
+}
+
+/* Release a reference. The connection is closed when the peer has
+   been removed from the table and no task uses it, so that the
+   descriptor can not be reused while it is in use. */
+static void mb_tcp_peer_put (mb_tcp_t * mb_tcp, mb_tcp_peer_t * peer)
+{
+   uint32_t refs;
+
+   os_mutex_lock (mb_tcp->mutex);
+   refs = --peer->refs;
+   os_mutex_unlock (mb_tcp->mutex);
+
+   if (refs == 0)
+   {
+      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
+      os_tcp_close (peer->fd);
+      free (peer);
+   }
+}
+
+/* Remove the peer from the table, if not done already by another
+   task. The caller holds a reference. */
+static void mb_tcp_peer_remove (mb_tcp_t * mb_tcp, mb_tcp_peer_t * peer)
+{
+   bool removed = false;
+   size_t i;
+
+   os_mutex_lock (mb_tcp->mutex);
+   for (i = 0; i < MB_TCP_MAX_PEERS; i++)
+   {
+      if (mb_tcp->peers[i] == peer)
+      {
+         mb_tcp->peers[i] = NULL;
+         removed          = true;
+      }
+   }
+   os_mutex_unlock (mb_tcp->mutex);
+
+   /* Drop the reference held by the table */
+   if (removed)
+      mb_tcp_peer_put (mb_tcp, peer);
+}
+
+static int mb_tcp_peer_add (mb_tcp_t * mb_tcp, int fd)
+{
+   mb_tcp_peer_t * peer;
+   size_t i;
+
+   peer = malloc (sizeof (*peer));
+   if (peer == NULL)
+      return -1;
+
+   peer->fd   = fd;
+   peer->refs = 1;
+   mb_mbap_buffer_reset (&peer->rx);
+
+   os_mutex_lock (mb_tcp->mutex);
+   for (i = 0; i < MB_TCP_MAX_PEERS; i++)
+   {
+      if (mb_tcp->peers[i] == NULL)
+      {
+         mb_tcp->peers[i] = peer;
+         break;
+      }
+   }
+   os_mutex_unlock (mb_tcp->mutex);
+
+   if (i == MB_TCP_MAX_PEERS)
+   {
+      free (peer);
+      return -1;
+   }
+
+   return 0;
+}
+
 static int mb_tcp_bringup (mb_transport_t * transport, const char * name)
 {
    mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
@@ -57,7 +159,18 @@ static int mb_tcp_bringup (mb_transport_t * transport, const char * name)
 
    if (transport->is_server)
    {
-      peer = os_tcp_accept_connection (mb_tcp->port);
+      /* The listening socket is kept open, so that clients can
+         reconnect without waiting for it to be set up again */
+      if (mb_tcp->listener == -1)
+      {
+         mb_tcp->listener = os_tcp_listen (mb_tcp->port, LISTEN_BACKLOG);
+         if (mb_tcp->listener == -1)
+            return -1;
+      }
+
+      peer = os_tcp_accept (mb_tcp->listener, mb_tcp->wakeup, RCV_TIMEOUT);
+      if (peer == 0)
+         return -1;
    }
    else
    {
@@ -66,7 +179,13 @@ static int mb_tcp_bringup (mb_transport_t * transport, const char * name)
 
    if (peer > 0)
    {
-      mb_tcp->is_down = false;
+      if (mb_tcp_peer_add (mb_tcp, peer) != 0)
+      {
+         LOG_WARNING (MB_TCP_LOG, "Too many connections\n");
+         os_tcp_close (peer);
+         return -1;
+      }
+
       LOG_INFO (MB_TCP_LOG, "Connection established\n");
    }
 
@@ -75,14 +194,14 @@ static int mb_tcp_bringup (mb_transport_t * transport, const char * name)
 
 static int mb_tcp_shutdown (mb_transport_t * transport, int arg)
 {
-   mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
-   int peer          = arg;
+   mb_tcp_t * mb_tcp    = (mb_tcp_t *)transport;
+   mb_tcp_peer_t * peer = mb_tcp_peer_get (mb_tcp, arg);
 
-   if (mb_tcp->is_down == false)
+   /* The connection may already have been closed on error */
+   if (peer != NULL)
    {
-      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
-      os_tcp_close (peer);
-      mb_tcp->is_down = true;
+      mb_tcp_peer_remove (mb_tcp, peer);
+      mb_tcp_peer_put (mb_tcp, peer);
    }
 
    os_usleep (10 * 1000);
@@ -92,7 +211,19 @@ static int mb_tcp_shutdown (mb_transport_t * transport, int arg)
 static bool mb_tcp_is_down (mb_transport_t * transport)
 {
    mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
-   return mb_tcp->is_down;
+   bool is_down      = true;
+   size_t i;
+
+   /* Down until a peer is connected */
+   os_mutex_lock (mb_tcp->mutex);
+   for (i = 0; i < MB_TCP_MAX_PEERS; i++)
+   {
+      if (mb_tcp->peers[i] != NULL)
+         is_down = false;
+   }
+   os_mutex_unlock (mb_tcp->mutex);
+
+   return is_down;
 }
 
 static void mb_tcp_tx (
@@ -100,95 +231,141 @@ static void mb_tcp_tx (
    const pdu_txn_t * transaction,
    size_t size)
 {
-   mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
-   int peer          = transaction->arg;
-   mbap_t * mbap     = &mb_tcp->mbap;
+   mb_tcp_t * mb_tcp    = (mb_tcp_t *)transport;
+   mb_tcp_peer_t * peer = mb_tcp_peer_get (mb_tcp, transaction->arg);
+   mbap_t * mbap;
    ssize_t result;
 
-   mbap->id       = CC_TO_BE16 (transaction->id);
-   mbap->length   = CC_TO_BE16 ((uint16_t)size + 1); /* Includes size of unit id */
-   mbap->protocol = 0;
-   mbap->unit     = transaction->unit;
+   if (peer == NULL)
+   {
+      LOG_WARNING (MB_TCP_LOG, "Not connected\n");
+      return;
+   }
 
-   memcpy (mbap->data, transaction->data, size);
-   result = os_tcp_send (peer, mbap, MBAP_HEADER_SIZE + size);
+   /* Build the header in front of the PDU if there is room, so that
+      the PDU is not copied */
+   if (transaction->flags & PDU_TXN_HEADROOM)
+      mbap = (mbap_t *)((uint8_t *)transaction->data - MBAP_HEADER_SIZE);
+   else
+      mbap = &peer->mbap;
+
+   size   = mb_mbap_encode (mbap, transaction, size);
+   result = os_tcp_send (peer->fd, mbap, size);
    LOG_DEBUG (MB_TCP_LOG, "Sent mbap\n");
 
    if (result <= 0)
    {
       /* Peer closed their connection or some other error. Close
          connection. */
-      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
-      os_tcp_close (peer);
-      mb_tcp->is_down = true;
-      return;
+      mb_tcp_peer_remove (mb_tcp, peer);
    }
+
+   mb_tcp_peer_put (mb_tcp, peer);
 }
 
-static int mb_tcp_rx (
-   mb_transport_t * transport,
+static int mb_tcp_peer_rx (
+   mb_tcp_t * mb_tcp,
+   mb_tcp_peer_t * peer,
    pdu_txn_t * transaction,
    uint32_t tmo)
 {
-   mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
-   int peer          = transaction->arg;
-   mbap_t * mbap     = &mb_tcp->mbap;
-   size_t size       = 0;
-   ssize_t result;
-
-   /* Wait for next message until timeout */
-   result = os_tcp_recv_wait (peer, tmo);
-   if (result == -1)
-   {
-      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
-      os_tcp_close (peer);
-      mb_tcp->is_down = true;
-      return EFRAME_NOK;
-   }
-   if (result == 0)
+   mb_transport_t * transport = &mb_tcp->transport;
+   mb_mbap_buffer_t * buffer;
+   const mbap_t * mbap;
+   size_t size;
+   int result;
+
+   /* Parse buffered frames before receiving more, so that pipelined
+      requests are served without system calls */
+   buffer = &peer->rx;
+   while ((result = mb_mbap_buffer_frame (buffer, &mbap)) == 0)
    {
-      /* Timeout */
-      return ETIMEOUT;
+      if (mb_mbap_buffer_is_empty (buffer))
+      {
+         /* Wait for next message until timeout */
+         result = os_tcp_recv_wait (peer->fd, mb_tcp->wakeup, tmo);
+         if (result == -1)
+            goto error;
+
+         if (result == 0)
+         {
+            /* Timeout */
+            return ETIMEOUT;
+         }
+      }
+
+      /* Receive as much as fits. The recv function will timeout if the
+         rest of a message is not available in a reasonable
+         timeframe. */
+      size   = mb_mbap_buffer_space (buffer);
+      result = os_tcp_recv_some (peer->fd, mb_mbap_buffer_next (buffer), size);
+      if (result <= 0)
+      {
+         /* Peer closed their connection or some other error. Drop
+            message, close connection. */
+         goto error;
+      }
+
+      LOG_DEBUG (MB_TCP_LOG, "Received %d bytes\n", result);
+      mb_mbap_buffer_commit (buffer, result);
    }
 
-   /* Get message. The recv function will timeout if data is not
-      available in a reasonable timeframe. */
-
-   LOG_DEBUG (MB_TCP_LOG, "Getting header\n");
-   result = os_tcp_recv (peer, mbap, MBAP_HEADER_SIZE);
-   if (result == MBAP_HEADER_SIZE)
+   if (result < 0)
    {
-      /* The size of the PDU includes the unit id we already read */
-      size = CC_FROM_BE16 (mbap->length) - 1;
-
-      /* Never overflow buffer */
-      if (size > MAX_PDU_SIZE)
-         size = MAX_PDU_SIZE;
-
-      LOG_DEBUG (MB_TCP_LOG, "Getting %d bytes\n", (unsigned)size);
-      result = os_tcp_recv (peer, transaction->data, size);
+      /* Invalid length, framing is lost */
+      if (CC_FROM_BE16 (mbap->length) > MAX_PDU_SIZE + 1)
+         mb_diag_count (&transport->diag, MB_DIAG_OVERRUNS);
+      else
+         mb_diag_count (&transport->diag, MB_DIAG_BUS_ERRORS);
+      goto error;
    }
 
-   if (result <= 0)
-   {
-      /* Peer closed their connection or some other error. Drop
-         message, close connection. */
-      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
-      os_tcp_close (peer);
-      mb_tcp->is_down = true;
-      return EFRAME_NOK;
-   }
+   mb_diag_count (&transport->diag, MB_DIAG_BUS_MESSAGES);
 
    /* Drop message if protocol field invalid */
    if (mbap->protocol != 0)
    {
+      mb_diag_count (&transport->diag, MB_DIAG_BUS_ERRORS);
       return EFRAME_NOK;
    }
 
+   /* The size of the PDU includes the unit id in the header */
+   size = CC_FROM_BE16 (mbap->length) - 1;
+   memcpy (transaction->data, mbap->data, size);
+
    transaction->id   = CC_FROM_BE16 (mbap->id);
    transaction->unit = mbap->unit;
 
    return (int)size;
+
+error:
+   mb_tcp_peer_remove (mb_tcp, peer);
+   return EFRAME_NOK;
+}
+
+static int mb_tcp_rx (
+   mb_transport_t * transport,
+   pdu_txn_t * transaction,
+   uint32_t tmo)
+{
+   mb_tcp_t * mb_tcp    = (mb_tcp_t *)transport;
+   mb_tcp_peer_t * peer = mb_tcp_peer_get (mb_tcp, transaction->arg);
+   int result;
+
+   if (peer == NULL)
+      return EFRAME_NOK;
+
+   result = mb_tcp_peer_rx (mb_tcp, peer, transaction, tmo);
+   mb_tcp_peer_put (mb_tcp, peer);
+   return result;
+}
+
+static void mb_tcp_wakeup (mb_transport_t * transport)
+{
+   mb_tcp_t * mb_tcp = (mb_tcp_t *)transport;
+
+   if (mb_tcp->wakeup != -1)
+      os_wakeup_signal (mb_tcp->wakeup);
 }
 
 static bool mb_tcp_rx_is_bc (mb_transport_t * transport)
@@ -222,9 +399,21 @@ mb_transport_t * mb_tcp_init (const mb_tcp_cfg_t * cfg)
    mb_tcp->transport.rx       = mb_tcp_rx;
    mb_tcp->transport.rx_is_bc = mb_tcp_rx_is_bc;
    mb_tcp->transport.rx_avail = mb_tcp_rx_avail;
+   mb_tcp->transport.wakeup   = mb_tcp_wakeup;
+
+   mb_tcp->transport.is_server  = false;
+   mb_tcp->transport.has_txn_id = true;
+   memset (&mb_tcp->transport.diag, 0, sizeof (mb_tcp->transport.diag));
+
+   mb_tcp->port     = cfg->port;
+   mb_tcp->listener = -1;
+   memset (mb_tcp->peers, 0, sizeof (mb_tcp->peers));
+
+   mb_tcp->mutex = os_mutex_create();
+   CC_ASSERT (mb_tcp->mutex != NULL);
 
-   mb_tcp->is_down = true;
-   mb_tcp->port    = cfg->port;
+   /* Without a wakeup descriptor, waits end on timeout only */
+   mb_tcp->wakeup = os_wakeup_create();
 
    return (mb_transport_t *)mb_tcp;
 }
@@ -0,0 +1,666 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_tcp_pool.h"
+#include "mb_tcp.h"
+#include "mb_pdu.h"
+#include "mb_mbap.h"
+#include "mbal_tcp.h"
+#include "mbus_internal.h"
+#include "osal.h"
+#include "osal_log.h"
+#include "options.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Wrap-safe comparison of timestamps */
+#define TIME_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+/* Maximum number of socket events handled per wait */
+#define MAX_EVENTS 64
+
+/* Maximum length of slave name, including terminator */
+#define MAX_NAME 64
+
+typedef enum mb_tcp_pool_state
+{
+   POOL_FREE = 0,
+   POOL_CONNECTING,
+   POOL_UP,
+   POOL_DOWN,
+} mb_tcp_pool_state_t;
+
+typedef struct mb_tcp_pool_conn
+{
+   int peer;
+   uint8_t state;
+   uint32_t gen;           /**< Incremented when the socket changes */
+   uint32_t events;        /**< Current event interest */
+   bool busy;              /**< Request outstanding */
+   uint32_t deadline;      /**< Response deadline [us] */
+   mbus_pending_t pending; /**< Outstanding request */
+   mbap_t tx;
+   size_t tx_size;
+   size_t tx_sent;
+   mb_mbap_rx_t rx;
+   char name[MAX_NAME]; /**< Slave name, for reconnecting */
+} mb_tcp_pool_conn_t;
+
+struct mb_tcp_pool /* Typedef in mb_tcp_pool.h */
+{
+   int set;
+   uint16_t port;
+   uint32_t timeout;
+   size_t send_buffer;
+   uint16_t id;
+   mb_tcp_pool_conn_t * conns;
+   size_t num_conns;
+   size_t num_busy;
+   uint32_t next_deadline; /**< Earliest deadline, if num_busy > 0 */
+};
+
+static mb_tcp_pool_conn_t * mb_tcp_pool_get (mb_tcp_pool_t * pool, int conn)
+{
+   if (conn < 0 || (size_t)conn >= pool->num_conns)
+      return NULL;
+
+   if (pool->conns[conn].state == POOL_FREE)
+      return NULL;
+
+   return &pool->conns[conn];
+}
+
+static bool mb_tcp_pool_is_open (const mb_tcp_pool_conn_t * conn)
+{
+   return conn->state == POOL_CONNECTING || conn->state == POOL_UP;
+}
+
+/* Start connecting to the slave of the connection */
+static int mb_tcp_pool_open (mb_tcp_pool_t * pool, mb_tcp_pool_conn_t * conn)
+{
+   int peer;
+
+   peer = os_tcp_connect_start (conn->name, pool->port);
+   if (peer < 0)
+      return -1;
+
+   if (
+      pool->send_buffer != 0 &&
+      os_tcp_send_buffer (peer, pool->send_buffer) != 0)
+   {
+      os_tcp_close (peer);
+      return -1;
+   }
+
+   conn->peer    = peer;
+   conn->state   = POOL_CONNECTING;
+   conn->events  = OS_POLL_IN | OS_POLL_OUT;
+   conn->tx_size = 0;
+   conn->tx_sent = 0;
+   conn->gen++;
+   mb_mbap_rx_reset (&conn->rx);
+
+   if (os_poll_add (pool->set, peer, conn->events, conn) != 0)
+   {
+      os_tcp_close (peer);
+      return -1;
+   }
+
+   return 0;
+}
+
+static void mb_tcp_pool_complete (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn,
+   int result)
+{
+   mbus_pending_t * pending = &conn->pending;
+
+   /* Release before the callback, so that it can submit again */
+   conn->busy = false;
+   pool->num_busy--;
+
+   if (pending->callback != NULL)
+      pending->callback (result, pending->arg);
+}
+
+static void mb_tcp_pool_down (mb_tcp_pool_t * pool, mb_tcp_pool_conn_t * conn)
+{
+   if (mb_tcp_pool_is_open (conn))
+   {
+      LOG_INFO (MB_TCP_LOG, "Connection closed\n");
+      os_poll_remove (pool->set, conn->peer);
+      os_tcp_close (conn->peer);
+      conn->state = POOL_DOWN;
+      conn->gen++;
+   }
+
+   if (conn->busy)
+      mb_tcp_pool_complete (pool, conn, ECONNECTION);
+}
+
+/* Replace the socket of a connection with a new one to the same
+   slave. The connection is down if no new connection can be started. */
+static void mb_tcp_pool_reconnect (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn)
+{
+   LOG_INFO (MB_TCP_LOG, "Reconnecting\n");
+   os_poll_remove (pool->set, conn->peer);
+   os_tcp_close (conn->peer);
+
+   if (mb_tcp_pool_open (pool, conn) != 0)
+   {
+      conn->state = POOL_DOWN;
+      conn->gen++;
+   }
+}
+
+static void mb_tcp_pool_interest (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn)
+{
+   uint32_t events = OS_POLL_IN;
+
+   if (conn->state == POOL_CONNECTING || conn->tx_sent < conn->tx_size)
+      events |= OS_POLL_OUT;
+
+   /* Avoid a system call if nothing changed */
+   if (events != conn->events)
+   {
+      os_poll_modify (pool->set, conn->peer, events, conn);
+      conn->events = events;
+   }
+}
+
+/* Send as much as possible of the pending request */
+static void mb_tcp_pool_flush (mb_tcp_pool_t * pool, mb_tcp_pool_conn_t * conn)
+{
+   size_t remain = conn->tx_size - conn->tx_sent;
+   int n;
+
+   if (conn->state != POOL_UP)
+      return;
+
+   if (remain > 0)
+   {
+      n = os_tcp_send_nb (
+         conn->peer,
+         (uint8_t *)&conn->tx + conn->tx_sent,
+         remain);
+      if (n < 0)
+      {
+         mb_tcp_pool_down (pool, conn);
+         return;
+      }
+
+      conn->tx_sent += n;
+   }
+
+   mb_tcp_pool_interest (pool, conn);
+}
+
+static void mb_tcp_pool_response (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn)
+{
+   mbap_t * frame = &conn->rx.frame;
+   int result;
+
+   if (!conn->busy || CC_FROM_BE16 (frame->id) != conn->pending.id)
+   {
+      /* Late response to a request that has timed out. Drop it. */
+      return;
+   }
+
+   result = mbus_parse_response (
+      &conn->pending,
+      frame->data,
+      (int)mb_mbap_rx_pdu_size (&conn->rx));
+
+   mb_tcp_pool_complete (pool, conn, result);
+}
+
+static void mb_tcp_pool_receive (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn)
+{
+   mb_mbap_rx_t * rx = &conn->rx;
+
+   /* Receive until the socket would block */
+   while (conn->state == POOL_UP)
+   {
+      int n;
+      int result;
+
+      n = os_tcp_recv_nb (
+         conn->peer,
+         mb_mbap_rx_next (rx),
+         mb_mbap_rx_needed (rx));
+      if (n == 0)
+         return;
+
+      if (n < 0)
+      {
+         mb_tcp_pool_down (pool, conn);
+         return;
+      }
+
+      result = mb_mbap_rx_commit (rx, n);
+      if (result < 0)
+      {
+         /* Invalid header, framing is lost */
+         LOG_WARNING (MB_TCP_LOG, "Invalid MBAP header\n");
+         mb_tcp_pool_down (pool, conn);
+         return;
+      }
+
+      if (result == 1)
+      {
+         mb_tcp_pool_response (pool, conn);
+         mb_mbap_rx_reset (rx);
+      }
+   }
+}
+
+static void mb_tcp_pool_event (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn,
+   uint32_t events)
+{
+   if (conn->state == POOL_CONNECTING)
+   {
+      if ((events & (OS_POLL_OUT | OS_POLL_ERR)) == 0)
+         return;
+
+      if (os_tcp_connect_result (conn->peer) != 0)
+      {
+         mb_tcp_pool_down (pool, conn);
+         return;
+      }
+
+      LOG_INFO (MB_TCP_LOG, "Connection established\n");
+      conn->state = POOL_UP;
+      mb_tcp_pool_flush (pool, conn);
+      return;
+   }
+
+   if (conn->state != POOL_UP)
+      return;
+
+   if (events & OS_POLL_IN)
+      mb_tcp_pool_receive (pool, conn);
+
+   if (events & OS_POLL_OUT)
+      mb_tcp_pool_flush (pool, conn);
+
+   if ((events & OS_POLL_ERR) && conn->state == POOL_UP)
+      mb_tcp_pool_down (pool, conn);
+}
+
+static void mb_tcp_pool_expire (mb_tcp_pool_t * pool)
+{
+   uint32_t now = os_get_current_time_us();
+   size_t i;
+
+   if (pool->num_busy == 0 || pool->timeout == 0)
+      return;
+
+   if (TIME_BEFORE (now, pool->next_deadline))
+      return;
+
+   for (i = 0; i < pool->num_conns; i++)
+   {
+      mb_tcp_pool_conn_t * conn = &pool->conns[i];
+
+      if (conn->busy && !TIME_BEFORE (now, conn->deadline))
+      {
+         if (conn->tx_sent == 0)
+         {
+            /* Nothing has been sent. The request must not be sent
+               when the socket becomes writable. */
+            conn->tx_size = 0;
+            if (mb_tcp_pool_is_open (conn))
+               mb_tcp_pool_interest (pool, conn);
+         }
+         else if (conn->tx_sent < conn->tx_size)
+         {
+            /* The slave has received part of the request. Framing is
+               lost, so the socket can not be used for the next
+               request. */
+            mb_tcp_pool_reconnect (pool, conn);
+         }
+
+         mb_tcp_pool_complete (pool, conn, ETIMEOUT);
+      }
+   }
+
+   /* Find the next deadline. Callbacks may have submitted requests. */
+   pool->next_deadline = now + pool->timeout * 1000;
+   for (i = 0; i < pool->num_conns; i++)
+   {
+      mb_tcp_pool_conn_t * conn = &pool->conns[i];
+
+      if (conn->busy && TIME_BEFORE (conn->deadline, pool->next_deadline))
+         pool->next_deadline = conn->deadline;
+   }
+}
+
+static int mb_tcp_pool_prepare (
+   mb_tcp_pool_t * pool,
+   int handle,
+   mb_tcp_pool_conn_t ** conn)
+{
+   *conn = mb_tcp_pool_get (pool, handle);
+   if (*conn == NULL)
+      return -1;
+
+   if (!mb_tcp_pool_is_open (*conn))
+      return ECONNECTION;
+
+   if ((*conn)->busy)
+      return EWINDOW_FULL;
+
+   return 0;
+}
+
+/* Send the request PDU of the given size in the transmit buffer */
+static void mb_tcp_pool_submit (
+   mb_tcp_pool_t * pool,
+   mb_tcp_pool_conn_t * conn,
+   uint8_t unit,
+   size_t size,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mbus_pending_t * pending = &conn->pending;
+   pdu_txn_t transaction;
+
+   pending->function  = conn->tx.data[0];
+   pending->id        = ++pool->id;
+   pending->slave     = unit;
+   pending->address   = address;
+   pending->quantity  = quantity;
+   pending->buffer    = buffer;
+   pending->callback  = callback;
+   pending->arg       = arg;
+   pending->result    = 0;
+   pending->timestamp = os_get_current_time_us();
+
+   transaction.arg   = conn->peer;
+   transaction.id    = pending->id;
+   transaction.unit  = unit;
+   transaction.flags = 0;
+   transaction.data  = conn->tx.data;
+
+   conn->tx_size = mb_mbap_encode (&conn->tx, &transaction, size);
+   conn->tx_sent = 0;
+
+   conn->deadline = pending->timestamp + pool->timeout * 1000;
+   if (pool->num_busy == 0 || TIME_BEFORE (conn->deadline, pool->next_deadline))
+      pool->next_deadline = conn->deadline;
+
+   conn->busy = true;
+   pool->num_busy++;
+
+   /* Sent when connected, if still connecting */
+   mb_tcp_pool_flush (pool, conn);
+}
+
+int mb_tcp_pool_read (
+   mb_tcp_pool_t * pool,
+   int handle,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mb_tcp_pool_conn_t * conn;
+   int error;
+   int size;
+
+   error = mb_tcp_pool_prepare (pool, handle, &conn);
+   if (error != 0)
+      return error;
+
+   /* There is no broadcast in Modbus/TCP, any unit can be read */
+   size = mbus_build_read (conn->tx.data, 1, address, quantity);
+   if (size < 0)
+      return size;
+
+   mb_tcp_pool_submit (
+      pool,
+      conn,
+      unit,
+      size,
+      address,
+      quantity,
+      buffer,
+      callback,
+      arg);
+   return 0;
+}
+
+int mb_tcp_pool_write (
+   mb_tcp_pool_t * pool,
+   int handle,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mb_tcp_pool_conn_t * conn;
+   int error;
+   int size;
+
+   error = mb_tcp_pool_prepare (pool, handle, &conn);
+   if (error != 0)
+      return error;
+
+   size = mbus_build_write (conn->tx.data, address, quantity, buffer);
+   if (size < 0)
+      return size;
+
+   mb_tcp_pool_submit (
+      pool,
+      conn,
+      unit,
+      size,
+      address,
+      quantity,
+      NULL,
+      callback,
+      arg);
+   return 0;
+}
+
+int mb_tcp_pool_write_single (
+   mb_tcp_pool_t * pool,
+   int handle,
+   uint8_t unit,
+   mb_address_t address,
+   uint16_t value,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mb_tcp_pool_conn_t * conn;
+   int error;
+   int size;
+
+   error = mb_tcp_pool_prepare (pool, handle, &conn);
+   if (error != 0)
+      return error;
+
+   size = mbus_build_write_single (conn->tx.data, address, value);
+   if (size < 0)
+      return size;
+
+   mb_tcp_pool_submit (pool, conn, unit, size, address, 1, NULL, callback, arg);
+   return 0;
+}
+
+int mb_tcp_pool_process (mb_tcp_pool_t * pool, uint32_t tmo)
+{
+   os_poll_event_t events[MAX_EVENTS];
+   uint32_t gen[MAX_EVENTS];
+   int n;
+   int i;
+
+   /* Do not sleep past the earliest deadline */
+   if (pool->num_busy > 0 && pool->timeout != 0)
+   {
+      uint32_t now       = os_get_current_time_us();
+      uint32_t remaining = 0;
+
+      if (TIME_BEFORE (now, pool->next_deadline))
+         remaining = (pool->next_deadline - now + 999) / 1000;
+
+      if (remaining < tmo)
+         tmo = remaining;
+   }
+
+   n = os_poll_wait (pool->set, events, MAX_EVENTS, tmo);
+   if (n < 0)
+      return -1;
+
+   /* Callbacks may close a connection and reuse it for a new socket.
+      Events for the old socket must then be dropped. */
+   for (i = 0; i < n; i++)
+   {
+      mb_tcp_pool_conn_t * conn = events[i].arg;
+
+      gen[i] = conn->gen;
+   }
+
+   for (i = 0; i < n; i++)
+   {
+      mb_tcp_pool_conn_t * conn = events[i].arg;
+
+      if (conn->gen == gen[i])
+         mb_tcp_pool_event (pool, conn, events[i].events);
+   }
+
+   mb_tcp_pool_expire (pool);
+   return (int)pool->num_busy;
+}
+
+bool mb_tcp_pool_is_down (mb_tcp_pool_t * pool, int handle)
+{
+   mb_tcp_pool_conn_t * conn = mb_tcp_pool_get (pool, handle);
+
+   return (conn == NULL) || !mb_tcp_pool_is_open (conn);
+}
+
+int mb_tcp_pool_connect (mb_tcp_pool_t * pool, const char * name)
+{
+   mb_tcp_pool_conn_t * conn = NULL;
+   uint32_t gen;
+   size_t i;
+
+   for (i = 0; i < pool->num_conns; i++)
+   {
+      if (pool->conns[i].state == POOL_FREE)
+      {
+         conn = &pool->conns[i];
+         break;
+      }
+   }
+
+   if (conn == NULL || strlen (name) >= sizeof (conn->name))
+      return -1;
+
+   /* Keep the generation, events may be pending for the old socket */
+   gen = conn->gen;
+   memset (conn, 0, sizeof (*conn));
+   conn->gen = gen;
+   strcpy (conn->name, name);
+
+   if (mb_tcp_pool_open (pool, conn) != 0)
+   {
+      conn->state = POOL_FREE;
+      return -1;
+   }
+
+   return (int)i;
+}
+
+void mb_tcp_pool_close (mb_tcp_pool_t * pool, int handle)
+{
+   mb_tcp_pool_conn_t * conn = mb_tcp_pool_get (pool, handle);
+
+   if (conn == NULL)
+      return;
+
+   if (mb_tcp_pool_is_open (conn))
+   {
+      os_poll_remove (pool->set, conn->peer);
+      os_tcp_close (conn->peer);
+   }
+
+   if (conn->busy)
+      pool->num_busy--;
+
+   conn->busy  = false;
+   conn->state = POOL_FREE;
+   conn->gen++;
+}
+
+void mb_tcp_pool_destroy (mb_tcp_pool_t * pool)
+{
+   size_t i;
+
+   for (i = 0; i < pool->num_conns; i++)
+   {
+      mb_tcp_pool_close (pool, (int)i);
+   }
+
+   os_poll_destroy (pool->set);
+   free (pool->conns);
+   free (pool);
+}
+
+mb_tcp_pool_t * mb_tcp_pool_create (const mb_tcp_pool_cfg_t * cfg)
+{
+   mb_tcp_pool_t * pool;
+
+   pool = calloc (1, sizeof (mb_tcp_pool_t));
+   CC_ASSERT (pool != NULL);
+
+   pool->conns = calloc (cfg->max_connections, sizeof (mb_tcp_pool_conn_t));
+   CC_ASSERT (pool->conns != NULL);
+
+   pool->set = os_poll_create();
+   if (pool->set < 0)
+   {
+      free (pool->conns);
+      free (pool);
+      return NULL;
+   }
+
+   pool->port        = cfg->port;
+   pool->timeout     = cfg->timeout;
+   pool->send_buffer = cfg->send_buffer;
+   pool->num_conns   = cfg->max_connections;
+
+   return pool;
+}
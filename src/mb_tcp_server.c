@@ -0,0 +1,790 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_tcp_server.h"
+#include "mb_tcp.h"
+#include "mb_pdu.h"
+#include "mb_mbap.h"
+#include "mb_diag.h"
+#include "mb_slave_internal.h"
+#include "mb_atomic.h"
+#include "mbal_tcp.h"
+#include "osal.h"
+#include "osal_log.h"
+#include "options.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Maximum number of socket events handled per wait */
+#define MAX_EVENTS 64
+
+/* Maximum number of connections accepted per call */
+#define ACCEPT_BATCH 16
+
+/* Default listen backlog */
+#define DEFAULT_BACKLOG 64
+
+/* Time to wait for events in the server task [ms] */
+#define SERVER_TIMEOUT 100
+
+/* Bytes buffered per connection before receiving is paused, when data
+   is received by os_poll_recv() */
+#define RECV_BACKLOG (4 * sizeof (mbap_t))
+
+typedef struct mb_tcp_server_client
+{
+   int peer;        /**< Socket, or -1 if the slot is free */
+   uint32_t events; /**< Current event interest */
+   size_t tx_size;  /**< Size of response, 0 if receiving */
+   size_t tx_sent;
+   bool busy;       /**< Request is being handled by a worker */
+   bool closing;    /**< Connection lost while busy */
+   bool recv;       /**< Data is received by os_poll_recv() */
+   bool receiving;  /**< Receiving is enabled */
+   bool eof;        /**< End of stream has been received */
+   uint8_t * in;    /**< Data received but not yet handled */
+   size_t in_head;
+   size_t in_tail;
+   size_t in_size;
+   mb_mbap_rx_t rx; /**< Request, replaced by response in place */
+} mb_tcp_server_client_t;
+
+struct mb_tcp_server /* Typedef in mb_tcp_server.h */
+{
+   int set;
+   int listener;
+   bool accepting;
+   volatile uint32_t running; /**< Cleared to stop the server task */
+   mb_slave_t slave;
+   mb_diag_t diag;
+   mb_tcp_server_client_t * clients;
+   size_t max_clients;
+   size_t num_clients;
+   size_t num_workers;
+   os_mbox_t * jobs;   /**< Clients with a request to handle */
+   os_mbox_t * done;   /**< Clients with a response to send */
+   os_sem_t * stopped; /**< Signalled by workers when they exit */
+   int wakeup;         /**< Signalled by workers when done */
+   int cpu;            /**< CPU of the server task, or -1 */
+   os_sem_t * exited;  /**< Signalled by the server task when it exits */
+   mb_tcp_server_t * next; /**< Next shard */
+};
+
+static void mb_tcp_server_close (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client)
+{
+   os_poll_remove (server->set, client->peer);
+
+   if (client->busy)
+   {
+      /* The worker owns the buffers, close when it is done */
+      client->closing = true;
+      return;
+   }
+
+   LOG_INFO (MB_TCP_LOG, "Connection closed\n");
+   os_tcp_close (client->peer);
+   free (client->in);
+   client->peer = -1;
+   client->in   = NULL;
+   server->num_clients--;
+
+   /* A slot is free, resume accepting */
+   if (!server->accepting)
+   {
+      os_poll_modify (server->set, server->listener, OS_POLL_IN, NULL);
+      server->accepting = true;
+   }
+}
+
+static void mb_tcp_server_interest (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client)
+{
+   uint32_t events = 0;
+
+   /* Do not read the next request until the response has been sent */
+   if (!client->busy)
+      events = (client->tx_size > 0) ? OS_POLL_OUT : OS_POLL_IN;
+
+   /* Avoid a system call if nothing changed */
+   if (events != client->events)
+   {
+      os_poll_modify (server->set, client->peer, events, client);
+      client->events = events;
+   }
+
+   if (client->recv)
+   {
+      /* Pause receiving while enough is buffered */
+      bool receiving = !client->eof &&
+                       client->in_tail - client->in_head < RECV_BACKLOG;
+
+      if (receiving != client->receiving)
+      {
+         os_poll_recv (server->set, client->peer, receiving);
+         client->receiving = receiving;
+      }
+   }
+}
+
+/* Buffer data received by os_poll_recv(). Data that arrives after
+   receiving was paused is also kept, so the buffer may grow past
+   RECV_BACKLOG. */
+static int mb_tcp_server_append (
+   mb_tcp_server_client_t * client,
+   const void * data,
+   size_t size)
+{
+   size_t pending = client->in_tail - client->in_head;
+   uint8_t * in;
+
+   if (client->in_tail + size > client->in_size)
+   {
+      if (pending > 0)
+         memmove (client->in, client->in + client->in_head, pending);
+      client->in_head = 0;
+      client->in_tail = pending;
+   }
+
+   if (pending + size > client->in_size)
+   {
+      size_t in_size = pending + size;
+
+      if (in_size < RECV_BACKLOG)
+         in_size = RECV_BACKLOG;
+
+      in = realloc (client->in, in_size);
+      if (in == NULL)
+         return -1;
+
+      client->in      = in;
+      client->in_size = in_size;
+   }
+
+   memcpy (client->in + client->in_tail, data, size);
+   client->in_tail += size;
+   return 0;
+}
+
+/* Receive from the socket, or from the data buffered by
+   mb_tcp_server_append(). Returns 0 if there is nothing to receive,
+   and -1 when the connection is lost. */
+static int mb_tcp_server_recv (
+   mb_tcp_server_client_t * client,
+   void * buffer,
+   size_t size)
+{
+   size_t pending = client->in_tail - client->in_head;
+
+   if (!client->recv)
+      return os_tcp_recv_nb (client->peer, buffer, size);
+
+   if (pending == 0)
+      return client->eof ? -1 : 0;
+
+   if (size > pending)
+      size = pending;
+
+   memcpy (buffer, client->in + client->in_head, size);
+   client->in_head += size;
+   if (client->in_head == client->in_tail)
+   {
+      client->in_head = 0;
+      client->in_tail = 0;
+   }
+
+   return (int)size;
+}
+
+/* Handle the request in the receive buffer. The response is built in
+   the same buffer. */
+static void mb_tcp_server_request (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client)
+{
+   mbap_t * frame = &client->rx.frame;
+   pdu_txn_t transaction;
+   int tx_count;
+
+   tx_count = mb_slave_dispatch (
+      &server->slave,
+      frame->unit,
+      (pdu_t *)frame->data,
+      mb_mbap_rx_pdu_size (&client->rx),
+      false);
+
+   transaction.arg   = client->peer;
+   transaction.id    = CC_FROM_BE16 (frame->id);
+   transaction.unit  = frame->unit;
+   transaction.flags = 0;
+   transaction.data  = frame->data;
+
+   /* Nothing is sent if the unit is not served */
+   client->tx_size = (tx_count > 0)
+                        ? mb_mbap_encode (frame, &transaction, tx_count)
+                        : 0;
+   client->tx_sent = 0;
+}
+
+/* Send as much as possible of the response. Returns true when the
+   response has been sent. */
+static bool mb_tcp_server_flush (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client)
+{
+   size_t remain = client->tx_size - client->tx_sent;
+   int n;
+
+   /* No response, the request was to a unit that is not served */
+   if (client->tx_size == 0)
+   {
+      mb_mbap_rx_reset (&client->rx);
+      return true;
+   }
+
+   n = os_tcp_send_nb (
+      client->peer,
+      (uint8_t *)&client->rx.frame + client->tx_sent,
+      remain);
+   if (n < 0)
+   {
+      mb_tcp_server_close (server, client);
+      return false;
+   }
+
+   client->tx_sent += n;
+   if (client->tx_sent < client->tx_size)
+      return false;
+
+   client->tx_size = 0;
+   mb_mbap_rx_reset (&client->rx);
+   return true;
+}
+
+/* Receive and handle requests until the socket would block, or a
+   response could not be sent in full */
+static void mb_tcp_server_receive (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client)
+{
+   mb_mbap_rx_t * rx = &client->rx;
+
+   for (;;)
+   {
+      int n;
+      int result;
+
+      n = mb_tcp_server_recv (
+         client,
+         mb_mbap_rx_next (rx),
+         mb_mbap_rx_needed (rx));
+      if (n == 0)
+         break;
+
+      if (n < 0)
+      {
+         mb_tcp_server_close (server, client);
+         return;
+      }
+
+      result = mb_mbap_rx_commit (rx, n);
+      if (result < 0)
+      {
+         /* Invalid header, framing is lost */
+         mb_diag_count (&server->diag, MB_DIAG_BUS_ERRORS);
+         LOG_WARNING (MB_TCP_LOG, "Invalid MBAP header\n");
+         mb_tcp_server_close (server, client);
+         return;
+      }
+
+      if (result == 1)
+      {
+         mb_diag_count (&server->diag, MB_DIAG_BUS_MESSAGES);
+
+         if (server->num_workers > 0)
+         {
+            /* Further requests are not read until the response has
+               been sent, so responses are in order */
+            client->busy = true;
+            os_mbox_post (server->jobs, client, 0);
+            break;
+         }
+
+         mb_tcp_server_request (server, client);
+         if (!mb_tcp_server_flush (server, client))
+         {
+            if (client->peer == -1)
+               return;
+            break;
+         }
+      }
+   }
+
+   mb_tcp_server_interest (server, client);
+}
+
+static void mb_tcp_server_event (
+   mb_tcp_server_t * server,
+   mb_tcp_server_client_t * client,
+   const os_poll_event_t * event)
+{
+   uint32_t events = event->events;
+
+   if (client->peer == -1)
+      return;
+
+   if (events & OS_POLL_DATA)
+   {
+      if (mb_tcp_server_append (client, event->data, event->size) != 0)
+      {
+         mb_tcp_server_close (server, client);
+         return;
+      }
+   }
+
+   if (client->recv && (events & OS_POLL_ERR))
+   {
+      /* End of stream. The requests received before it are served
+         before the connection is closed. */
+      client->eof = true;
+      events      = (events & ~OS_POLL_ERR) | OS_POLL_IN;
+   }
+
+   if (client->busy)
+   {
+      /* Only errors and received data are reported while busy */
+      if (events & OS_POLL_ERR)
+         mb_tcp_server_close (server, client);
+      else
+         mb_tcp_server_interest (server, client);
+      return;
+   }
+
+   if (events & OS_POLL_OUT)
+   {
+      if (!mb_tcp_server_flush (server, client))
+         return;
+   }
+   else if (client->tx_size > 0)
+   {
+      /* Received data is handled when the response has been sent */
+      if (events & OS_POLL_ERR)
+         mb_tcp_server_close (server, client);
+      else
+         mb_tcp_server_interest (server, client);
+      return;
+   }
+
+   if (events & (OS_POLL_IN | OS_POLL_OUT | OS_POLL_DATA))
+   {
+      /* Serve requests that arrived while the response was sent */
+      mb_tcp_server_receive (server, client);
+      return;
+   }
+
+   if (events & OS_POLL_ERR)
+      mb_tcp_server_close (server, client);
+}
+
+static void mb_tcp_server_worker (void * arg)
+{
+   mb_tcp_server_t * server = arg;
+   void * msg;
+
+   for (;;)
+   {
+      if (os_mbox_fetch (server->jobs, &msg, OS_WAIT_FOREVER))
+         continue;
+
+      /* NULL is posted when the server is destroyed */
+      if (msg == NULL)
+         break;
+
+      mb_tcp_server_request (server, msg);
+
+      os_mbox_post (server->done, msg, OS_WAIT_FOREVER);
+      os_wakeup_signal (server->wakeup);
+   }
+
+   os_sem_signal (server->stopped);
+}
+
+/* Send the responses built by the workers */
+static void mb_tcp_server_completed (mb_tcp_server_t * server)
+{
+   void * msg;
+
+   os_wakeup_clear (server->wakeup);
+
+   while (!os_mbox_fetch (server->done, &msg, 0))
+   {
+      mb_tcp_server_client_t * client = msg;
+
+      client->busy = false;
+      if (client->closing)
+      {
+         mb_tcp_server_close (server, client);
+         continue;
+      }
+
+      if (mb_tcp_server_flush (server, client))
+         mb_tcp_server_receive (server, client);
+      else if (client->peer != -1)
+         mb_tcp_server_interest (server, client);
+   }
+}
+
+static void mb_tcp_server_add (mb_tcp_server_t * server, int peer)
+{
+   mb_tcp_server_client_t * client = NULL;
+   size_t i;
+
+   for (i = 0; i < server->max_clients; i++)
+   {
+      if (server->clients[i].peer == -1)
+      {
+         client = &server->clients[i];
+         break;
+      }
+   }
+
+   CC_ASSERT (client != NULL);
+
+   memset (client, 0, sizeof (*client));
+   client->peer   = peer;
+   client->events = OS_POLL_IN;
+   mb_mbap_rx_reset (&client->rx);
+
+   if (os_poll_add (server->set, peer, client->events, client) != 0)
+   {
+      os_tcp_close (peer);
+      client->peer = -1;
+      return;
+   }
+
+   /* Let the port receive without a system call per request, if it
+      can */
+   client->recv      = os_poll_recv (server->set, peer, true) == 0;
+   client->receiving = client->recv;
+
+   LOG_INFO (MB_TCP_LOG, "Connection established\n");
+   server->num_clients++;
+}
+
+static void mb_tcp_server_accept (mb_tcp_server_t * server)
+{
+   int peers[ACCEPT_BATCH];
+   size_t max;
+   int n;
+   int i;
+
+   /* Accept until the backlog is empty or the server is full */
+   do
+   {
+      max = server->max_clients - server->num_clients;
+      if (max == 0)
+      {
+         /* Leave further connections in the backlog until a slot is
+            free */
+         os_poll_modify (server->set, server->listener, 0, NULL);
+         server->accepting = false;
+         return;
+      }
+
+      if (max > NELEMENTS (peers))
+         max = NELEMENTS (peers);
+
+      n = os_tcp_accept_nb (server->listener, peers, max);
+      for (i = 0; i < n; i++)
+      {
+         mb_tcp_server_add (server, peers[i]);
+      }
+   } while (n == (int)max);
+}
+
+int mb_tcp_server_process (mb_tcp_server_t * server, uint32_t tmo)
+{
+   os_poll_event_t events[MAX_EVENTS];
+   int n;
+   int i;
+
+   n = os_poll_wait (server->set, events, MAX_EVENTS, tmo);
+   if (n < 0)
+      return -1;
+
+   for (i = 0; i < n; i++)
+   {
+      if (events[i].arg == NULL)
+         mb_tcp_server_accept (server);
+      else if (events[i].arg == &server->wakeup)
+         mb_tcp_server_completed (server);
+      else
+         mb_tcp_server_event (server, events[i].arg, &events[i]);
+   }
+
+   return (int)server->num_clients;
+}
+
+void mb_tcp_server_destroy (mb_tcp_server_t * server)
+{
+   size_t i;
+
+   if (server->num_workers > 0)
+   {
+      /* Workers finish the jobs in the queue before they exit */
+      for (i = 0; i < server->num_workers; i++)
+      {
+         os_mbox_post (server->jobs, NULL, OS_WAIT_FOREVER);
+      }
+
+      for (i = 0; i < server->num_workers; i++)
+      {
+         os_sem_wait (server->stopped, OS_WAIT_FOREVER);
+      }
+
+      os_mbox_destroy (server->jobs);
+      os_mbox_destroy (server->done);
+      os_sem_destroy (server->stopped);
+      os_wakeup_destroy (server->wakeup);
+   }
+
+   for (i = 0; i < server->max_clients; i++)
+   {
+      if (server->clients[i].peer != -1)
+      {
+         os_tcp_close (server->clients[i].peer);
+         free (server->clients[i].in);
+      }
+   }
+
+   os_tcp_close (server->listener);
+   os_poll_destroy (server->set);
+   free (server->slave.units);
+   free (server->clients);
+   free (server);
+}
+
+mb_tcp_server_t * mb_tcp_server_create (const mb_tcp_server_cfg_t * cfg)
+{
+   mb_tcp_server_t * server;
+   int backlog = (cfg->backlog > 0) ? cfg->backlog : DEFAULT_BACKLOG;
+   int error;
+   size_t i;
+
+   server = calloc (1, sizeof (mb_tcp_server_t));
+   CC_ASSERT (server != NULL);
+
+   server->clients = calloc (cfg->max_clients, sizeof (mb_tcp_server_client_t));
+   CC_ASSERT (server->clients != NULL);
+
+   for (i = 0; i < cfg->max_clients; i++)
+   {
+      server->clients[i].peer = -1;
+   }
+
+   server->set = os_poll_create();
+   if (server->set < 0)
+      goto error1;
+
+   if (cfg->num_shards > 1)
+      server->listener = os_tcp_listen_shared (cfg->port, backlog);
+   else
+      server->listener = os_tcp_listen (cfg->port, backlog);
+   if (server->listener < 0)
+      goto error2;
+
+   if (os_poll_add (server->set, server->listener, OS_POLL_IN, NULL) != 0)
+      goto error3;
+
+   /* Requests are dispatched as by a slave without transport. There
+      are no broadcasts in Modbus/TCP. */
+   mb_slave_iomap_set (&server->slave, cfg->iomap);
+   if (mb_slave_units_set (&server->slave, cfg->units, cfg->num_units) != 0)
+      goto error3;
+
+   server->slave.transport = NULL;
+   server->slave.diag      = &server->diag;
+   server->max_clients     = cfg->max_clients;
+   server->accepting       = true;
+   server->cpu             = -1;
+   mb_atomic_store (&server->running, 1);
+
+   if (cfg->num_workers > 0)
+   {
+      server->wakeup = os_wakeup_create();
+      if (server->wakeup < 0)
+         goto error3;
+
+      error = os_poll_add (
+         server->set,
+         server->wakeup,
+         OS_POLL_IN,
+         &server->wakeup);
+      if (error != 0)
+      {
+         os_wakeup_destroy (server->wakeup);
+         goto error3;
+      }
+
+      /* Every client has at most one job, plus one exit message per
+         worker */
+      server->jobs    = os_mbox_create (cfg->max_clients + cfg->num_workers);
+      server->done    = os_mbox_create (cfg->max_clients);
+      server->stopped = os_sem_create (0);
+      CC_ASSERT (server->jobs != NULL);
+      CC_ASSERT (server->done != NULL);
+      CC_ASSERT (server->stopped != NULL);
+
+      server->num_workers = cfg->num_workers;
+      for (i = 0; i < cfg->num_workers; i++)
+      {
+         os_thread_create (
+            "tMbWorker",
+            cfg->priority,
+            cfg->stack_size,
+            mb_tcp_server_worker,
+            server);
+      }
+   }
+
+   return server;
+
+error3:
+   free (server->slave.units);
+   os_tcp_close (server->listener);
+error2:
+   os_poll_destroy (server->set);
+error1:
+   free (server->clients);
+   free (server);
+   return NULL;
+}
+
+uint32_t mb_tcp_server_diag_get (
+   mb_tcp_server_t * server,
+   mb_diag_counter_t counter)
+{
+   uint32_t value = 0;
+
+   for (; server != NULL; server = server->next)
+   {
+      value += mb_slave_diag_get (&server->slave, counter);
+   }
+
+   return value;
+}
+
+static void mb_tcp_server_task (void * arg)
+{
+   mb_tcp_server_t * server = arg;
+   size_t i;
+
+   if (server->cpu >= 0)
+      os_thread_pin (server->cpu);
+
+   while (mb_atomic_load (&server->running))
+   {
+      mb_tcp_server_process (server, SERVER_TIMEOUT);
+   }
+
+   /* Remove the sockets from the set on this thread, which is the only
+      one that may use it on some ports. The sockets are then released
+      when they are closed. */
+   os_poll_remove (server->set, server->listener);
+   for (i = 0; i < server->max_clients; i++)
+   {
+      if (server->clients[i].peer != -1)
+         os_poll_remove (server->set, server->clients[i].peer);
+   }
+
+   /* The server is destroyed by mb_tcp_server_shutdown() */
+   os_sem_signal (server->exited);
+}
+
+mb_tcp_server_t * mb_tcp_server_init (const mb_tcp_server_cfg_t * cfg)
+{
+   mb_tcp_server_t * first = NULL;
+   mb_tcp_server_t ** last = &first;
+   mb_tcp_server_t * server;
+   size_t num_shards = (cfg->num_shards > 0) ? cfg->num_shards : 1;
+   size_t i;
+
+   /* Create all shards before any task is started, so that nothing
+      is left running on failure */
+   for (i = 0; i < num_shards; i++)
+   {
+      server = mb_tcp_server_create (cfg);
+      if (server == NULL)
+         goto error;
+
+      if (cfg->cpus != NULL)
+         server->cpu = cfg->cpus[i];
+
+      server->exited = os_sem_create (0);
+      CC_ASSERT (server->exited != NULL);
+
+      *last = server;
+      last  = &server->next;
+   }
+
+   for (server = first; server != NULL; server = server->next)
+   {
+      os_thread_create (
+         "tMbServer",
+         cfg->priority,
+         cfg->stack_size,
+         mb_tcp_server_task,
+         server);
+   }
+
+   return first;
+
+error:
+   while (first != NULL)
+   {
+      server = first->next;
+      os_sem_destroy (first->exited);
+      mb_tcp_server_destroy (first);
+      first = server;
+   }
+   return NULL;
+}
+
+void mb_tcp_server_shutdown (mb_tcp_server_t * server)
+{
+   mb_tcp_server_t * shard;
+   mb_tcp_server_t * next;
+
+   /* Stop all shards before waiting, so that they stop in parallel */
+   for (shard = server; shard != NULL; shard = shard->next)
+   {
+      mb_atomic_store (&shard->running, 0);
+
+      /* Wake the task now instead of at its next poll timeout */
+      if (shard->num_workers > 0)
+         os_wakeup_signal (shard->wakeup);
+   }
+
+   for (shard = server; shard != NULL; shard = next)
+   {
+      next = shard->next;
+      os_sem_wait (shard->exited, OS_WAIT_FOREVER);
+      os_sem_destroy (shard->exited);
+      mb_tcp_server_destroy (shard);
+   }
+}
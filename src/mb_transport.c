@@ -30,6 +30,12 @@ bool mb_transport_is_down (mb_transport_t * transport)
    return transport->is_down (transport);
 }
 
+void mb_transport_wakeup (mb_transport_t * transport)
+{
+   if (transport->wakeup != NULL)
+      transport->wakeup (transport);
+}
+
 void mb_pdu_tx (
    mb_transport_t * transport,
    const pdu_txn_t * transaction,
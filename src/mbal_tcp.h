@@ -24,11 +24,73 @@ extern "C" {
 #include "mb_transport.h"
 
 int os_tcp_connect (const char * name, uint16_t port);
-int os_tcp_accept_connection (uint16_t port);
+int os_tcp_listen (uint16_t port, int backlog);
+int os_tcp_accept (int listener, int wakeup, uint32_t tmo);
 void os_tcp_close (int peer);
 int os_tcp_send (int peer, const void * buffer, size_t size);
 int os_tcp_recv (int peer, void * buffer, size_t size);
-int os_tcp_recv_wait (int peer, uint32_t tmo);
+int os_tcp_recv_some (int peer, void * buffer, size_t size);
+int os_tcp_recv_wait (int peer, int wakeup, uint32_t tmo);
+
+/* Wakeup of a thread that waits for socket events. The descriptor
+   becomes readable when signalled. It can be passed to
+   os_tcp_recv_wait() and os_tcp_accept(), which then return 0 as on
+   timeout when it is signalled and clear it, or be added to a poll
+   set. Pass -1 to wait without wakeup. */
+
+int os_wakeup_create (void);
+void os_wakeup_destroy (int wakeup);
+void os_wakeup_signal (int wakeup);
+void os_wakeup_clear (int wakeup);
+
+/* Non-blocking sockets and readiness notification. These are only
+   required by modules that serve many connections from one thread,
+   and are not available on all ports. */
+
+#define OS_POLL_IN   0x01 /* Socket is readable */
+#define OS_POLL_OUT  0x02 /* Socket is writable, or connect has completed */
+#define OS_POLL_ERR  0x04 /* Error or hangup */
+#define OS_POLL_DATA 0x08 /* Data received, see os_poll_recv() */
+
+typedef struct os_poll_event
+{
+   uint32_t events;
+   void * arg;
+   const void * data; /* Received data, with OS_POLL_DATA */
+   size_t size;       /* Size of received data */
+} os_poll_event_t;
+
+int os_poll_create (void);
+void os_poll_destroy (int set);
+int os_poll_add (int set, int fd, uint32_t events, void * arg);
+int os_poll_modify (int set, int fd, uint32_t events, void * arg);
+int os_poll_remove (int set, int fd);
+int os_poll_wait (int set, os_poll_event_t * events, int max, uint32_t tmo);
+
+/* Receive on a socket in the set without a system call per receive.
+   Data is then reported as OS_POLL_DATA instead of OS_POLL_IN, and
+   stays valid until the next call to os_poll_wait(). The end of the
+   stream is reported as OS_POLL_ERR. Receiving is paused by passing
+   false; data that has already been received is still reported.
+   Returns -1 if not supported by the port, in which case the socket
+   is left as it was. */
+int os_poll_recv (int set, int fd, bool enable);
+
+int os_tcp_connect_start (const char * name, uint16_t port);
+int os_tcp_connect_result (int peer);
+int os_tcp_send_nb (int peer, const void * buffer, size_t size);
+int os_tcp_recv_nb (int peer, void * buffer, size_t size);
+int os_tcp_accept_nb (int listener, int * peers, size_t max);
+
+/* Set the size of the socket send buffer */
+int os_tcp_send_buffer (int peer, size_t size);
+
+/* Listening socket that shares its port with other listening sockets
+   (SO_REUSEPORT). Incoming connections are spread across them. */
+int os_tcp_listen_shared (uint16_t port, int backlog);
+
+/* Run the calling thread on the given CPU only */
+int os_thread_pin (int cpu);
 
 #ifdef __cplusplus
 }
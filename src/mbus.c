@@ -19,6 +19,8 @@
 #endif
 
 #include "mbus.h"
+#include "mbus_cache.h"
+#include "mbus_internal.h"
 #include "mb_pdu.h"
 #include "mb_crc.h"
 #include "osal.h"
@@ -50,19 +52,20 @@ static int mb_exception (pdu_exception_t * pdu)
    }
 }
 
-int mbus_read (
-   mbus_t * mbus,
+typedef enum mbus_state
+{
+   MBUS_FREE = 0,
+   MBUS_PENDING,
+   MBUS_DONE,
+} mbus_state_t;
+
+int mbus_build_read (
+   void * pdu,
    int slave,
    mb_address_t address,
-   uint16_t quantity,
-   void * buffer)
+   uint16_t quantity)
 {
-   pdu_txn_t * transaction = &mbus->transaction;
-   pdu_read_t * request    = mbus->scratch;
-   void * response         = mbus->scratch;
-   int rx_count            = 0;
-   int result;
-   int i;
+   pdu_read_t * request = pdu;
 
    if (slave == 0)
    {
@@ -70,7 +73,6 @@ int mbus_read (
       return -1;
    }
 
-   /* Build request */
    switch (address >> 16)
    {
    case 0:
@@ -107,64 +109,16 @@ int mbus_read (
    request->address  = CC_TO_BE16 ((address - 1) & 0xFFFF);
    request->quantity = CC_TO_BE16 (quantity);
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = mbus->scratch;
-   transaction->unit = slave;
-   transaction->id++;
-
-   /* Send request, receive response */
-   mb_pdu_tx (mbus->transport, transaction, sizeof (*request));
-   rx_count = mb_pdu_rx (mbus->transport, transaction, mbus->timeout);
-
-   if (rx_count < 0)
-   {
-      result = rx_count;
-   }
-   else if (mb_is_exception (response))
-   {
-      result = mb_exception (response);
-   }
-   else
-   {
-      pdu_read_response_t * read_response = response;
-      switch (read_response->function)
-      {
-      case PDU_READ_COILS: /* Fall-through */
-      case PDU_READ_INPUTS:
-         memcpy (buffer, read_response->data, read_response->count);
-         result = 0;
-         break;
-      case PDU_READ_INPUT_REGISTERS: /* Fall-through */
-      case PDU_READ_HOLDING_REGISTERS:
-         for (i = 0; i < read_response->count; i += 2)
-         {
-            ((uint8_t *)buffer)[i + 1] = read_response->data[i];
-            ((uint8_t *)buffer)[i]     = read_response->data[i + 1];
-         }
-         result = 0;
-         break;
-      default:
-         result = -1;
-         break;
-      }
-   }
-
-   return result;
+   return sizeof (*request);
 }
 
-int mbus_write_single (
-   mbus_t * mbus,
-   int slave,
+int mbus_build_write_single (
+   void * pdu,
    mb_address_t address,
    uint16_t value)
 {
-   pdu_txn_t * transaction      = &mbus->transaction;
-   pdu_write_single_t * request = mbus->scratch;
-   void * response              = mbus->scratch;
-   int rx_count                 = 0;
-   int result;
+   pdu_write_single_t * request = pdu;
 
-   /* Build request */
    switch (address >> 16)
    {
    case 0:
@@ -180,51 +134,19 @@ int mbus_write_single (
    request->address = CC_TO_BE16 ((address - 1) & 0xFFFF);
    request->value   = CC_TO_BE16 (value);
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = mbus->scratch;
-   transaction->unit = slave;
-   transaction->id++;
-
-   /* Send request, receive response */
-   mb_pdu_tx (mbus->transport, transaction, sizeof (*request));
-
-   if (slave != 0)
-   {
-      rx_count = mb_pdu_rx (mbus->transport, transaction, mbus->timeout);
-   }
-
-   if (rx_count < 0)
-   {
-      result = rx_count;
-   }
-   else if (mb_is_exception (response))
-   {
-      result = mb_exception (response);
-   }
-   else
-   {
-      result = 0;
-   }
-
-   return result;
+   return sizeof (*request);
 }
 
-int mbus_write (
-   mbus_t * mbus,
-   int slave,
+int mbus_build_write (
+   void * pdu,
    mb_address_t address,
    uint16_t quantity,
-   void * buffer)
+   const void * buffer)
 {
-   pdu_txn_t * transaction = &mbus->transaction;
-   pdu_write_t * request   = mbus->scratch;
-   void * response         = mbus->scratch;
-   int rx_count            = 0;
-   int result;
-   uint8_t count = 0;
+   pdu_write_t * request = pdu;
+   uint8_t count         = 0;
    int i;
 
-   /* Build request */
    switch (address >> 16)
    {
    case 0:
@@ -249,8 +171,8 @@ int mbus_write (
       count             = 2 * quantity;
       for (i = 0; i < count; i += 2)
       {
-         request->data[i]     = ((uint8_t *)buffer)[i + 1];
-         request->data[i + 1] = ((uint8_t *)buffer)[i];
+         request->data[i]     = ((const uint8_t *)buffer)[i + 1];
+         request->data[i + 1] = ((const uint8_t *)buffer)[i];
       }
       break;
    default:
@@ -260,91 +182,997 @@ int mbus_write (
    request->quantity = CC_TO_BE16 (quantity);
    request->count    = count;
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = mbus->scratch;
-   transaction->unit = slave;
-   transaction->id++;
+   return sizeof (*request) + count;
+}
 
-   /* Send request, receive response */
-   mb_pdu_tx (mbus->transport, transaction, (sizeof (pdu_write_t) + count));
+int mbus_build_mask_write (
+   void * pdu,
+   mb_address_t address,
+   uint16_t and_mask,
+   uint16_t or_mask)
+{
+   pdu_mask_write_t * request = pdu;
 
-   if (slave != 0)
+   if ((address >> 16) != 4)
    {
-      rx_count = mb_pdu_rx (mbus->transport, transaction, mbus->timeout);
+      return -1;
    }
 
-   if (rx_count < 0)
+   request->function = PDU_MASK_WRITE_HOLDING_REGISTER;
+   request->address  = CC_TO_BE16 ((address - 1) & 0xFFFF);
+   request->and_mask = CC_TO_BE16 (and_mask);
+   request->or_mask  = CC_TO_BE16 (or_mask);
+
+   return sizeof (*request);
+}
+
+int mbus_build_read_write (
+   void * pdu,
+   int slave,
+   mb_address_t read_address,
+   uint16_t read_quantity,
+   mb_address_t write_address,
+   uint16_t write_quantity,
+   const void * buffer)
+{
+   pdu_read_write_t * request = pdu;
+   uint8_t count              = 2 * write_quantity;
+   int i;
+
+   if (slave == 0)
    {
-      result = rx_count;
+      /* Broadcast read is not possible */
+      return -1;
    }
-   else if (mb_is_exception (response))
+
+   if ((read_address >> 16) != 4 || (write_address >> 16) != 4)
    {
-      result = mb_exception (response);
+      return -1;
    }
-   else
+
+   if (read_quantity == 0 || read_quantity > 125)
    {
-      result = 0;
+      return -1;
    }
 
-   return result;
+   if (write_quantity == 0 || write_quantity > 121)
+   {
+      return -1;
+   }
+
+   request->function       = PDU_READ_WRITE_HOLDING_REGISTERS;
+   request->read_address   = CC_TO_BE16 ((read_address - 1) & 0xFFFF);
+   request->read_quantity  = CC_TO_BE16 (read_quantity);
+   request->write_address  = CC_TO_BE16 ((write_address - 1) & 0xFFFF);
+   request->write_quantity = CC_TO_BE16 (write_quantity);
+   request->count          = count;
+
+   for (i = 0; i < count; i += 2)
+   {
+      request->data[i]     = ((const uint8_t *)buffer)[i + 1];
+      request->data[i + 1] = ((const uint8_t *)buffer)[i];
+   }
+
+   return sizeof (*request) + count;
 }
 
-int mbus_loopback (mbus_t * mbus, int slave, uint16_t size, void * buffer)
+static int mbus_build_loopback (void * pdu, uint16_t size, const void * buffer)
 {
-   pdu_txn_t * transaction = &mbus->transaction;
-   pdu_diag_t * request    = mbus->scratch;
-   void * response         = mbus->scratch;
-   int rx_count            = 0;
-   int result;
+   pdu_diag_t * request = pdu;
 
    if (size > 250)
    {
       return -1;
    }
 
-   /* Build request */
    request->function     = PDU_DIAGNOSTICS;
    request->sub_function = PDU_DIAG_LOOPBACK;
 
    memcpy (request->data, buffer, size);
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = mbus->scratch;
-   transaction->unit = slave;
-   transaction->id++;
+   return sizeof (*request) + size;
+}
+
+/* Return true if the byte count of a read response matches the
+   requested quantity, and all data was received */
+static bool mbus_is_valid_count (
+   const mbus_pending_t * pending,
+   const pdu_read_response_t * read_response,
+   int rx_count)
+{
+   size_t expected;
+
+   if (
+      pending->function == PDU_READ_COILS ||
+      pending->function == PDU_READ_INPUTS)
+      expected = (pending->quantity + 7) / 8;
+   else
+      expected = 2 * (size_t)pending->quantity;
+
+   return read_response->count == expected &&
+          (size_t)rx_count >= sizeof (*read_response) + expected;
+}
+
+int mbus_parse_response (
+   mbus_pending_t * pending,
+   void * response,
+   int rx_count)
+{
+   pdu_read_response_t * read_response = response;
+   uint8_t * buffer                    = pending->buffer;
+   int i;
+
+   if (rx_count < 0)
+   {
+      return rx_count;
+   }
+
+   if (mb_is_exception (response))
+   {
+      return mb_exception (response);
+   }
+
+   switch (pending->function)
+   {
+   case PDU_READ_COILS: /* Fall-through */
+   case PDU_READ_INPUTS:
+      if (read_response->function != pending->function)
+         return -1;
+      if (!mbus_is_valid_count (pending, read_response, rx_count))
+         return -1;
+      memcpy (buffer, read_response->data, read_response->count);
+      return 0;
+   case PDU_READ_INPUT_REGISTERS:   /* Fall-through */
+   case PDU_READ_HOLDING_REGISTERS: /* Fall-through */
+   case PDU_READ_WRITE_HOLDING_REGISTERS:
+      if (read_response->function != pending->function)
+         return -1;
+      if (!mbus_is_valid_count (pending, read_response, rx_count))
+         return -1;
+      for (i = 0; i < read_response->count; i += 2)
+      {
+         buffer[i + 1] = read_response->data[i];
+         buffer[i]     = read_response->data[i + 1];
+      }
+      return 0;
+   case PDU_WRITE_COIL:             /* Fall-through */
+   case PDU_WRITE_HOLDING_REGISTER: /* Fall-through */
+   case PDU_WRITE_COILS:             /* Fall-through */
+   case PDU_WRITE_HOLDING_REGISTERS: /* Fall-through */
+   case PDU_MASK_WRITE_HOLDING_REGISTER:
+      return 0;
+   case PDU_DIAGNOSTICS:
+      memcpy (
+         buffer,
+         response,
+         (rx_count > pending->quantity) ? pending->quantity : rx_count);
+      return rx_count;
+   default:
+      return -1;
+   }
+}
+
+static bool mbus_is_expired (mbus_t * mbus, mbus_pending_t * pending)
+{
+   uint32_t elapsed = os_get_current_time_us() - pending->timestamp;
+
+   /* A timeout of 0 means to wait forever */
+   if (mbus->timeout == 0)
+      return false;
+
+   return elapsed >= mbus->timeout * 1000;
+}
+
+static uint32_t mbus_remaining (mbus_t * mbus, mbus_pending_t * pending)
+{
+   uint32_t elapsed = (os_get_current_time_us() - pending->timestamp) / 1000;
+
+   if (mbus->timeout == 0)
+      return 0;
+
+   /* Never return 0 here, as that would wait forever */
+   return (elapsed < mbus->timeout) ? mbus->timeout - elapsed : 1;
+}
+
+static bool mbus_is_read (uint8_t function)
+{
+   return function == PDU_READ_COILS || function == PDU_READ_INPUTS ||
+          function == PDU_READ_INPUT_REGISTERS ||
+          function == PDU_READ_HOLDING_REGISTERS ||
+          function == PDU_READ_WRITE_HOLDING_REGISTERS;
+}
+
+static bool mbus_is_write (uint8_t function)
+{
+   return function == PDU_WRITE_COIL ||
+          function == PDU_WRITE_HOLDING_REGISTER ||
+          function == PDU_WRITE_COILS ||
+          function == PDU_WRITE_HOLDING_REGISTERS;
+}
+
+/* Update the cache with values that are about to be written */
+static void mbus_cache_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer)
+{
+   if (mbus->cache == NULL)
+      return;
+
+   if (slave == 0)
+   {
+      /* Broadcast, may change any slave */
+      mbus_cache_clear (mbus->cache);
+      return;
+   }
+
+   mbus_cache_store (mbus->cache, slave, address, quantity, buffer);
+}
+
+static void mbus_cache_write_single (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t value)
+{
+   uint8_t bit = (value != 0) ? 1 : 0;
+
+   if ((address >> 16) == 0)
+      mbus_cache_write (mbus, slave, address, 1, &bit);
+   else
+      mbus_cache_write (mbus, slave, address, 1, &value);
+}
+
+static void mbus_complete (
+   mbus_t * mbus,
+   mbus_pending_t * pending,
+   int result)
+{
+   mbus_callback_t callback = pending->callback;
+
+   pending->result = result;
+   pending->state  = MBUS_DONE;
+
+   if (mbus->cache != NULL && pending->slave != 0)
+   {
+      if (result == 0 && mbus_is_read (pending->function))
+      {
+         mbus_cache_fill (
+            mbus->cache,
+            pending->slave,
+            pending->address,
+            pending->quantity,
+            pending->buffer,
+            pending->cache_seq);
+      }
+      else if (result != 0 && mbus_is_write (pending->function))
+      {
+         /* The write may or may not have taken effect */
+         mbus_cache_invalidate (
+            mbus->cache,
+            pending->slave,
+            pending->address,
+            pending->quantity);
+      }
+   }
+
+   if (callback != NULL)
+   {
+      /* Asynchronous requests are released before the callback is
+         called, so that the callback can submit new requests */
+      pending->state = MBUS_FREE;
+      callback (result, pending->arg);
+   }
+}
+
+static mbus_pending_t * mbus_oldest (mbus_t * mbus)
+{
+   mbus_pending_t * oldest = NULL;
+   size_t i;
+
+   for (i = 0; i < NELEMENTS (mbus->pending); i++)
+   {
+      mbus_pending_t * pending = &mbus->pending[i];
+
+      if (pending->state != MBUS_PENDING)
+         continue;
+
+      if (oldest == NULL ||
+          (int32_t)(pending->timestamp - oldest->timestamp) < 0)
+      {
+         oldest = pending;
+      }
+   }
+
+   return oldest;
+}
+
+static mbus_pending_t * mbus_find (mbus_t * mbus, uint16_t id)
+{
+   size_t i;
+
+   for (i = 0; i < NELEMENTS (mbus->pending); i++)
+   {
+      mbus_pending_t * pending = &mbus->pending[i];
+
+      if (pending->state == MBUS_PENDING && pending->id == id)
+         return pending;
+   }
+
+   return NULL;
+}
+
+/* Return a transaction ID that is not used by any outstanding
+   request. The ID of a received response is not used, as it may
+   belong to any of them. */
+static uint16_t mbus_next_id (mbus_t * mbus)
+{
+   do
+   {
+      mbus->next_id++;
+   } while (mbus_find (mbus, mbus->next_id) != NULL);
+
+   return mbus->next_id;
+}
+
+static size_t mbus_in_flight (mbus_t * mbus)
+{
+   size_t count = 0;
+   size_t i;
+
+   for (i = 0; i < NELEMENTS (mbus->pending); i++)
+   {
+      if (mbus->pending[i].state == MBUS_PENDING)
+         count++;
+   }
 
-   /* Send request, receive response */
-   mb_pdu_tx (mbus->transport, transaction, size + sizeof (*request));
-   if (slave != 0)
+   return count;
+}
+
+/* Receive one response, or time out the oldest outstanding
+   request. Wait at most tmo ms, unless tmo is 0. */
+static void mbus_receive (mbus_t * mbus, uint32_t tmo)
+{
+   pdu_txn_t * transaction = &mbus->transaction;
+   mbus_pending_t * oldest = mbus_oldest (mbus);
+   mbus_pending_t * pending;
+   uint32_t remaining;
+   int rx_count;
+
+   if (oldest == NULL)
+      return;
+
+   if (mbus_is_expired (mbus, oldest))
    {
-      rx_count = mb_pdu_rx (mbus->transport, transaction, mbus->timeout);
+      mbus_complete (mbus, oldest, ETIMEOUT);
+      return;
    }
 
+   /* Responses are received from the peer of the oldest request.
+      Responses from other peers remain queued by the transport until
+      their own requests are the oldest. */
+   transaction->arg   = oldest->slave;
+   transaction->data  = mbus->scratch;
+   transaction->unit  = oldest->slave;
+   transaction->id    = oldest->id;
+   transaction->flags = mbus->scratch_flags;
+
+   remaining = mbus_remaining (mbus, oldest);
+   if (tmo != 0 && (remaining == 0 || tmo < remaining))
+      remaining = tmo;
+
+   rx_count = mb_pdu_rx (mbus->transport, transaction, remaining);
+   if (rx_count == ETIMEOUT && !mbus_is_expired (mbus, oldest))
+   {
+      /* Caller timeout, request is still pending */
+      return;
+   }
    if (rx_count < 0)
    {
-      result = rx_count;
+      mbus_complete (mbus, oldest, rx_count);
+      return;
+   }
+
+   if (mbus->transport->has_txn_id)
+   {
+      pending = mbus_find (mbus, transaction->id);
+      if (pending == NULL)
+      {
+         /* Late response to a request that has timed out. Drop it. */
+         return;
+      }
+   }
+   else
+   {
+      pending = oldest;
+   }
+
+   mbus_complete (
+      mbus,
+      pending,
+      mbus_parse_response (pending, mbus->scratch, rx_count));
+}
+
+static mbus_pending_t * mbus_alloc (mbus_t * mbus, bool block)
+{
+   size_t i;
+
+   /* Make room in the window */
+   while (mbus_in_flight (mbus) >= mbus->window)
+   {
+      if (!block)
+         return NULL;
+
+      mbus_receive (mbus, 0);
+   }
+
+   for (i = 0; i < NELEMENTS (mbus->pending); i++)
+   {
+      mbus_pending_t * pending = &mbus->pending[i];
+
+      if (pending->state == MBUS_FREE)
+         return pending;
+   }
+
+   return NULL;
+}
+
+/* Send the request in the scratch buffer and return its handle */
+static int mbus_submit (
+   mbus_t * mbus,
+   mbus_pending_t * pending,
+   int slave,
+   mb_address_t address,
+   size_t size,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   pdu_txn_t * transaction = &mbus->transaction;
+   pdu_request_t * request = mbus->scratch;
+
+   pending->function  = request->function;
+   pending->slave     = slave;
+   pending->address   = address;
+   pending->quantity  = quantity;
+   pending->buffer    = buffer;
+   pending->callback  = callback;
+   pending->arg       = arg;
+   pending->result    = 0;
+   pending->id        = mbus_next_id (mbus);
+   pending->timestamp = os_get_current_time_us();
+   pending->cache_seq = (mbus->cache != NULL) ? mbus->cache->seq : 0;
+
+   transaction->arg   = slave; /* ? */
+   transaction->data  = mbus->scratch;
+   transaction->unit  = slave;
+   transaction->id    = pending->id;
+   transaction->flags = mbus->scratch_flags;
+
+   mb_pdu_tx (mbus->transport, transaction, size);
+   pending->state = MBUS_PENDING;
+
+   /* No response to broadcast messages */
+   if (slave == 0)
+   {
+      mbus_complete (mbus, pending, 0);
+   }
+
+   return (int)(pending - mbus->pending);
+}
+
+int mbus_read_submit (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer)
+{
+   mbus_pending_t * pending;
+   int size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_read (mbus->scratch, slave, address, quantity);
+   if (size < 0)
+      return size;
+
+   return mbus_submit (
+      mbus,
+      pending,
+      slave,
+      address,
+      size,
+      quantity,
+      buffer,
+      NULL,
+      NULL);
+}
+
+int mbus_write_submit (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer)
+{
+   mbus_pending_t * pending;
+   int size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_write (mbus->scratch, address, quantity, buffer);
+   if (size < 0)
+      return size;
+
+   mbus_cache_write (mbus, slave, address, quantity, buffer);
+   return mbus_submit (
+      mbus,
+      pending,
+      slave,
+      address,
+      size,
+      quantity,
+      NULL,
+      NULL,
+      NULL);
+}
+
+int mbus_wait (mbus_t * mbus, int handle)
+{
+   mbus_pending_t * pending;
+
+   if (handle < 0 || handle >= (int)NELEMENTS (mbus->pending))
+      return -1;
+
+   pending = &mbus->pending[handle];
+   if (pending->state == MBUS_FREE || pending->callback != NULL)
+      return -1;
+
+   while (pending->state == MBUS_PENDING)
+   {
+      mbus_receive (mbus, 0);
    }
-   else if (mb_is_exception (response))
+
+   pending->state = MBUS_FREE;
+   return pending->result;
+}
+
+int mbus_read_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mbus_pending_t * pending;
+   int size;
+
+   pending = mbus_alloc (mbus, false);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_read (mbus->scratch, slave, address, quantity);
+   if (size < 0)
+      return size;
+
+   mbus_submit (
+      mbus,
+      pending,
+      slave,
+      address,
+      size,
+      quantity,
+      buffer,
+      callback,
+      arg);
+   return 0;
+}
+
+int mbus_write_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mbus_pending_t * pending;
+   int size;
+
+   pending = mbus_alloc (mbus, false);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_write (mbus->scratch, address, quantity, buffer);
+   if (size < 0)
+      return size;
+
+   mbus_cache_write (mbus, slave, address, quantity, buffer);
+   mbus_submit (
+      mbus,
+      pending,
+      slave,
+      address,
+      size,
+      quantity,
+      NULL,
+      callback,
+      arg);
+   return 0;
+}
+
+int mbus_write_single_async (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t value,
+   mbus_callback_t callback,
+   void * arg)
+{
+   mbus_pending_t * pending;
+   int size;
+
+   pending = mbus_alloc (mbus, false);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_write_single (mbus->scratch, address, value);
+   if (size < 0)
+      return size;
+
+   mbus_cache_write_single (mbus, slave, address, value);
+   mbus_submit (mbus, pending, slave, address, size, 1, NULL, callback, arg);
+   return 0;
+}
+
+int mbus_process (mbus_t * mbus, uint32_t tmo)
+{
+   if (mbus_in_flight (mbus) > 0)
    {
-      result = mb_exception (response);
+      mbus_receive (mbus, (tmo > 0) ? tmo : 1);
    }
+
+   return (int)mbus_in_flight (mbus);
+}
+
+/* Read or write a range of any size in maximal chunks */
+static int mbus_range (
+   mbus_t * mbus,
+   int slave,
+   bool write,
+   mb_address_t address,
+   uint32_t quantity,
+   void * buffer)
+{
+   int handles[MBUS_MAX_PENDING];
+   uint32_t table = address >> 16;
+   uint32_t start = address & 0xFFFF;
+   bool is_bits   = (table == 0 || table == 1);
+   uint32_t chunk;
+   size_t num_chunks;
+   size_t next_submit = 0;
+   size_t next_wait   = 0;
+   int error          = 0;
+
+   /* Bit chunks are multiples of 8, so that each chunk starts on a
+      byte boundary in the buffer */
+   if (is_bits)
+      chunk = write ? 1968 : 2000;
    else
+      chunk = write ? 123 : 125;
+
+   /* Addresses are 1-based, the range must end within the table */
+   if (quantity == 0 || start == 0 || start + quantity - 1 > 0xFFFF)
+      return -1;
+
+   num_chunks = (quantity + chunk - 1) / chunk;
+
+   while (next_wait < num_chunks)
+   {
+      int handle;
+      int result;
+
+      /* Keep the window full, but stop sending after an error */
+      while (next_submit < num_chunks && error == 0 &&
+             next_submit - next_wait < mbus->window)
+      {
+         uint32_t offset    = next_submit * chunk;
+         uint32_t remaining = quantity - offset;
+         uint16_t n         = (remaining < chunk) ? remaining : chunk;
+         mb_address_t first = MB_ADDRESS (table, start + offset);
+         uint8_t * data     = buffer;
+
+         data += is_bits ? offset / 8 : offset * 2;
+
+         if (write)
+            handle = mbus_write_submit (mbus, slave, first, n, data);
+         else
+            handle = mbus_read_submit (mbus, slave, first, n, data);
+
+         handles[next_submit % MBUS_MAX_PENDING] = handle;
+         next_submit++;
+         if (handle < 0 && error == 0)
+            error = handle;
+      }
+
+      if (next_wait == next_submit)
+         break;
+
+      handle = handles[next_wait % MBUS_MAX_PENDING];
+      result = (handle >= 0) ? mbus_wait (mbus, handle) : handle;
+      if (result != 0 && error == 0)
+         error = result;
+
+      next_wait++;
+   }
+
+   return error;
+}
+
+int mbus_read_range (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint32_t quantity,
+   void * buffer)
+{
+   return mbus_range (mbus, slave, false, address, quantity, buffer);
+}
+
+int mbus_write_range (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint32_t quantity,
+   void * buffer)
+{
+   return mbus_range (mbus, slave, true, address, quantity, buffer);
+}
+
+static int mbus_op_submit (mbus_t * mbus, mbus_op_t * op)
+{
+   switch (op->type)
+   {
+   case MBUS_OP_READ:
+      return mbus_read_submit (
+         mbus,
+         op->slave,
+         op->address,
+         op->quantity,
+         op->buffer);
+   case MBUS_OP_WRITE:
+      return mbus_write_submit (
+         mbus,
+         op->slave,
+         op->address,
+         op->quantity,
+         op->buffer);
+   default:
+      return -1;
+   }
+}
+
+int mbus_execute_batch (mbus_t * mbus, mbus_op_t * ops, size_t num_ops)
+{
+   int handles[MBUS_MAX_PENDING];
+   uint32_t start = os_get_current_time_us();
+   size_t next_submit = 0;
+   size_t next_wait   = 0;
+   int failed         = 0;
+
+   while (next_wait < num_ops)
+   {
+      mbus_op_t * op = &ops[next_wait];
+      int handle;
+
+      /* Keep the window full */
+      while (next_submit < num_ops && next_submit - next_wait < mbus->window)
+      {
+         handles[next_submit % MBUS_MAX_PENDING] =
+            mbus_op_submit (mbus, &ops[next_submit]);
+         next_submit++;
+      }
+
+      handle     = handles[next_wait % MBUS_MAX_PENDING];
+      op->result = (handle >= 0) ? mbus_wait (mbus, handle) : handle;
+      if (op->result != 0)
+         failed++;
+
+      next_wait++;
+   }
+
+   mbus->cycle_time = os_get_current_time_us() - start;
+   return failed;
+}
+
+uint32_t mbus_cycle_time (mbus_t * mbus)
+{
+   return mbus->cycle_time;
+}
+
+int mbus_read (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer)
+{
+   int handle;
+
+   if (mbus->cache != NULL)
    {
-      memcpy (buffer, response, (rx_count > size) ? size : rx_count);
-      result = rx_count;
+      if (mbus_cache_read (mbus->cache, slave, address, quantity, buffer) == 0)
+         return 0;
    }
 
-   return result;
+   handle = mbus_read_submit (mbus, slave, address, quantity, buffer);
+   if (handle < 0)
+      return handle;
+
+   return mbus_wait (mbus, handle);
+}
+
+int mbus_write_single (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t value)
+{
+   mbus_pending_t * pending;
+   int handle;
+   int size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_write_single (mbus->scratch, address, value);
+   if (size < 0)
+      return size;
+
+   mbus_cache_write_single (mbus, slave, address, value);
+   handle =
+      mbus_submit (mbus, pending, slave, address, size, 1, NULL, NULL, NULL);
+   return mbus_wait (mbus, handle);
+}
+
+int mbus_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer)
+{
+   int handle;
+
+   handle = mbus_write_submit (mbus, slave, address, quantity, buffer);
+   if (handle < 0)
+      return handle;
+
+   return mbus_wait (mbus, handle);
+}
+
+int mbus_mask_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t address,
+   uint16_t and_mask,
+   uint16_t or_mask)
+{
+   mbus_pending_t * pending;
+   int handle;
+   int size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_mask_write (mbus->scratch, address, and_mask, or_mask);
+   if (size < 0)
+      return size;
+
+   /* The resulting value is only known to the slave */
+   if (mbus->cache != NULL)
+   {
+      if (slave == 0)
+         mbus_cache_clear (mbus->cache);
+      else
+         mbus_cache_invalidate (mbus->cache, slave, address, 1);
+   }
+
+   handle =
+      mbus_submit (mbus, pending, slave, address, size, 1, NULL, NULL, NULL);
+   return mbus_wait (mbus, handle);
+}
+
+int mbus_read_write (
+   mbus_t * mbus,
+   int slave,
+   mb_address_t read_address,
+   uint16_t read_quantity,
+   void * read_buffer,
+   mb_address_t write_address,
+   uint16_t write_quantity,
+   const void * write_buffer)
+{
+   mbus_pending_t * pending;
+   int handle;
+   int size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   size = mbus_build_read_write (
+      mbus->scratch,
+      slave,
+      read_address,
+      read_quantity,
+      write_address,
+      write_quantity,
+      write_buffer);
+   if (size < 0)
+      return size;
+
+   /* The read part is cached on completion. The written values are
+      not known to be in effect until then, so drop them. */
+   if (mbus->cache != NULL)
+   {
+      mbus_cache_invalidate (mbus->cache, slave, write_address, write_quantity);
+   }
+
+   handle = mbus_submit (
+      mbus,
+      pending,
+      slave,
+      read_address,
+      size,
+      read_quantity,
+      read_buffer,
+      NULL,
+      NULL);
+   return mbus_wait (mbus, handle);
+}
+
+int mbus_loopback (mbus_t * mbus, int slave, uint16_t size, void * buffer)
+{
+   mbus_pending_t * pending;
+   int handle;
+   int tx_size;
+
+   pending = mbus_alloc (mbus, true);
+   if (pending == NULL)
+      return EWINDOW_FULL;
+
+   tx_size = mbus_build_loopback (mbus->scratch, size, buffer);
+   if (tx_size < 0)
+      return tx_size;
+
+   handle =
+      mbus_submit (mbus, pending, slave, 0, tx_size, size, buffer, NULL, NULL);
+   return mbus_wait (mbus, handle);
 }
 
 int mbus_send_msg (mbus_t * mbus, int slave, const void * msg, uint8_t size)
 {
    pdu_txn_t * transaction = &mbus->transaction;
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = (void *)msg;
-   transaction->unit = slave;
-   transaction->id++;
+   transaction->arg   = slave; /* ? */
+   transaction->data  = (void *)msg;
+   transaction->unit  = slave;
+   transaction->flags = 0;
+   transaction->id    = mbus_next_id (mbus);
 
    mb_pdu_tx (mbus->transport, transaction, size);
 
@@ -356,9 +1184,10 @@ int mbus_get_msg (mbus_t * mbus, int slave, void * msg, uint16_t size)
    pdu_txn_t * transaction = &mbus->transaction;
    int rx_count;
 
-   transaction->arg  = slave; /* ? */
-   transaction->data = msg;
-   transaction->unit = slave;
+   transaction->arg   = slave; /* ? */
+   transaction->data  = msg;
+   transaction->unit  = slave;
+   transaction->flags = 0;
 
    rx_count = mb_pdu_rx (mbus->transport, transaction, mbus->timeout);
 
@@ -386,9 +1215,21 @@ void mbus_init (
    mb_transport_t * transport,
    uint8_t * scratch)
 {
-   mbus->timeout        = cfg->timeout;
-   mbus->transaction.id = 0;
-   mbus->scratch        = scratch;
+   mbus->timeout           = cfg->timeout;
+   mbus->transaction.id    = 0;
+   mbus->next_id           = 0;
+   mbus->transaction.flags = 0;
+   mbus->scratch           = scratch;
+   mbus->scratch_flags     = 0;
+
+   mbus->window = (cfg->window > 0) ? cfg->window : 1;
+   if (mbus->window > MBUS_MAX_PENDING)
+      mbus->window = MBUS_MAX_PENDING;
+   if (!transport->has_txn_id)
+      mbus->window = 1;
+   memset (mbus->pending, 0, sizeof (mbus->pending));
+   mbus->cache      = NULL;
+   mbus->cycle_time = 0;
 
    memset (mbus->scratch, 0x55, MAX_PDU_SIZE);
 
@@ -406,10 +1247,12 @@ mbus_t * mbus_create (const mbus_cfg_t * cfg, mb_transport_t * transport)
    mbus = malloc (sizeof (mbus_t));
    CC_ASSERT (mbus != NULL);
 
-   /* Allocate scratch buffer */
-   scratch = malloc (MAX_PDU_SIZE);
+   /* Allocate scratch buffer, with room to frame the ADU around the
+      PDU */
+   scratch = malloc (PDU_BUFFER_SIZE);
    CC_ASSERT (scratch != NULL);
 
-   mbus_init (mbus, cfg, transport, scratch);
+   mbus_init (mbus, cfg, transport, scratch + PDU_HEADROOM);
+   mbus->scratch_flags = PDU_TXN_HEADROOM;
    return mbus;
 }
@@ -0,0 +1,344 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_cache.h"
+#include "mbus_internal.h"
+#include "osal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Maximum number of entries searched for an address */
+#define MBUS_CACHE_PROBES 8
+
+static bool mbus_cache_is_bits (mb_address_t address)
+{
+   return (address >> 16) <= 1;
+}
+
+static uint32_t mbus_cache_ttl (mbus_cache_t * cache, mb_address_t address)
+{
+   uint32_t table = address >> 16;
+
+   return (table < NELEMENTS (cache->ttl)) ? cache->ttl[table] : 0;
+}
+
+static size_t mbus_cache_hash (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address)
+{
+   uint32_t key = address ^ ((uint32_t)slave << 24);
+
+   /* Fibonacci hashing, spreads consecutive addresses */
+   return (size_t)((key * 2654435761u) % cache->size);
+}
+
+static bool mbus_cache_is_fresh (
+   mbus_cache_t * cache,
+   const mbus_cache_entry_t * entry,
+   uint32_t now)
+{
+   uint32_t ttl = mbus_cache_ttl (cache, entry->address);
+
+   /* Compare in ms, ttl * 1000 may overflow */
+   return entry->valid && (now - entry->timestamp) / 1000 < ttl;
+}
+
+/* Return true if a is older than b, where b is fresh */
+static bool mbus_cache_is_older (
+   mbus_cache_t * cache,
+   const mbus_cache_entry_t * a,
+   const mbus_cache_entry_t * b,
+   uint32_t now)
+{
+   if (!mbus_cache_is_fresh (cache, b, now))
+      return false;
+
+   return (now - a->timestamp) > (now - b->timestamp);
+}
+
+static mbus_cache_entry_t * mbus_cache_find (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address)
+{
+   size_t ix = mbus_cache_hash (cache, slave, address);
+   size_t i;
+
+   for (i = 0; i < MBUS_CACHE_PROBES && i < cache->size; i++)
+   {
+      mbus_cache_entry_t * entry = &cache->entries[(ix + i) % cache->size];
+
+      if (entry->valid && entry->slave == slave && entry->address == address)
+         return entry;
+   }
+
+   return NULL;
+}
+
+/* Return entry for address, or the best entry to replace */
+static mbus_cache_entry_t * mbus_cache_slot (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint32_t now)
+{
+   size_t ix = mbus_cache_hash (cache, slave, address);
+   mbus_cache_entry_t * victim = NULL;
+   size_t i;
+
+   for (i = 0; i < MBUS_CACHE_PROBES && i < cache->size; i++)
+   {
+      mbus_cache_entry_t * entry = &cache->entries[(ix + i) % cache->size];
+
+      if (entry->valid && entry->slave == slave && entry->address == address)
+         return entry;
+
+      if (!mbus_cache_is_fresh (cache, entry, now))
+      {
+         /* Prefer free or expired entries */
+         if (victim == NULL || mbus_cache_is_fresh (cache, victim, now))
+            victim = entry;
+      }
+      else if (victim == NULL)
+      {
+         victim = entry;
+      }
+      else if (mbus_cache_is_older (cache, entry, victim, now))
+      {
+         /* Replace the least recently updated entry */
+         victim = entry;
+      }
+   }
+
+   return victim;
+}
+
+static uint16_t mbus_cache_get (
+   mb_address_t address,
+   const void * buffer,
+   uint16_t ix)
+{
+   if (mbus_cache_is_bits (address))
+   {
+      const uint8_t * bits = buffer;
+      return (bits[ix / 8] & BIT (ix % 8)) ? 1 : 0;
+   }
+   else
+   {
+      const uint16_t * registers = buffer;
+      return registers[ix];
+   }
+}
+
+static void mbus_cache_set (
+   mb_address_t address,
+   void * buffer,
+   uint16_t ix,
+   uint16_t value)
+{
+   if (mbus_cache_is_bits (address))
+   {
+      uint8_t * bits = buffer;
+
+      if (value)
+         bits[ix / 8] |= BIT (ix % 8);
+      else
+         bits[ix / 8] &= ~BIT (ix % 8);
+   }
+   else
+   {
+      uint16_t * registers = buffer;
+      registers[ix]        = value;
+   }
+}
+
+int mbus_cache_read (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   void * buffer)
+{
+   uint32_t now = os_get_current_time_us();
+   uint16_t i;
+
+   if (mbus_cache_ttl (cache, address) == 0)
+      return -1;
+
+   for (i = 0; i < quantity; i++)
+   {
+      mbus_cache_entry_t * entry = mbus_cache_find (cache, slave, address + i);
+
+      if (entry == NULL || !mbus_cache_is_fresh (cache, entry, now))
+      {
+         cache->misses++;
+         return -1;
+      }
+   }
+
+   for (i = 0; i < quantity; i++)
+   {
+      mbus_cache_entry_t * entry = mbus_cache_find (cache, slave, address + i);
+      mbus_cache_set (address, buffer, i, entry->value);
+   }
+
+   cache->hits++;
+   return 0;
+}
+
+void mbus_cache_store (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer)
+{
+   uint32_t now = os_get_current_time_us();
+   uint16_t i;
+
+   if (mbus_cache_ttl (cache, address) == 0)
+      return;
+
+   cache->seq++;
+
+   for (i = 0; i < quantity; i++)
+   {
+      mbus_cache_entry_t * entry =
+         mbus_cache_slot (cache, slave, address + i, now);
+
+      entry->slave     = slave;
+      entry->address   = address + i;
+      entry->timestamp = now;
+      entry->value     = mbus_cache_get (address, buffer, i);
+      entry->seq       = cache->seq;
+      entry->valid     = true;
+   }
+}
+
+void mbus_cache_fill (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer,
+   uint32_t since)
+{
+   uint32_t now = os_get_current_time_us();
+   uint16_t i;
+
+   if (mbus_cache_ttl (cache, address) == 0)
+      return;
+
+   /* Cache was cleared after the read was sent */
+   if ((int32_t)(cache->cleared - since) > 0)
+      return;
+
+   for (i = 0; i < quantity; i++)
+   {
+      mbus_cache_entry_t * entry =
+         mbus_cache_slot (cache, slave, address + i, now);
+
+      if (
+         entry->slave == slave && entry->address == address + i &&
+         (int32_t)(entry->seq - since) > 0)
+      {
+         /* Written or invalidated after the read was sent */
+         continue;
+      }
+
+      entry->slave     = slave;
+      entry->address   = address + i;
+      entry->timestamp = now;
+      entry->value     = mbus_cache_get (address, buffer, i);
+      entry->seq       = since;
+      entry->valid     = true;
+   }
+}
+
+void mbus_cache_invalidate (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity)
+{
+   uint16_t i;
+
+   cache->seq++;
+
+   for (i = 0; i < quantity; i++)
+   {
+      mbus_cache_entry_t * entry = mbus_cache_find (cache, slave, address + i);
+
+      if (entry != NULL)
+      {
+         entry->seq   = cache->seq;
+         entry->valid = false;
+      }
+   }
+}
+
+void mbus_cache_clear (mbus_cache_t * cache)
+{
+   memset (cache->entries, 0, cache->size * sizeof (mbus_cache_entry_t));
+   cache->cleared = ++cache->seq;
+}
+
+void mbus_cache_attach (mbus_t * mbus, mbus_cache_t * cache)
+{
+   mbus->cache = cache;
+}
+
+void mbus_cache_init (
+   mbus_cache_t * cache,
+   const mbus_cache_cfg_t * cfg,
+   mbus_cache_entry_t * entries)
+{
+   size_t i;
+
+   CC_ASSERT (cfg->size > 0);
+
+   /* Entry ages are measured with a 32-bit us clock */
+   for (i = 0; i < NELEMENTS (cache->ttl); i++)
+   {
+      cache->ttl[i] = (cfg->ttl[i] > MBUS_CACHE_MAX_TTL) ? MBUS_CACHE_MAX_TTL
+                                                          : cfg->ttl[i];
+   }
+
+   cache->entries = entries;
+   cache->size    = cfg->size;
+   cache->hits    = 0;
+   cache->misses  = 0;
+   cache->seq     = 0;
+   cache->cleared = 0;
+
+   mbus_cache_clear (cache);
+}
+
+mbus_cache_t * mbus_cache_create (const mbus_cache_cfg_t * cfg)
+{
+   mbus_cache_t * cache;
+   mbus_cache_entry_t * entries;
+
+   cache = malloc (sizeof (mbus_cache_t));
+   CC_ASSERT (cache != NULL);
+
+   entries = malloc (cfg->size * sizeof (mbus_cache_entry_t));
+   CC_ASSERT (entries != NULL);
+
+   mbus_cache_init (cache, cfg, entries);
+   return cache;
+}
@@ -0,0 +1,82 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#ifndef MBUS_INTERNAL_H
+#define MBUS_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "mbus.h"
+#include "mbus_cache.h"
+
+#include <stdint.h>
+
+/* Request encoding and response decoding, shared by the master
+   implementations. The build functions return the size of the request
+   PDU, or -1 if the arguments are invalid. */
+
+int mbus_build_read (
+   void * pdu,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity);
+
+int mbus_build_write_single (void * pdu, mb_address_t address, uint16_t value);
+
+int mbus_build_write (
+   void * pdu,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer);
+
+int mbus_build_mask_write (
+   void * pdu,
+   mb_address_t address,
+   uint16_t and_mask,
+   uint16_t or_mask);
+
+int mbus_build_read_write (
+   void * pdu,
+   int slave,
+   mb_address_t read_address,
+   uint16_t read_quantity,
+   mb_address_t write_address,
+   uint16_t write_quantity,
+   const void * buffer);
+
+/* Decode the response to the request in pending. Returns the result
+   of the transaction. */
+int mbus_parse_response (
+   mbus_pending_t * pending,
+   void * response,
+   int rx_count);
+
+/* Store a read response in the cache. Addresses that were written or
+   invalidated after sequence number since are not updated. */
+void mbus_cache_fill (
+   mbus_cache_t * cache,
+   int slave,
+   mb_address_t address,
+   uint16_t quantity,
+   const void * buffer,
+   uint32_t since);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MBUS_INTERNAL_H */
@@ -0,0 +1,277 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_plan.h"
+#include "osal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct mbus_block
+{
+   mb_address_t address; /**< Start of request */
+   uint16_t quantity;    /**< Number of addresses in request */
+   size_t first;         /**< First tag in sorted tag list */
+   size_t count;         /**< Number of tags covered */
+   uint8_t * data;       /**< Response data */
+} mbus_block_t;
+
+struct mbus_plan /* Typedef in mbus_plan.h */
+{
+   mbus_tag_t ** sorted;
+   size_t num_tags;
+   mbus_block_t * blocks;
+   mbus_op_t * ops;
+   size_t num_blocks;
+   uint8_t * data;
+};
+
+static bool mbus_plan_is_bits (mb_address_t address)
+{
+   return (address >> 16) <= 1;
+}
+
+static uint16_t mbus_plan_max_quantity (mb_address_t address)
+{
+   return mbus_plan_is_bits (address) ? 2000 : 125;
+}
+
+static size_t mbus_plan_size (mb_address_t address, uint32_t quantity)
+{
+   if (mbus_plan_is_bits (address))
+      return (quantity + 7) / 8;
+   else
+      return 2 * quantity;
+}
+
+static int mbus_plan_compare (const void * a, const void * b)
+{
+   const mbus_tag_t * tag_a = *(mbus_tag_t * const *)a;
+   const mbus_tag_t * tag_b = *(mbus_tag_t * const *)b;
+
+   /* Sorts by table, then by address */
+   if (tag_a->address < tag_b->address)
+      return -1;
+   if (tag_a->address > tag_b->address)
+      return 1;
+   return 0;
+}
+
+static bool mbus_plan_is_valid (const mbus_tag_t * tag)
+{
+   uint32_t table = tag->address >> 16;
+   uint32_t start = tag->address & 0xFFFF;
+
+   if (table != 0 && table != 1 && table != 3 && table != 4)
+      return false;
+
+   if (tag->quantity == 0)
+      return false;
+
+   if (tag->quantity > mbus_plan_max_quantity (tag->address))
+      return false;
+
+   /* Addresses are 1-based */
+   return start >= 1 && start + tag->quantity - 1 <= 0x10000;
+}
+
+/* Return true if tag can be added to block at a cost lower than a new
+   request */
+static bool mbus_plan_can_merge (
+   const mbus_plan_cfg_t * cfg,
+   const mbus_block_t * block,
+   const mbus_tag_t * tag)
+{
+   uint32_t block_end = block->address + block->quantity;
+   uint32_t tag_end   = tag->address + tag->quantity;
+   uint32_t end       = (tag_end > block_end) ? tag_end : block_end;
+
+   if ((tag->address >> 16) != (block->address >> 16))
+      return false;
+
+   if (end - block->address > mbus_plan_max_quantity (block->address))
+      return false;
+
+   if (tag->address <= block_end)
+      return true; /* Adjacent or overlapping */
+
+   return mbus_plan_size (block->address, tag->address - block_end) <=
+          cfg->request_cost;
+}
+
+static void mbus_plan_bits_copy (
+   uint8_t * dst,
+   const uint8_t * src,
+   uint32_t offset,
+   uint16_t quantity)
+{
+   uint32_t i;
+
+   memset (dst, 0, (quantity + 7) / 8);
+   for (i = 0; i < quantity; i++)
+   {
+      uint32_t bit = offset + i;
+
+      if (src[bit / 8] & BIT (bit % 8))
+         dst[i / 8] |= BIT (i % 8);
+   }
+}
+
+static void mbus_plan_scatter (const mbus_block_t * block, mbus_tag_t * tag)
+{
+   uint32_t offset = tag->address - block->address;
+
+   if (mbus_plan_is_bits (block->address))
+   {
+      mbus_plan_bits_copy (tag->buffer, block->data, offset, tag->quantity);
+   }
+   else
+   {
+      memcpy (
+         tag->buffer,
+         block->data + 2 * offset,
+         2 * (size_t)tag->quantity);
+   }
+}
+
+size_t mbus_plan_num_requests (const mbus_plan_t * plan)
+{
+   return plan->num_blocks;
+}
+
+int mbus_plan_execute (mbus_t * mbus, int slave, mbus_plan_t * plan)
+{
+   int error = 0;
+   size_t i;
+   size_t j;
+
+   for (i = 0; i < plan->num_blocks; i++)
+   {
+      plan->ops[i].slave = slave;
+   }
+
+   mbus_execute_batch (mbus, plan->ops, plan->num_blocks);
+
+   for (i = 0; i < plan->num_blocks; i++)
+   {
+      mbus_block_t * block = &plan->blocks[i];
+      int result           = plan->ops[i].result;
+
+      if (result != 0 && error == 0)
+         error = result;
+
+      for (j = block->first; j < block->first + block->count; j++)
+      {
+         mbus_tag_t * tag = plan->sorted[j];
+
+         tag->result = result;
+         if (result == 0)
+            mbus_plan_scatter (block, tag);
+      }
+   }
+
+   return error;
+}
+
+mbus_plan_t * mbus_plan_create (
+   const mbus_plan_cfg_t * cfg,
+   mbus_tag_t * tags,
+   size_t num_tags)
+{
+   mbus_plan_t * plan;
+   mbus_block_t * block = NULL;
+   size_t size          = 0;
+   size_t i;
+
+   for (i = 0; i < num_tags; i++)
+   {
+      if (!mbus_plan_is_valid (&tags[i]))
+         return NULL;
+   }
+
+   plan = calloc (1, sizeof (mbus_plan_t));
+   CC_ASSERT (plan != NULL);
+
+   plan->num_tags = num_tags;
+   plan->sorted   = calloc (num_tags + 1, sizeof (mbus_tag_t *));
+   plan->blocks   = calloc (num_tags + 1, sizeof (mbus_block_t));
+   plan->ops      = calloc (num_tags + 1, sizeof (mbus_op_t));
+   CC_ASSERT (plan->sorted != NULL);
+   CC_ASSERT (plan->blocks != NULL);
+   CC_ASSERT (plan->ops != NULL);
+
+   for (i = 0; i < num_tags; i++)
+   {
+      plan->sorted[i] = &tags[i];
+   }
+   qsort (plan->sorted, num_tags, sizeof (mbus_tag_t *), mbus_plan_compare);
+
+   /* Merge tags into requests, in address order */
+   for (i = 0; i < num_tags; i++)
+   {
+      mbus_tag_t * tag = plan->sorted[i];
+
+      if (block != NULL && mbus_plan_can_merge (cfg, block, tag))
+      {
+         uint32_t end = tag->address + tag->quantity;
+
+         if (end > block->address + block->quantity)
+            block->quantity = end - block->address;
+         block->count++;
+      }
+      else
+      {
+         block           = &plan->blocks[plan->num_blocks++];
+         block->address  = tag->address;
+         block->quantity = tag->quantity;
+         block->first    = i;
+         block->count    = 1;
+      }
+   }
+
+   /* Allocate response data for all requests */
+   for (i = 0; i < plan->num_blocks; i++)
+   {
+      block = &plan->blocks[i];
+      size += mbus_plan_size (block->address, block->quantity);
+   }
+
+   plan->data = malloc (size + 1);
+   CC_ASSERT (plan->data != NULL);
+
+   size = 0;
+   for (i = 0; i < plan->num_blocks; i++)
+   {
+      block       = &plan->blocks[i];
+      block->data = plan->data + size;
+      size += mbus_plan_size (block->address, block->quantity);
+
+      plan->ops[i].type     = MBUS_OP_READ;
+      plan->ops[i].address  = block->address;
+      plan->ops[i].quantity = block->quantity;
+      plan->ops[i].buffer   = block->data;
+   }
+
+   return plan;
+}
+
+void mbus_plan_destroy (mbus_plan_t * plan)
+{
+   free (plan->data);
+   free (plan->ops);
+   free (plan->blocks);
+   free (plan->sorted);
+   free (plan);
+}
@@ -0,0 +1,124 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_sched.h"
+#include "osal.h"
+
+/* Wrap-safe comparison of timestamps */
+#define TIME_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+static uint32_t mbus_sched_period_us (const mbus_poll_t * poll)
+{
+   return poll->period * 1000;
+}
+
+static uint32_t mbus_sched_deadline (const mbus_poll_t * poll)
+{
+   return poll->release + mbus_sched_period_us (poll);
+}
+
+/* Return true if poll a should run before poll b */
+static bool mbus_sched_before (const mbus_poll_t * a, const mbus_poll_t * b)
+{
+   uint32_t deadline_a = mbus_sched_deadline (a);
+   uint32_t deadline_b = mbus_sched_deadline (b);
+
+   if (deadline_a != deadline_b)
+      return TIME_BEFORE (deadline_a, deadline_b);
+
+   return a->priority > b->priority;
+}
+
+static void mbus_sched_next (mbus_poll_t * poll, uint32_t now)
+{
+   uint32_t period = mbus_sched_period_us (poll);
+
+   poll->late = TIME_BEFORE (mbus_sched_deadline (poll), now);
+   if (poll->late)
+      poll->missed++;
+
+   poll->release += period;
+
+   /* Skip periods that have already ended */
+   while (period > 0 && TIME_BEFORE (mbus_sched_deadline (poll), now))
+   {
+      poll->release += period;
+      poll->missed++;
+   }
+}
+
+uint32_t mbus_sched_run_once (mbus_sched_t * sched)
+{
+   uint32_t now       = os_get_current_time_us();
+   mbus_poll_t * next = NULL;
+   uint32_t delay     = MBUS_SCHED_IDLE;
+   size_t i;
+   int result;
+
+   /* Find released poll with earliest deadline */
+   for (i = 0; i < sched->num_polls; i++)
+   {
+      mbus_poll_t * poll = &sched->polls[i];
+
+      if (TIME_BEFORE (now, poll->release))
+      {
+         /* Not released yet */
+         if (poll->release - now < delay)
+            delay = poll->release - now;
+         continue;
+      }
+
+      if (next == NULL || mbus_sched_before (poll, next))
+         next = poll;
+   }
+
+   if (next == NULL)
+      return delay;
+
+   result = mbus_read (
+      sched->mbus,
+      next->slave,
+      next->address,
+      next->quantity,
+      next->buffer);
+
+   mbus_sched_next (next, os_get_current_time_us());
+
+   if (next->callback != NULL)
+      next->callback (next, result);
+
+   return 0;
+}
+
+void mbus_sched_init (
+   mbus_sched_t * sched,
+   mbus_t * mbus,
+   mbus_poll_t * polls,
+   size_t num_polls)
+{
+   uint32_t now = os_get_current_time_us();
+   size_t i;
+
+   sched->mbus      = mbus;
+   sched->polls     = polls;
+   sched->num_polls = num_polls;
+
+   for (i = 0; i < num_polls; i++)
+   {
+      polls[i].release = now;
+      polls[i].missed  = 0;
+      polls[i].late    = false;
+   }
+}
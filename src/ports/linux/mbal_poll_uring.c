@@ -0,0 +1,849 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2015 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+/* Socket events on io_uring, selected with USE_IO_URING.
+ *
+ * Sockets passed to os_poll_recv() have a multishot receive in
+ * flight, which selects buffers from a ring shared by all sockets in
+ * the set. The kernel receives as soon as data arrives, and the data
+ * is reported by os_poll_wait() without a receive system call per
+ * socket. Buffers are returned to the ring on the next wait.
+ *
+ * Other events are reported by a poll request per socket. A poll
+ * request completes once, and is armed again on the next call to
+ * os_poll_wait(), which gives the same level-triggered semantics as
+ * the epoll implementation. Changes to the set are queued in the
+ * submission ring and submitted together with the wait, so that a
+ * wait costs a single system call however many sockets changed
+ * interest. Removal is submitted at once, so that the socket is
+ * released when it is closed.
+ *
+ * Unlike epoll, a set must only be used by the thread that waits on
+ * it. */
+
+#include "mbal_tcp.h"
+#include "osal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define PERROR(s) perror ("modbus: "s)
+
+#define URING_MAX_SETS   16
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* Provided buffers for receive. The count must be a power of two. */
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE  512
+
+/* User data of requests whose completion is ignored */
+#define URING_IGNORE UINT64_MAX
+
+/* User data flag of receive requests, and mask of the descriptor */
+#define URING_RECV    0x80000000u
+#define URING_FD_MASK 0x7FFFFFFFu
+
+typedef struct os_uring_reg
+{
+   void * arg;
+   uint32_t events; /**< Events of interest, 0 if not in set */
+   uint32_t gen;    /**< Generation, identifies the poll request */
+   uint32_t rgen;   /**< Generation, identifies the receive request */
+   bool armed;      /**< Poll request in flight */
+   bool queued;     /**< In the list of requests to arm */
+   bool recv;       /**< Data is received by the kernel */
+   bool receiving;  /**< Receive is enabled */
+   bool recv_armed; /**< Receive request in flight */
+} os_uring_reg_t;
+
+typedef struct os_uring
+{
+   int fd;
+
+   /* Submission ring */
+   void * sq_ring;
+   size_t sq_ring_size;
+   unsigned * sq_head;
+   unsigned * sq_tail;
+   unsigned * sq_mask;
+   unsigned * sq_array;
+   unsigned sq_entries;
+   struct io_uring_sqe * sqes;
+   size_t sqes_size;
+   unsigned to_submit;
+
+   /* Completion ring */
+   void * cq_ring;
+   size_t cq_ring_size;
+   unsigned * cq_head;
+   unsigned * cq_tail;
+   unsigned * cq_mask;
+   struct io_uring_cqe * cqes;
+
+   /* Sockets in the set, indexed by descriptor */
+   os_uring_reg_t * regs;
+   int num_regs;
+
+   /* Sockets whose poll request is to be armed */
+   int * arm;
+   int num_arm;
+
+   /* Provided buffers, allocated by the first call to os_poll_recv() */
+   struct io_uring_buf_ring * br;
+   uint8_t * bufs;
+   bool no_bufs;                      /**< Not supported by the kernel */
+   uint16_t recycle[URING_BUF_COUNT]; /**< Buffers reported last time */
+   unsigned num_recycle;
+} os_uring_t;
+
+static os_uring_t * os_uring_sets[URING_MAX_SETS];
+
+static os_uring_t * os_uring_get (int set)
+{
+   if (set < 0 || set >= URING_MAX_SETS)
+      return NULL;
+
+   return os_uring_sets[set];
+}
+
+static int os_uring_enter (
+   os_uring_t * s,
+   unsigned min_complete,
+   uint32_t tmo)
+{
+   struct io_uring_getevents_arg arg;
+   struct __kernel_timespec ts;
+   unsigned flags = IORING_ENTER_EXT_ARG;
+   int result;
+
+   memset (&arg, 0, sizeof (arg));
+   if (min_complete > 0)
+   {
+      flags |= IORING_ENTER_GETEVENTS;
+      if (tmo != OS_WAIT_FOREVER)
+      {
+         ts.tv_sec  = tmo / 1000;
+         ts.tv_nsec = (tmo % 1000) * 1000000;
+         arg.ts     = (uint64_t)(uintptr_t)&ts;
+      }
+   }
+
+   do
+   {
+      result = (int)syscall (
+         __NR_io_uring_enter,
+         s->fd,
+         s->to_submit,
+         min_complete,
+         flags,
+         &arg,
+         sizeof (arg));
+   } while (result == -1 && errno == EINTR);
+
+   if (result >= 0)
+   {
+      s->to_submit -= (unsigned)result;
+      return 0;
+   }
+
+   /* Timeout, or completion ring full. Completions are reaped by the
+      caller. */
+   if (errno == ETIME || errno == EBUSY)
+      return 0;
+
+   return -1;
+}
+
+static struct io_uring_sqe * os_uring_sqe (os_uring_t * s)
+{
+   struct io_uring_sqe * sqe;
+   unsigned tail = *s->sq_tail;
+   unsigned ix;
+
+   if (tail - __atomic_load_n (s->sq_head, __ATOMIC_ACQUIRE) ==
+       s->sq_entries)
+   {
+      /* Ring is full, submit what has been queued so far */
+      if (os_uring_enter (s, 0, 0) != 0)
+         return NULL;
+   }
+
+   ix  = tail & *s->sq_mask;
+   sqe = &s->sqes[ix];
+   memset (sqe, 0, sizeof (*sqe));
+   s->sq_array[ix] = ix;
+   return sqe;
+}
+
+static void os_uring_sqe_commit (os_uring_t * s)
+{
+   __atomic_store_n (s->sq_tail, *s->sq_tail + 1, __ATOMIC_RELEASE);
+   s->to_submit++;
+}
+
+static int os_uring_fd (uint64_t user_data)
+{
+   return (int)((uint32_t)user_data & URING_FD_MASK);
+}
+
+static uint64_t os_uring_user_data (int fd, const os_uring_reg_t * reg)
+{
+   return ((uint64_t)reg->gen << 32) | (uint32_t)fd;
+}
+
+static uint64_t os_uring_recv_data (int fd, const os_uring_reg_t * reg)
+{
+   return ((uint64_t)reg->rgen << 32) | URING_RECV | (uint32_t)fd;
+}
+
+/* Events reported by the poll request. Data is reported by the
+   receive request instead, if there is one. */
+static uint32_t os_uring_poll_events (const os_uring_reg_t * reg)
+{
+   return reg->recv ? (reg->events & ~OS_POLL_IN) : reg->events;
+}
+
+/* Return the buffers that were reported by the last wait to the
+   ring */
+static void os_uring_recycle (os_uring_t * s)
+{
+   unsigned tail;
+   unsigned i;
+
+   if (s->num_recycle == 0)
+      return;
+
+   tail = s->br->tail;
+   for (i = 0; i < s->num_recycle; i++)
+   {
+      uint16_t bid = s->recycle[i];
+      struct io_uring_buf * buf;
+
+      buf       = &s->br->bufs[(tail + i) & (URING_BUF_COUNT - 1)];
+      buf->addr = (uint64_t)(uintptr_t)(s->bufs + bid * URING_BUF_SIZE);
+      buf->len  = URING_BUF_SIZE;
+      buf->bid  = bid;
+   }
+
+   __atomic_store_n (
+      &s->br->tail,
+      (uint16_t)(tail + s->num_recycle),
+      __ATOMIC_RELEASE);
+   s->num_recycle = 0;
+}
+
+static int os_uring_buf_init (os_uring_t * s)
+{
+   struct io_uring_buf_reg reg;
+   void * br;
+   unsigned i;
+
+   br = mmap (
+      NULL,
+      URING_BUF_COUNT * sizeof (struct io_uring_buf),
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+   if (br == MAP_FAILED)
+      return -1;
+
+   s->bufs = malloc (URING_BUF_COUNT * URING_BUF_SIZE);
+   if (s->bufs == NULL)
+      goto error;
+
+   memset (&reg, 0, sizeof (reg));
+   reg.ring_addr    = (uint64_t)(uintptr_t)br;
+   reg.ring_entries = URING_BUF_COUNT;
+   reg.bgid         = URING_BUF_GROUP;
+
+   /* Kernel 5.19 or later is required for buffer rings */
+   if (
+      syscall (
+         __NR_io_uring_register,
+         s->fd,
+         IORING_REGISTER_PBUF_RING,
+         &reg,
+         1) != 0)
+   {
+      goto error;
+   }
+
+   s->br = br;
+   for (i = 0; i < URING_BUF_COUNT; i++)
+   {
+      s->recycle[i] = (uint16_t)i;
+   }
+   s->num_recycle = URING_BUF_COUNT;
+   os_uring_recycle (s);
+   return 0;
+
+error:
+   munmap (br, URING_BUF_COUNT * sizeof (struct io_uring_buf));
+   free (s->bufs);
+   s->bufs = NULL;
+   return -1;
+}
+
+/* Cancel the receive request in flight. It completes with the data
+   received so far. */
+static int os_uring_recv_cancel (os_uring_t * s, int fd, os_uring_reg_t * reg)
+{
+   struct io_uring_sqe * sqe;
+
+   sqe = os_uring_sqe (s);
+   if (sqe == NULL)
+      return -1;
+
+   sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+   sqe->fd        = -1;
+   sqe->addr      = os_uring_recv_data (fd, reg);
+   sqe->user_data = URING_IGNORE;
+   os_uring_sqe_commit (s);
+   return 0;
+}
+
+/* Cancel the poll request in flight, if any. Its completion will not
+   match the new generation of the socket. */
+static int os_uring_disarm (os_uring_t * s, int fd, os_uring_reg_t * reg)
+{
+   struct io_uring_sqe * sqe;
+
+   if (reg->armed)
+   {
+      sqe = os_uring_sqe (s);
+      if (sqe == NULL)
+         return -1;
+
+      sqe->opcode    = IORING_OP_POLL_REMOVE;
+      sqe->fd        = -1;
+      sqe->addr      = os_uring_user_data (fd, reg);
+      sqe->user_data = URING_IGNORE;
+      os_uring_sqe_commit (s);
+      reg->armed = false;
+   }
+
+   reg->gen++;
+   return 0;
+}
+
+static void os_uring_queue (os_uring_t * s, int fd, os_uring_reg_t * reg)
+{
+   if (!reg->queued)
+   {
+      s->arm[s->num_arm++] = fd;
+      reg->queued          = true;
+   }
+}
+
+/* Arm the poll and receive requests of the sockets in the list */
+static int os_uring_arm (os_uring_t * s)
+{
+   struct io_uring_sqe * sqe;
+   int i;
+
+   for (i = 0; i < s->num_arm; i++)
+   {
+      int fd               = s->arm[i];
+      os_uring_reg_t * reg = &s->regs[fd];
+      uint32_t events      = os_uring_poll_events (reg);
+
+      reg->queued = false;
+      if (!reg->armed && events != 0)
+      {
+         sqe = os_uring_sqe (s);
+         if (sqe == NULL)
+            return -1;
+
+         sqe->opcode        = IORING_OP_POLL_ADD;
+         sqe->fd            = fd;
+         sqe->poll32_events = 0;
+         if (events & OS_POLL_IN)
+            sqe->poll32_events |= POLLIN;
+         if (events & OS_POLL_OUT)
+            sqe->poll32_events |= POLLOUT;
+         sqe->user_data = os_uring_user_data (fd, reg);
+         os_uring_sqe_commit (s);
+         reg->armed = true;
+      }
+
+      if (reg->receiving && !reg->recv_armed)
+      {
+         sqe = os_uring_sqe (s);
+         if (sqe == NULL)
+            return -1;
+
+         /* Receives into a buffer from the ring whenever data
+            arrives, until cancelled or out of buffers */
+         sqe->opcode    = IORING_OP_RECV;
+         sqe->fd        = fd;
+         sqe->flags     = IOSQE_BUFFER_SELECT;
+         sqe->ioprio    = IORING_RECV_MULTISHOT;
+         sqe->buf_group = URING_BUF_GROUP;
+         sqe->user_data = os_uring_recv_data (fd, reg);
+         os_uring_sqe_commit (s);
+         reg->recv_armed = true;
+      }
+   }
+
+   s->num_arm = 0;
+   return 0;
+}
+
+/* Report a completion of a receive request. Returns true if an
+   event is reported. */
+static bool os_uring_reap_recv (
+   os_uring_t * s,
+   const struct io_uring_cqe * cqe,
+   os_poll_event_t * event)
+{
+   int fd       = os_uring_fd (cqe->user_data);
+   uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+   uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+   os_uring_reg_t * reg;
+
+   /* The buffer is returned to the ring on the next wait, also if the
+      socket has been removed */
+   if (cqe->flags & IORING_CQE_F_BUFFER)
+      s->recycle[s->num_recycle++] = bid;
+
+   if (fd >= s->num_regs)
+      return false;
+
+   /* Ignore requests of sockets that were removed */
+   reg = &s->regs[fd];
+   if (gen != reg->rgen || !reg->recv_armed)
+      return false;
+
+   if (!(cqe->flags & IORING_CQE_F_MORE))
+   {
+      /* Request has ended, arm again if still enabled */
+      reg->recv_armed = false;
+      os_uring_queue (s, fd, reg);
+   }
+
+   event->arg = reg->arg;
+   if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+   {
+      event->events = OS_POLL_DATA;
+      event->data   = s->bufs + bid * URING_BUF_SIZE;
+      event->size   = (size_t)cqe->res;
+      return true;
+   }
+
+   /* Cancelled, or out of buffers until the next wait */
+   if (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)
+      return false;
+
+   /* End of stream, or error */
+   event->events = OS_POLL_ERR;
+   return true;
+}
+
+/* Report completed requests. Completions that do not fit are left in
+   the ring for the next call. */
+static int os_uring_reap (os_uring_t * s, os_poll_event_t * events, int max)
+{
+   unsigned head = *s->cq_head;
+   unsigned tail = __atomic_load_n (s->cq_tail, __ATOMIC_ACQUIRE);
+   int n         = 0;
+
+   while (head != tail && n < max)
+   {
+      struct io_uring_cqe * cqe = &s->cqes[head & *s->cq_mask];
+      int fd                    = os_uring_fd (cqe->user_data);
+      uint32_t gen              = (uint32_t)(cqe->user_data >> 32);
+      os_uring_reg_t * reg;
+      uint32_t mask = 0;
+
+      head++;
+
+      if (cqe->user_data == URING_IGNORE)
+         continue;
+
+      if (cqe->user_data & URING_RECV)
+      {
+         if (os_uring_reap_recv (s, cqe, &events[n]))
+            n++;
+         continue;
+      }
+
+      if (fd >= s->num_regs)
+         continue;
+
+      /* Ignore polls that were cancelled or replaced */
+      reg = &s->regs[fd];
+      if (gen != reg->gen || !reg->armed)
+         continue;
+
+      reg->armed = false;
+      os_uring_queue (s, fd, reg);
+
+      if (cqe->res < 0)
+      {
+         mask = OS_POLL_ERR;
+      }
+      else
+      {
+         if (cqe->res & POLLIN)
+            mask |= OS_POLL_IN;
+         if (cqe->res & POLLOUT)
+            mask |= OS_POLL_OUT;
+         if (cqe->res & (POLLERR | POLLHUP | POLLNVAL))
+            mask |= OS_POLL_ERR;
+      }
+
+      events[n].events = mask;
+      events[n].arg    = reg->arg;
+      n++;
+   }
+
+   __atomic_store_n (s->cq_head, head, __ATOMIC_RELEASE);
+   return n;
+}
+
+static int os_uring_grow (os_uring_t * s, int fd)
+{
+   os_uring_reg_t * regs;
+   int * arm;
+   int num_regs = (s->num_regs > 0) ? s->num_regs : 64;
+
+   if (fd < s->num_regs)
+      return 0;
+
+   while (num_regs <= fd)
+      num_regs *= 2;
+
+   regs = realloc (s->regs, num_regs * sizeof (*regs));
+   if (regs == NULL)
+      return -1;
+   s->regs = regs;
+
+   arm = realloc (s->arm, num_regs * sizeof (*arm));
+   if (arm == NULL)
+      return -1;
+   s->arm = arm;
+
+   memset (&regs[s->num_regs], 0, (num_regs - s->num_regs) * sizeof (*regs));
+   s->num_regs = num_regs;
+   return 0;
+}
+
+static void os_uring_free (os_uring_t * s)
+{
+   if (s->sqes != NULL && s->sqes != MAP_FAILED)
+      munmap (s->sqes, s->sqes_size);
+   if (s->cq_ring != NULL && s->cq_ring != MAP_FAILED &&
+       s->cq_ring != s->sq_ring)
+      munmap (s->cq_ring, s->cq_ring_size);
+   if (s->sq_ring != NULL && s->sq_ring != MAP_FAILED)
+      munmap (s->sq_ring, s->sq_ring_size);
+   if (s->fd != -1)
+      close (s->fd);
+
+   if (s->br != NULL)
+      munmap (s->br, URING_BUF_COUNT * sizeof (struct io_uring_buf));
+
+   free (s->bufs);
+   free (s->regs);
+   free (s->arm);
+   free (s);
+}
+
+int os_poll_create (void)
+{
+   os_uring_t * s;
+   struct io_uring_params params;
+   uint8_t * sq;
+   uint8_t * cq;
+   int set;
+
+   s = calloc (1, sizeof (*s));
+   if (s == NULL)
+      return -1;
+
+   memset (&params, 0, sizeof (params));
+   params.flags      = IORING_SETUP_CQSIZE;
+   params.cq_entries = URING_CQ_ENTRIES;
+
+   s->fd = (int)syscall (__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+   if (s->fd == -1)
+   {
+      PERROR ("io_uring_setup");
+      goto error;
+   }
+
+   if (!(params.features & IORING_FEAT_EXT_ARG))
+   {
+      /* Kernel 5.11 or later is required for wait timeouts */
+      fprintf (stderr, "modbus: io_uring wait timeouts not supported\n");
+      goto error;
+   }
+
+   s->sq_ring_size = params.sq_off.array +
+                     params.sq_entries * sizeof (unsigned);
+   s->cq_ring_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof (struct io_uring_cqe);
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (s->cq_ring_size > s->sq_ring_size)
+         s->sq_ring_size = s->cq_ring_size;
+      s->cq_ring_size = s->sq_ring_size;
+   }
+
+   s->sq_ring = mmap (
+      NULL,
+      s->sq_ring_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      s->fd,
+      IORING_OFF_SQ_RING);
+   if (s->sq_ring == MAP_FAILED)
+   {
+      PERROR ("mmap");
+      goto error;
+   }
+
+   if (params.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      s->cq_ring = s->sq_ring;
+   }
+   else
+   {
+      s->cq_ring = mmap (
+         NULL,
+         s->cq_ring_size,
+         PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE,
+         s->fd,
+         IORING_OFF_CQ_RING);
+      if (s->cq_ring == MAP_FAILED)
+      {
+         PERROR ("mmap");
+         goto error;
+      }
+   }
+
+   s->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+   s->sqes      = mmap (
+      NULL,
+      s->sqes_size,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      s->fd,
+      IORING_OFF_SQES);
+   if (s->sqes == MAP_FAILED)
+   {
+      PERROR ("mmap");
+      goto error;
+   }
+
+   sq            = s->sq_ring;
+   s->sq_head    = (unsigned *)(sq + params.sq_off.head);
+   s->sq_tail    = (unsigned *)(sq + params.sq_off.tail);
+   s->sq_mask    = (unsigned *)(sq + params.sq_off.ring_mask);
+   s->sq_array   = (unsigned *)(sq + params.sq_off.array);
+   s->sq_entries = params.sq_entries;
+
+   cq         = s->cq_ring;
+   s->cq_head = (unsigned *)(cq + params.cq_off.head);
+   s->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+   s->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+   s->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+   /* Claim a free slot */
+   for (set = 0; set < URING_MAX_SETS; set++)
+   {
+      os_uring_t * expected = NULL;
+
+      if (__atomic_compare_exchange_n (
+             &os_uring_sets[set],
+             &expected,
+             s,
+             false,
+             __ATOMIC_ACQ_REL,
+             __ATOMIC_RELAXED))
+      {
+         return set;
+      }
+   }
+
+   fprintf (stderr, "modbus: too many poll sets\n");
+
+error:
+   os_uring_free (s);
+   return -1;
+}
+
+void os_poll_destroy (int set)
+{
+   os_uring_t * s = os_uring_get (set);
+   int fd;
+
+   if (s == NULL)
+      return;
+
+   /* The ring is torn down in the background. Cancel the requests
+      first, so that the sockets are released now. */
+   for (fd = 0; fd < s->num_regs; fd++)
+   {
+      if (s->regs[fd].armed || s->regs[fd].recv_armed)
+         os_poll_remove (set, fd);
+   }
+
+   __atomic_store_n (&os_uring_sets[set], NULL, __ATOMIC_RELEASE);
+   os_uring_free (s);
+}
+
+int os_poll_add (int set, int fd, uint32_t events, void * arg)
+{
+   os_uring_t * s = os_uring_get (set);
+   os_uring_reg_t * reg;
+
+   if (s == NULL || fd < 0 || os_uring_grow (s, fd) != 0)
+      return -1;
+
+   reg         = &s->regs[fd];
+   reg->arg    = arg;
+   reg->events = events;
+   os_uring_queue (s, fd, reg);
+   return 0;
+}
+
+int os_poll_modify (int set, int fd, uint32_t events, void * arg)
+{
+   os_uring_t * s = os_uring_get (set);
+   os_uring_reg_t * reg;
+   uint32_t mask;
+
+   if (s == NULL || fd < 0 || fd >= s->num_regs)
+      return -1;
+
+   reg         = &s->regs[fd];
+   reg->arg    = arg;
+   mask        = os_uring_poll_events (reg);
+   reg->events = events;
+   if (os_uring_poll_events (reg) != mask)
+   {
+      if (os_uring_disarm (s, fd, reg) != 0)
+         return -1;
+
+      os_uring_queue (s, fd, reg);
+   }
+
+   return 0;
+}
+
+int os_poll_remove (int set, int fd)
+{
+   os_uring_t * s = os_uring_get (set);
+   os_uring_reg_t * reg;
+
+   if (s == NULL || fd < 0 || fd >= s->num_regs)
+      return -1;
+
+   /* The requests must be cancelled before the descriptor is closed
+      and reused */
+   reg         = &s->regs[fd];
+   reg->events = 0;
+   reg->arg    = NULL;
+   if (reg->recv_armed && os_uring_recv_cancel (s, fd, reg) != 0)
+      return -1;
+
+   reg->recv       = false;
+   reg->receiving  = false;
+   reg->recv_armed = false;
+   reg->rgen++;
+   if (os_uring_disarm (s, fd, reg) != 0)
+      return -1;
+
+   /* Submit now. The requests hold a reference to the socket, which
+      would otherwise not be released by os_tcp_close() until the next
+      wait. */
+   return (s->to_submit > 0) ? os_uring_enter (s, 0, 0) : 0;
+}
+
+int os_poll_recv (int set, int fd, bool enable)
+{
+   os_uring_t * s = os_uring_get (set);
+   os_uring_reg_t * reg;
+
+   if (s == NULL || fd < 0 || fd >= s->num_regs || s->no_bufs)
+      return -1;
+
+   if (s->br == NULL && os_uring_buf_init (s) != 0)
+   {
+      s->no_bufs = true;
+      return -1;
+   }
+
+   reg = &s->regs[fd];
+   if (!reg->recv)
+   {
+      /* Data is no longer reported by the poll request */
+      if (os_uring_disarm (s, fd, reg) != 0)
+         return -1;
+      reg->recv = true;
+   }
+
+   reg->receiving = enable;
+   os_uring_queue (s, fd, reg);
+   if (!enable && reg->recv_armed && os_uring_recv_cancel (s, fd, reg) != 0)
+      return -1;
+
+   return 0;
+}
+
+int os_poll_wait (int set, os_poll_event_t * events, int max, uint32_t tmo)
+{
+   os_uring_t * s = os_uring_get (set);
+   int n;
+
+   if (s == NULL)
+      return -1;
+
+   /* Data reported by the last call is no longer in use */
+   os_uring_recycle (s);
+
+   /* Report completions left over from the last call, and arm the
+      sockets that were reported last time */
+   n = os_uring_reap (s, events, max);
+   if (os_uring_arm (s) != 0)
+      return -1;
+
+   if (n > 0)
+   {
+      if (s->to_submit > 0 && os_uring_enter (s, 0, 0) != 0)
+         return -1;
+      return n;
+   }
+
+   if (tmo == 0 && s->to_submit == 0)
+      return 0;
+
+   if (os_uring_enter (s, (tmo == 0) ? 0 : 1, tmo) != 0)
+      return -1;
+
+   return os_uring_reap (s, events, max);
+}
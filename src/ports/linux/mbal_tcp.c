@@ -13,12 +13,16 @@
  * full license information.
  ********************************************************************/
 
+#define _GNU_SOURCE /* For accept4 and pthread_setaffinity_np */
+
 #include "mbal_tcp.h"
 #include "mb_tcp.h"
 #include "osal.h"
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
@@ -26,6 +30,10 @@
 
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #define PERROR(s) perror ("modbus: "s)
 
@@ -87,17 +95,66 @@ error:
    return -1;
 }
 
-int os_tcp_accept_connection (uint16_t port)
+static int os_tcp_peer_options (int peer)
+{
+   int result;
+   int option;
+
+   option = 1;
+   result = setsockopt (peer, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("TCP_NODELAY");
+      return -1;
+   }
+
+   option = 1;
+   result = setsockopt (peer, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("SO_KEEPALIVE");
+      return -1;
+   }
+
+   option = KEEP_ALIVE_IDLE;
+   result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPIDLE, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("TCP_KEEPALIVE");
+      return -1;
+   }
+
+   option = KEEP_ALIVE_INTVL;
+   result =
+      setsockopt (peer, IPPROTO_TCP, TCP_KEEPINTVL, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("TCP_KEEPINTVL");
+      return -1;
+   }
+
+   option = KEEP_ALIVE_CNT;
+   result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPCNT, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("TCP_KEEPCNT");
+      return -1;
+   }
+
+   return 0;
+}
+
+static int os_tcp_listen_socket (uint16_t port, int backlog, bool shared)
 {
    int result;
    int sock;
    struct sockaddr_in addr;
-   struct timeval tv;
    int option;
-   int peer;
 
-   /* Create listening socket */
-   sock = socket (AF_INET, SOCK_STREAM, 0);
+   /* Create listening socket. It is non-blocking so that a connection
+      that is aborted after it has been signalled can not block the
+      caller of accept. */
+   sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
    if (sock == -1)
    {
       PERROR ("socket");
@@ -115,109 +172,90 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("SO_REUSEADDR");
-      goto error1;
+      goto error;
    }
 
-   tv.tv_sec = 0;
-   tv.tv_usec = RCV_TIMEOUT * 1000;
-   result = setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
-   if (result == -1)
+   if (shared)
    {
-      PERROR ("SO_RCVTIMEO");
-      goto error1;
+      /* Several listeners on the port, the kernel spreads connections
+         across them */
+      result =
+         setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &option, sizeof (int));
+      if (result == -1)
+      {
+         PERROR ("SO_REUSEPORT");
+         goto error;
+      }
    }
 
    result = bind (sock, (struct sockaddr *)&addr, sizeof (addr));
    if (result == -1)
    {
       PERROR ("bind");
-      goto error1;
+      goto error;
    }
 
-   result = listen (sock, 1);
+   result = listen (sock, backlog);
    if (result == -1)
    {
       PERROR ("listen");
-      goto error1;
+      goto error;
    }
 
-   /* Accept one connection */
-   peer = accept (sock, NULL, NULL);
-   if (peer == -1)
-   {
-      /* Error or timeout */
-      goto error1;
-   }
+   return sock;
 
-   /* Set peer socket options (nagle, reuseaddr, receive timeout,
-      keepalive). */
+error:
+   close (sock);
+   return -1;
+}
 
-   option = 1;
-   result = setsockopt (peer, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("TCP_NODELAY");
-      goto error2;
-   }
+int os_tcp_listen (uint16_t port, int backlog)
+{
+   return os_tcp_listen_socket (port, backlog, false);
+}
 
-   option = 1; /* enable */
-   result = setsockopt (peer, SOL_SOCKET, SO_REUSEADDR, &option, sizeof (int));
-   if (result == -1)
+int os_tcp_accept (int listener, int wakeup, uint32_t tmo)
+{
+   struct timeval tv;
+   int result;
+   int peer;
+
+   /* Wait for a connection */
+   result = os_tcp_recv_wait (listener, wakeup, tmo);
+   if (result <= 0)
+      return result;
+
+   peer = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+   if (peer == -1)
    {
-      PERROR ("SO_REUSEADDR");
-      goto error2;
+      /* The peer may have given up before it was accepted */
+      return (errno == EAGAIN || errno == EWOULDBLOCK ||
+              errno == ECONNABORTED)
+                ? 0
+                : -1;
    }
 
+   /* Set peer socket options (receive timeout, nagle, keepalive) */
+
    tv.tv_sec = 0;
    tv.tv_usec = RCV_TIMEOUT * 1000;
    result = setsockopt (peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
    if (result == -1)
    {
       PERROR ("SO_RCVTIMEO");
-      goto error2;
-   }
-
-   option = 1;
-   result = setsockopt (peer, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("SO_KEEPALIVE");
-      goto error2;
-   }
-
-   option = KEEP_ALIVE_IDLE;
-   result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPIDLE, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("TCP_KEEPALIVE");
-      goto error2;
-   }
-
-   option = KEEP_ALIVE_INTVL;
-   result =
-      setsockopt (peer, IPPROTO_TCP, TCP_KEEPINTVL, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("TCP_KEEPINTVL");
-      goto error2;
+      goto error;
    }
 
-   option = KEEP_ALIVE_CNT;
-   result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPCNT, &option, sizeof (int));
+   result = os_tcp_peer_options (peer);
    if (result == -1)
    {
-      PERROR ("TCP_KEEPCNT");
-      goto error2;
+      goto error;
    }
 
-   /* Close listening socket. No more connections accepted. */
-   close (sock);
    return peer;
 
-error2:
+error:
    close (peer);
-error1:
-   close (sock);
    return -1;
 }
 
@@ -272,17 +310,337 @@ int os_tcp_recv (int peer, void * buffer, size_t size)
    return n;
 }
 
-int os_tcp_recv_wait (int peer, uint32_t tmo)
+int os_tcp_recv_some (int peer, void * buffer, size_t size)
+{
+   /* Receive what is available, waiting at most the receive timeout
+      for the first byte */
+   return recv (peer, buffer, size, 0);
+}
+
+int os_tcp_recv_wait (int peer, int wakeup, uint32_t tmo)
 {
    fd_set fds;
    int result;
    struct timeval tv;
+   int nfds = peer + 1;
 
    FD_ZERO (&fds);
    FD_SET (peer, &fds);
 
+   if (wakeup >= 0)
+   {
+      FD_SET (wakeup, &fds);
+      if (wakeup >= nfds)
+         nfds = wakeup + 1;
+   }
+
    tv.tv_sec = 0;
    tv.tv_usec = tmo * 1000;
-   result = select (peer + 1, &fds, NULL, NULL, &tv);
+   result = select (nfds, &fds, NULL, NULL, &tv);
+
+   if (result > 0 && wakeup >= 0 && FD_ISSET (wakeup, &fds))
+   {
+      /* Woken up, report a timeout unless the peer is also ready */
+      os_wakeup_clear (wakeup);
+      result = FD_ISSET (peer, &fds) ? 1 : 0;
+   }
+
    return result;
 }
+
+#if !defined(USE_IO_URING)
+
+/* Readiness notification on epoll. See mbal_poll_uring.c for the
+   io_uring implementation. */
+
+static uint32_t os_poll_to_epoll (uint32_t events)
+{
+   uint32_t epoll_events = 0;
+
+   if (events & OS_POLL_IN)
+      epoll_events |= EPOLLIN;
+   if (events & OS_POLL_OUT)
+      epoll_events |= EPOLLOUT;
+
+   return epoll_events;
+}
+
+static uint32_t os_poll_from_epoll (uint32_t epoll_events)
+{
+   uint32_t events = 0;
+
+   if (epoll_events & EPOLLIN)
+      events |= OS_POLL_IN;
+   if (epoll_events & EPOLLOUT)
+      events |= OS_POLL_OUT;
+   if (epoll_events & (EPOLLERR | EPOLLHUP))
+      events |= OS_POLL_ERR;
+
+   return events;
+}
+
+int os_poll_create (void)
+{
+   int set;
+
+   set = epoll_create1 (EPOLL_CLOEXEC);
+   if (set == -1)
+   {
+      PERROR ("epoll_create1");
+   }
+
+   return set;
+}
+
+void os_poll_destroy (int set)
+{
+   close (set);
+}
+
+int os_poll_add (int set, int fd, uint32_t events, void * arg)
+{
+   struct epoll_event event;
+
+   event.events   = os_poll_to_epoll (events);
+   event.data.ptr = arg;
+   return epoll_ctl (set, EPOLL_CTL_ADD, fd, &event);
+}
+
+int os_poll_modify (int set, int fd, uint32_t events, void * arg)
+{
+   struct epoll_event event;
+
+   event.events   = os_poll_to_epoll (events);
+   event.data.ptr = arg;
+   return epoll_ctl (set, EPOLL_CTL_MOD, fd, &event);
+}
+
+int os_poll_remove (int set, int fd)
+{
+   return epoll_ctl (set, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int os_poll_wait (int set, os_poll_event_t * events, int max, uint32_t tmo)
+{
+   struct epoll_event epoll_events[64];
+   int timeout = (tmo == OS_WAIT_FOREVER) ? -1 : (int)tmo;
+   int n;
+   int i;
+
+   if (max > (int)NELEMENTS (epoll_events))
+      max = NELEMENTS (epoll_events);
+
+   do
+   {
+      n = epoll_wait (set, epoll_events, max, timeout);
+   } while (n == -1 && errno == EINTR);
+
+   for (i = 0; i < n; i++)
+   {
+      events[i].events = os_poll_from_epoll (epoll_events[i].events);
+      events[i].arg    = epoll_events[i].data.ptr;
+   }
+
+   return n;
+}
+
+int os_poll_recv (int set, int fd, bool enable)
+{
+   /* Data is received by the caller when OS_POLL_IN is reported */
+   return -1;
+}
+
+#endif /* USE_IO_URING */
+
+int os_tcp_listen_shared (uint16_t port, int backlog)
+{
+   return os_tcp_listen_socket (port, backlog, true);
+}
+
+int os_thread_pin (int cpu)
+{
+   cpu_set_t cpus;
+   int error;
+
+   CPU_ZERO (&cpus);
+   CPU_SET (cpu, &cpus);
+
+   error = pthread_setaffinity_np (pthread_self(), sizeof (cpus), &cpus);
+   if (error != 0)
+   {
+      errno = error;
+      PERROR ("pthread_setaffinity_np");
+      return -1;
+   }
+
+   return 0;
+}
+
+int os_tcp_connect_start (const char * name, uint16_t port)
+{
+   int result;
+   int sock;
+   int option;
+   struct sockaddr_in addr;
+
+   /* Create non-blocking socket */
+   sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (sock == -1)
+   {
+      PERROR ("socket");
+      return -1;
+   }
+
+   option = 1;
+   result = setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("TCP_NODELAY");
+      goto error;
+   }
+
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = inet_addr (name);
+   addr.sin_port = htons (port);
+
+   /* Start connecting. Completion is signalled by OS_POLL_OUT. */
+   result = connect (sock, (struct sockaddr *)&addr, sizeof (addr));
+   if (result == -1 && errno != EINPROGRESS)
+   {
+      goto error;
+   }
+
+   return sock;
+
+error:
+   close (sock);
+   return -1;
+}
+
+int os_tcp_send_buffer (int peer, size_t size)
+{
+   int option = (int)size;
+   int result;
+
+   result = setsockopt (peer, SOL_SOCKET, SO_SNDBUF, &option, sizeof (int));
+   if (result == -1)
+   {
+      PERROR ("SO_SNDBUF");
+      return -1;
+   }
+
+   return 0;
+}
+
+int os_tcp_connect_result (int peer)
+{
+   int error = 0;
+   socklen_t len = sizeof (error);
+
+   if (getsockopt (peer, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+   {
+      return -1;
+   }
+
+   return (error == 0) ? 0 : -1;
+}
+
+int os_tcp_send_nb (int peer, const void * buffer, size_t size)
+{
+   ssize_t n;
+
+   n = send (peer, buffer, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+   if (n == -1)
+   {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+   }
+
+   return (int)n;
+}
+
+int os_tcp_recv_nb (int peer, void * buffer, size_t size)
+{
+   ssize_t n;
+
+   n = recv (peer, buffer, size, MSG_DONTWAIT);
+   if (n == -1)
+   {
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+   }
+   if (n == 0)
+   {
+      /* Connection closed by peer */
+      return -1;
+   }
+
+   return (int)n;
+}
+
+int os_tcp_accept_nb (int listener, int * peers, size_t max)
+{
+   size_t n = 0;
+
+   /* Drain the backlog */
+   while (n < max)
+   {
+      int peer;
+
+      peer = accept4 (listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (peer == -1)
+      {
+         /* The peer may have given up before it was accepted */
+         if (errno == ECONNABORTED || errno == EINTR)
+            continue;
+
+         break;
+      }
+
+      if (os_tcp_peer_options (peer) == -1)
+      {
+         close (peer);
+         continue;
+      }
+
+      peers[n++] = peer;
+   }
+
+   return (int)n;
+}
+
+int os_wakeup_create (void)
+{
+   int wakeup;
+
+   wakeup = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (wakeup == -1)
+   {
+      PERROR ("eventfd");
+   }
+
+   return wakeup;
+}
+
+void os_wakeup_destroy (int wakeup)
+{
+   close (wakeup);
+}
+
+void os_wakeup_signal (int wakeup)
+{
+   uint64_t value = 1;
+   ssize_t n;
+
+   /* Can only fail if the counter would overflow, in which case the
+      descriptor is readable anyway */
+   n = write (wakeup, &value, sizeof (value));
+   (void)n;
+}
+
+void os_wakeup_clear (int wakeup)
+{
+   uint64_t value;
+   ssize_t n;
+
+   n = read (wakeup, &value, sizeof (value));
+   (void)n;
+}
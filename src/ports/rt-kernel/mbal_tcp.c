@@ -84,13 +84,12 @@ error:
    return -1;
 }
 
-int os_tcp_accept_connection (uint16_t port)
+int os_tcp_listen (uint16_t port, int backlog)
 {
    int result;
    int sock;
    struct sockaddr_in addr;
    int option;
-   int peer;
 
    /* Create listening socket */
    sock = socket (AF_INET, SOCK_STREAM, 0);
@@ -111,56 +110,55 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("SO_REUSEADDR");
-      goto error1;
-   }
-
-   option = RCV_TIMEOUT;
-   result = setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("SO_RCVTIMEO");
-      goto error1;
+      goto error;
    }
 
    result = bind (sock, (struct sockaddr *)&addr, sizeof (addr));
    if (result == -1)
    {
       PERROR ("bind");
-      goto error1;
+      goto error;
    }
 
-   result = listen (sock, 1);
+   result = listen (sock, backlog);
    if (result == -1)
    {
       PERROR ("listen");
-      goto error1;
+      goto error;
    }
 
-   /* Accept one connection */
-   peer = accept (sock, NULL, NULL);
+   return sock;
+
+error:
+   close (sock);
+   return -1;
+}
+
+int os_tcp_accept (int listener, int wakeup, uint32_t tmo)
+{
+   int result;
+   int option;
+   int peer;
+
+   /* Wait for a connection */
+   result = os_tcp_recv_wait (listener, wakeup, tmo);
+   if (result <= 0)
+      return result;
+
+   peer = accept (listener, NULL, NULL);
    if (peer == -1)
    {
-      /* Error or timeout */
-      goto error1;
+      return -1;
    }
 
-   /* Set peer socket options (nagle, reuseaddr, receive timeout,
-      keepalive). */
+   /* Set peer socket options (nagle, receive timeout, keepalive). */
 
    option = 1;
    result = setsockopt (peer, IPPROTO_TCP, TCP_NODELAY, &option, sizeof (int));
    if (result == -1)
    {
       PERROR ("TCP_NODELAY");
-      goto error2;
-   }
-
-   option = 1; /* enable */
-   result = setsockopt (peer, SOL_SOCKET, SO_REUSEADDR, &option, sizeof (int));
-   if (result == -1)
-   {
-      PERROR ("SO_REUSEADDR");
-      goto error2;
+      goto error;
    }
 
    option = RCV_TIMEOUT;
@@ -168,7 +166,7 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("SO_RCVTIMEO");
-      goto error2;
+      goto error;
    }
 
    option = 1;
@@ -176,7 +174,7 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("SO_KEEPALIVE");
-      goto error2;
+      goto error;
    }
 
    option = KEEP_ALIVE_IDLE;
@@ -184,7 +182,7 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("TCP_KEEPALIVE");
-      goto error2;
+      goto error;
    }
 
    option = KEEP_ALIVE_INTVL;
@@ -193,7 +191,7 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("TCP_KEEPINTVL");
-      goto error2;
+      goto error;
    }
 
    option = KEEP_ALIVE_CNT;
@@ -201,17 +199,13 @@ int os_tcp_accept_connection (uint16_t port)
    if (result == -1)
    {
       PERROR ("TCP_KEEPCNT");
-      goto error2;
+      goto error;
    }
 
-   /* Close listening socket. No more connections accepted. */
-   close (sock);
    return peer;
 
-error2:
+error:
    close (peer);
-error1:
-   close (sock);
    return -1;
 }
 
@@ -266,17 +260,108 @@ int os_tcp_recv (int peer, void * buffer, size_t size)
    return n;
 }
 
-int os_tcp_recv_wait (int peer, uint32_t tmo)
+int os_tcp_recv_some (int peer, void * buffer, size_t size)
+{
+   /* Receive what is available, waiting at most the receive timeout
+      for the first byte */
+   return recv (peer, buffer, size, 0);
+}
+
+int os_tcp_recv_wait (int peer, int wakeup, uint32_t tmo)
 {
    fd_set fds;
    int result;
    struct timeval tv;
+   int nfds = peer + 1;
 
    FD_ZERO (&fds);
    FD_SET (peer, &fds);
 
+   if (wakeup >= 0)
+   {
+      FD_SET (wakeup, &fds);
+      if (wakeup >= nfds)
+         nfds = wakeup + 1;
+   }
+
    tv.tv_sec = 0;
    tv.tv_usec = tmo * 1000;
-   result = select (peer + 1, &fds, NULL, NULL, &tv);
+   result = select (nfds, &fds, NULL, NULL, &tv);
+
+   if (result > 0 && wakeup >= 0 && FD_ISSET (wakeup, &fds))
+   {
+      /* Woken up, report a timeout unless the peer is also ready */
+      os_wakeup_clear (wakeup);
+      result = FD_ISSET (peer, &fds) ? 1 : 0;
+   }
+
    return result;
 }
+
+int os_wakeup_create (void)
+{
+   int result;
+   int sock;
+   struct sockaddr_in addr;
+   socklen_t size = sizeof (addr);
+
+   /* A UDP socket connected to itself on the loopback interface. Each
+      signal queues a datagram that makes the socket readable. */
+   sock = socket (AF_INET, SOCK_DGRAM, 0);
+   if (sock == -1)
+   {
+      PERROR ("socket");
+      return -1;
+   }
+
+   memset (&addr, 0, sizeof (addr));
+
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   addr.sin_port = 0;
+
+   result = bind (sock, (struct sockaddr *)&addr, sizeof (addr));
+   if (result == -1)
+   {
+      PERROR ("bind");
+      goto error;
+   }
+
+   result = getsockname (sock, (struct sockaddr *)&addr, &size);
+   if (result == -1)
+   {
+      goto error;
+   }
+
+   result = connect (sock, (struct sockaddr *)&addr, sizeof (addr));
+   if (result == -1)
+   {
+      goto error;
+   }
+
+   return sock;
+
+error:
+   close (sock);
+   return -1;
+}
+
+void os_wakeup_destroy (int wakeup)
+{
+   close (wakeup);
+}
+
+void os_wakeup_signal (int wakeup)
+{
+   uint8_t value = 1;
+
+   send (wakeup, &value, sizeof (value), MSG_DONTWAIT);
+}
+
+void os_wakeup_clear (int wakeup)
+{
+   uint8_t value;
+
+   while (recv (wakeup, &value, sizeof (value), MSG_DONTWAIT) > 0)
+      ;
+}
@@ -97,14 +97,12 @@ error:
    return -1;
 }
 
-int os_tcp_accept_connection (uint16_t port)
+int os_tcp_listen (uint16_t port, int backlog)
 {
    int result;
    SOCKET sock;
    struct sockaddr_in addr;
-   DWORD tv;
    int option;
-   SOCKET peer;
 
    os_winsock_init();
 
@@ -126,54 +124,55 @@ int os_tcp_accept_connection (uint16_t port)
       setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error1;
-   }
-
-   tv = RCV_TIMEOUT;
-   result =
-      setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof (tv));
-   if (result == SOCKET_ERROR)
-   {
-      goto error1;
+      goto error;
    }
 
    result = bind (sock, (struct sockaddr *)&addr, sizeof (addr));
    if (result == SOCKET_ERROR)
    {
-      goto error1;
+      goto error;
    }
 
-   result = listen (sock, 1);
+   result = listen (sock, backlog);
    if (result == SOCKET_ERROR)
    {
-      goto error1;
+      goto error;
    }
 
-   /* Accept one connection */
+   return (int)sock;
+
+error:
+   closesocket (sock);
+   return -1;
+}
+
+int os_tcp_accept (int listener, int wakeup, uint32_t tmo)
+{
+   SOCKET sock = (SOCKET)listener;
+   int result;
+   DWORD tv;
+   int option;
+   SOCKET peer;
+
+   /* Wait for a connection */
+   result = os_tcp_recv_wait (listener, wakeup, tmo);
+   if (result <= 0)
+      return result;
+
    peer = accept (sock, NULL, NULL);
    if (peer == INVALID_SOCKET)
    {
-      /* Error or timeout */
-      goto error1;
+      return -1;
    }
 
-   /* Set peer socket options (nagle, reuseaddr, receive timeout,
-      keepalive). */
+   /* Set peer socket options (nagle, receive timeout, keepalive). */
 
    option = 1;
    result =
       setsockopt (peer, IPPROTO_TCP, TCP_NODELAY, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
-   }
-
-   option = 1; /* enable */
-   result =
-      setsockopt (peer, SOL_SOCKET, SO_REUSEADDR, (char *)&option, sizeof (int));
-   if (result == SOCKET_ERROR)
-   {
-      goto error2;
+      goto error;
    }
 
    tv = RCV_TIMEOUT;
@@ -181,7 +180,7 @@ int os_tcp_accept_connection (uint16_t port)
       setsockopt (peer, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof (tv));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
+      goto error;
    }
 
    option = 1;
@@ -189,7 +188,7 @@ int os_tcp_accept_connection (uint16_t port)
       setsockopt (peer, SOL_SOCKET, SO_KEEPALIVE, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
+      goto error;
    }
 
    /* keepalive is not available on windows */
@@ -198,7 +197,7 @@ int os_tcp_accept_connection (uint16_t port)
    result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPIDLE, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
+      goto error;
    }
 
    option = KEEP_ALIVE_INTVL;
@@ -206,25 +205,21 @@ int os_tcp_accept_connection (uint16_t port)
       setsockopt (peer, IPPROTO_TCP, TCP_KEEPINTVL, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
+      goto error;
    }
 
    option = KEEP_ALIVE_CNT;
    result = setsockopt (peer, IPPROTO_TCP, TCP_KEEPCNT, (char *)&option, sizeof (int));
    if (result == SOCKET_ERROR)
    {
-      goto error2;
+      goto error;
    }
 #endif
 
-   /* Close listening socket. No more connections accepted. */
-   closesocket (sock);
    return (int)peer;
 
-error2:
+error:
    closesocket (peer);
-error1:
-   closesocket (sock);
    return -1;
 }
 
@@ -282,7 +277,16 @@ int os_tcp_recv (int peer, void * buffer, size_t size)
    return n;
 }
 
-int os_tcp_recv_wait (int peer, uint32_t tmo)
+int os_tcp_recv_some (int peer, void * buffer, size_t size)
+{
+   SOCKET s = (SOCKET)peer;
+
+   /* Receive what is available, waiting at most the receive timeout
+      for the first byte */
+   return recv (s, buffer, (int)size, 0);
+}
+
+int os_tcp_recv_wait (int peer, int wakeup, uint32_t tmo)
 {
    SOCKET s = (SOCKET)peer;
    fd_set fds;
@@ -292,8 +296,95 @@ int os_tcp_recv_wait (int peer, uint32_t tmo)
    FD_ZERO (&fds);
    FD_SET (s, &fds);
 
+   if (wakeup >= 0)
+   {
+      FD_SET ((SOCKET)wakeup, &fds);
+   }
+
    tv.tv_sec = 0;
    tv.tv_usec = tmo * 1000;
    result = select (0, &fds, NULL, NULL, &tv);
+
+   if (result > 0 && wakeup >= 0 && FD_ISSET ((SOCKET)wakeup, &fds))
+   {
+      /* Woken up, report a timeout unless the peer is also ready */
+      os_wakeup_clear (wakeup);
+      result = FD_ISSET (s, &fds) ? 1 : 0;
+   }
+
    return result;
 }
+
+int os_wakeup_create (void)
+{
+   SOCKET sock;
+   int result;
+   struct sockaddr_in addr;
+   int size = sizeof (addr);
+   u_long option;
+
+   /* A UDP socket connected to itself on the loopback interface. Each
+      signal queues a datagram that makes the socket readable. */
+   sock = socket (AF_INET, SOCK_DGRAM, 0);
+   if (sock == INVALID_SOCKET)
+   {
+      return -1;
+   }
+
+   memset (&addr, 0, sizeof (addr));
+
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   addr.sin_port = 0;
+
+   result = bind (sock, (struct sockaddr *)&addr, sizeof (addr));
+   if (result == SOCKET_ERROR)
+   {
+      goto error;
+   }
+
+   result = getsockname (sock, (struct sockaddr *)&addr, &size);
+   if (result == SOCKET_ERROR)
+   {
+      goto error;
+   }
+
+   result = connect (sock, (struct sockaddr *)&addr, sizeof (addr));
+   if (result == SOCKET_ERROR)
+   {
+      goto error;
+   }
+
+   option = 1;
+   result = ioctlsocket (sock, FIONBIO, &option);
+   if (result == SOCKET_ERROR)
+   {
+      goto error;
+   }
+
+   return (int)sock;
+
+error:
+   closesocket (sock);
+   return -1;
+}
+
+void os_wakeup_destroy (int wakeup)
+{
+   closesocket ((SOCKET)wakeup);
+}
+
+void os_wakeup_signal (int wakeup)
+{
+   char value = 1;
+
+   send ((SOCKET)wakeup, &value, sizeof (value), 0);
+}
+
+void os_wakeup_clear (int wakeup)
+{
+   char value;
+
+   while (recv ((SOCKET)wakeup, &value, sizeof (value), 0) > 0)
+      ;
+}
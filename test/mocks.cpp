@@ -22,6 +22,9 @@ unsigned int mock_mb_pdu_tx_calls;
 pdu_txn_t mock_mb_pdu_tx_transaction;
 uint8_t mock_mb_pdu_tx_data[MAX_PDU_SIZE];
 size_t mock_mb_pdu_tx_size;
+uint16_t mock_mb_pdu_tx_ids[64];
+uint16_t mock_mb_pdu_tx_quantities[64];
+size_t mock_mb_pdu_tx_num_ids;
 
 void mock_mb_pdu_tx (
    mb_transport_t * transport,
@@ -32,12 +35,23 @@ void mock_mb_pdu_tx (
    mock_mb_pdu_tx_size = size;
    memset (mock_mb_pdu_tx_data, 0, sizeof (mock_mb_pdu_tx_data));
    memcpy (mock_mb_pdu_tx_data, transaction->data, size);
+
+   if (mock_mb_pdu_tx_num_ids < NELEMENTS (mock_mb_pdu_tx_ids))
+   {
+      mock_mb_pdu_tx_ids[mock_mb_pdu_tx_num_ids] = transaction->id;
+      mock_mb_pdu_tx_quantities[mock_mb_pdu_tx_num_ids] =
+         (uint16_t)(mock_mb_pdu_tx_data[3] << 8 | mock_mb_pdu_tx_data[4]);
+      mock_mb_pdu_tx_num_ids++;
+   }
 }
 
 unsigned int mock_mb_pdu_rx_calls;
 const uint8_t * mock_mb_pdu_rx_data;
 size_t mock_mb_pdu_rx_size;
 int mock_mb_pdu_rx_result;
+uint16_t mock_mb_pdu_rx_id;
+bool mock_mb_pdu_rx_fifo;
+size_t mock_mb_pdu_rx_num_ids;
 
 int mock_mb_pdu_rx (
    mb_transport_t * transport,
@@ -45,7 +59,36 @@ int mock_mb_pdu_rx (
    uint32_t tmp)
 {
    mock_mb_pdu_rx_calls++;
+
+   if (mock_mb_pdu_rx_fifo)
+   {
+      uint8_t * response = (uint8_t *)transaction->data;
+      uint16_t quantity;
+      uint16_t id;
+
+      if (mock_mb_pdu_rx_num_ids >= mock_mb_pdu_tx_num_ids)
+         return ETIMEOUT;
+
+      id       = mock_mb_pdu_tx_ids[mock_mb_pdu_rx_num_ids];
+      quantity = mock_mb_pdu_tx_quantities[mock_mb_pdu_rx_num_ids];
+      mock_mb_pdu_rx_num_ids++;
+
+      transaction->id = id;
+      response[0]     = 0x03;
+      response[1]     = (uint8_t)(2 * quantity);
+      for (uint16_t k = 0; k < quantity; k++)
+      {
+         response[2 + 2 * k]     = (uint8_t)id;
+         response[2 + 2 * k + 1] = (uint8_t)k;
+      }
+      return 2 + 2 * quantity;
+   }
+
    memcpy (transaction->data, mock_mb_pdu_rx_data, mock_mb_pdu_rx_size);
+   if (mock_mb_pdu_rx_id != 0)
+   {
+      transaction->id = mock_mb_pdu_rx_id;
+   }
    return mock_mb_pdu_rx_result;
 }
 
@@ -31,6 +31,12 @@ extern pdu_txn_t mock_mb_pdu_tx_transaction;
 extern uint8_t mock_mb_pdu_tx_data[MAX_PDU_SIZE];
 extern size_t mock_mb_pdu_tx_size;
 
+/* Transaction IDs and register quantities of transmitted requests,
+   oldest first */
+extern uint16_t mock_mb_pdu_tx_ids[64];
+extern uint16_t mock_mb_pdu_tx_quantities[64];
+extern size_t mock_mb_pdu_tx_num_ids;
+
 void mock_mb_pdu_tx (
    mb_transport_t * transport,
    const pdu_txn_t * transaction,
@@ -40,6 +46,13 @@ extern unsigned int mock_mb_pdu_rx_calls;
 extern const uint8_t * mock_mb_pdu_rx_data;
 extern size_t mock_mb_pdu_rx_size;
 extern int mock_mb_pdu_rx_result;
+extern uint16_t mock_mb_pdu_rx_id;
+
+/* If set, register reads are answered in the order they were sent,
+   with the ID of the request. Register k of the response holds
+   (ID << 8) + k. */
+extern bool mock_mb_pdu_rx_fifo;
+extern size_t mock_mb_pdu_rx_num_ids;
 
 int mock_mb_pdu_rx (
    mb_transport_t * transport,
@@ -0,0 +1,235 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_cache.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "mocks.h"
+#include "test_util.h"
+
+// Test fixture
+
+class MbusCacheTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      TestBase::SetUp();
+      transport.has_txn_id = false;
+      mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+      mbus_cache_init (&cache, &cache_cfg, entries);
+      mbus_cache_attach (&mbus, &cache);
+   }
+
+   void Respond (uint8_t * response, size_t size)
+   {
+      mock_mb_pdu_rx_data   = response;
+      mock_mb_pdu_rx_size   = size;
+      mock_mb_pdu_rx_result = size;
+   }
+
+   mbus_cfg_t mbus_cfg = {
+      .timeout = 1000,
+      .window = 1,
+   };
+   mbus_cache_cfg_t cache_cfg = {
+      .ttl  = {1000, 1000, 0, 0, 1000},
+      .size = 16,
+   };
+   mbus_t mbus;
+   uint8_t scratch[MAX_PDU_SIZE];
+   mb_transport_t transport;
+   mbus_cache_t cache;
+   mbus_cache_entry_t entries[16];
+};
+
+// Tests
+
+TEST_F (MbusCacheTest, MbusCacheShouldServeRepeatedReads)
+{
+   uint8_t response[] = {0x03, 0x04, 0x11, 0x22, 0x33, 0x44};
+   uint16_t data[2];
+
+   Respond (response, sizeof (response));
+
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 2, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+
+   memset (data, 0, sizeof (data));
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 2, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 1u);
+   EXPECT_EQ (data[0], 0x1122);
+   EXPECT_EQ (data[1], 0x3344);
+
+   // Subset of cached range
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 2), 1, data), 0);
+   EXPECT_EQ (data[0], 0x3344);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_EQ (cache.hits, 2u);
+
+   // Other slave is not cached
+   EXPECT_EQ (mbus_read (&mbus, 2, MB_ADDRESS (4, 1), 2, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldServeBits)
+{
+   uint8_t response[] = {0x01, 0x01, 0x05};
+   uint8_t data;
+
+   Respond (response, sizeof (response));
+
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (0, 1), 3, &data), 0);
+   data = 0;
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (0, 2), 2, &data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_EQ (data, 0x02);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldNotCacheTableWithoutTtl)
+{
+   uint8_t response[] = {0x04, 0x02, 0x11, 0x22};
+   uint16_t data;
+
+   Respond (response, sizeof (response));
+
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (3, 1), 1, &data), 0);
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (3, 1), 1, &data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldExpire)
+{
+   uint8_t response[] = {0x03, 0x02, 0x11, 0x22};
+   uint16_t data;
+
+   cache_cfg.ttl[4] = 1;
+   mbus_cache_init (&cache, &cache_cfg, entries);
+   Respond (response, sizeof (response));
+
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   os_usleep (2000);
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldReadYourWrites)
+{
+   uint8_t read_response[]  = {0x03, 0x04, 0x11, 0x22, 0x33, 0x44};
+   uint8_t write_response[] = {0x06, 0x00, 0x01, 0xAB, 0xCD};
+   uint16_t values[2]       = {0x5555, 0x6666};
+   uint16_t data[2];
+
+   Respond (read_response, sizeof (read_response));
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 2, data), 0);
+
+   Respond (write_response, sizeof (write_response));
+   EXPECT_EQ (mbus_write_single (&mbus, 1, MB_ADDRESS (4, 2), 0xABCD), 0);
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 2, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_EQ (data[0], 0x1122);
+   EXPECT_EQ (data[1], 0xABCD);
+
+   write_response[0] = 0x10;
+   EXPECT_EQ (mbus_write (&mbus, 1, MB_ADDRESS (4, 1), 2, values), 0);
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 2, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 3u);
+   EXPECT_EQ (data[0], 0x5555);
+   EXPECT_EQ (data[1], 0x6666);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldInvalidateFailedWrites)
+{
+   uint8_t read_response[]  = {0x03, 0x02, 0x11, 0x22};
+   uint8_t write_response[] = {0x86, 0x02};
+   uint16_t data;
+
+   Respond (read_response, sizeof (read_response));
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+
+   Respond (write_response, sizeof (write_response));
+   EXPECT_EQ (
+      mbus_write_single (&mbus, 1, MB_ADDRESS (4, 1), 0xABCD),
+      EILLEGAL_DATA_ADDRESS);
+
+   Respond (read_response, sizeof (read_response));
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 3u);
+   EXPECT_EQ (data, 0x1122);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldLimitTtl)
+{
+   uint8_t response[] = {0x03, 0x02, 0x11, 0x22};
+   uint16_t data;
+
+   // 5 hours, ttl * 1000 does not fit in 32 bits
+   cache_cfg.ttl[4] = 5 * 3600 * 1000;
+   mbus_cache_init (&cache, &cache_cfg, entries);
+   EXPECT_EQ (cache.ttl[4], (uint32_t)MBUS_CACHE_MAX_TTL);
+
+   Respond (response, sizeof (response));
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   EXPECT_EQ (mbus_read (&mbus, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_EQ (data, 0x1122);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldKeepWriteSentAfterRead)
+{
+   uint16_t value = 0xABCD;
+   uint16_t data  = 0;
+   int handle;
+
+   transport.has_txn_id = true;
+   mbus_cfg.window       = 4;
+   mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+   mbus_cache_attach (&mbus, &cache);
+   mock_mb_pdu_rx_fifo = true;
+
+   // Read response arrives after the write has been sent
+   handle = mbus_read_submit (&mbus, 1, MB_ADDRESS (4, 1), 1, &data);
+   ASSERT_GE (handle, 0);
+   EXPECT_GE (mbus_write_submit (&mbus, 1, MB_ADDRESS (4, 1), 1, &value), 0);
+   EXPECT_EQ (mbus_wait (&mbus, handle), 0);
+   EXPECT_EQ (data, mock_mb_pdu_tx_ids[0] << 8);
+
+   data = 0;
+   EXPECT_EQ (mbus_cache_read (&cache, 1, MB_ADDRESS (4, 1), 1, &data), 0);
+   EXPECT_EQ (data, 0xABCD);
+}
+
+TEST_F (MbusCacheTest, MbusCacheShouldNotFillAfterClear)
+{
+   uint16_t data = 0;
+   int handle;
+
+   transport.has_txn_id = true;
+   mbus_cfg.window       = 4;
+   mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+   mbus_cache_attach (&mbus, &cache);
+   mock_mb_pdu_rx_fifo = true;
+
+   handle = mbus_read_submit (&mbus, 1, MB_ADDRESS (4, 1), 1, &data);
+   ASSERT_GE (handle, 0);
+   mbus_cache_clear (&cache);
+   EXPECT_EQ (mbus_wait (&mbus, handle), 0);
+
+   EXPECT_EQ (mbus_cache_read (&cache, 1, MB_ADDRESS (4, 1), 1, &data), -1);
+}
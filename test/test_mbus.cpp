@@ -30,17 +30,35 @@ class MbusTest : public TestBase
    virtual void SetUp()
    {
       TestBase::SetUp();
+      transport.has_txn_id = false;
       mbus_init (&mbus, &mbus_cfg, &transport, scratch);
    }
 
    mbus_cfg_t mbus_cfg = {
       .timeout = 1000,
+      .window = 1,
    };
    mbus_t mbus;
    uint8_t scratch[MAX_PDU_SIZE];
    mb_transport_t transport;
 };
 
+class MbusPipelineTest : public MbusTest
+{
+ protected:
+   virtual void SetUp()
+   {
+      TestBase::SetUp();
+      transport.has_txn_id = true;
+      mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+   }
+
+   mbus_cfg_t mbus_cfg = {
+      .timeout = 1000,
+      .window = 4,
+   };
+};
+
 // Tests
 
 TEST_F (MbusTest, MbusReadCoils)
@@ -48,14 +66,14 @@ TEST_F (MbusTest, MbusReadCoils)
    mb_address_t address = MB_ADDRESS (0, 0x2711);
    uint8_t data[4];
    int error;
-   uint8_t expected[253] = {0x01, 0x27, 0x10, 0x00, 0x04};
+   uint8_t expected[253] = {0x01, 0x27, 0x10, 0x00, 0x20};
    uint8_t response[]    = {0x01, 0x04, 0x12, 0x34, 0x56, 0x78};
 
    mock_mb_pdu_rx_data   = response;
    mock_mb_pdu_rx_size   = sizeof (response);
    mock_mb_pdu_rx_result = sizeof (response);
 
-   error = mbus_read (&mbus, 1, address, NELEMENTS (data), data);
+   error = mbus_read (&mbus, 1, address, 8 * NELEMENTS (data), data);
    EXPECT_EQ (error, 0);
    EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
    EXPECT_EQ (data[0], 0x12);
@@ -69,14 +87,14 @@ TEST_F (MbusTest, MbusReadInputs)
    mb_address_t address = MB_ADDRESS (1, 0x2711);
    uint8_t data[4];
    int error;
-   uint8_t expected[253] = {0x02, 0x27, 0x10, 0x00, 0x04};
+   uint8_t expected[253] = {0x02, 0x27, 0x10, 0x00, 0x20};
    uint8_t response[] = {0x02, 0x04, 0x12, 0x34, 0x56, 0x78};
 
    mock_mb_pdu_rx_data = response;
    mock_mb_pdu_rx_size = sizeof (response);
    mock_mb_pdu_rx_result = sizeof (response);
 
-   error = mbus_read (&mbus, 1, address, NELEMENTS (data), data);
+   error = mbus_read (&mbus, 1, address, 8 * NELEMENTS (data), data);
    EXPECT_EQ (error, 0);
    EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
    EXPECT_EQ (data[0], 0x12);
@@ -429,6 +447,119 @@ TEST_F (MbusTest, MbusWriteShouldNotExpectResponseOnBroadcast)
    EXPECT_EQ (mock_mb_pdu_rx_calls, 0u);
 }
 
+TEST_F (MbusTest, MbusMaskWriteHoldingRegister)
+{
+   int error;
+   uint8_t expected[253] = {0x16, 0x00, 0x04, 0xF0, 0xF2, 0x00, 0x25};
+   uint8_t response[]    = {0x16, 0x00, 0x04, 0xF0, 0xF2, 0x00, 0x25};
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   error = mbus_mask_write (&mbus, 1, MB_ADDRESS (4, 5), 0xF0F2, 0x0025);
+   EXPECT_EQ (error, 0);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+
+   // Only holding registers
+   error = mbus_mask_write (&mbus, 1, MB_ADDRESS (0, 5), 0xF0F2, 0x0025);
+   EXPECT_EQ (error, -1);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+}
+
+TEST_F (MbusTest, MbusReadWriteHoldingRegisters)
+{
+   uint16_t read_data[2];
+   uint16_t write_data[1] = {0x1234};
+   int error;
+   uint8_t expected[253] =
+      {0x17, 0x00, 0x00, 0x00, 0x02, 0x00, 0x10, 0x00, 0x01, 0x02, 0x12, 0x34};
+   uint8_t response[] = {0x17, 0x04, 0x11, 0x22, 0x33, 0x44};
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   error = mbus_read_write (
+      &mbus,
+      1,
+      MB_ADDRESS (4, 1),
+      2,
+      read_data,
+      MB_ADDRESS (4, 0x11),
+      1,
+      write_data);
+   EXPECT_EQ (error, 0);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_EQ (read_data[0], 0x1122);
+   EXPECT_EQ (read_data[1], 0x3344);
+}
+
+TEST_F (MbusTest, MbusReadWriteShouldValidateArguments)
+{
+   uint16_t d[126] = {0};
+   mb_address_t h  = MB_ADDRESS (4, 1);
+
+   // Only holding registers
+   EXPECT_EQ (mbus_read_write (&mbus, 1, MB_ADDRESS (3, 1), 1, d, h, 1, d), -1);
+   EXPECT_EQ (mbus_read_write (&mbus, 1, h, 1, d, MB_ADDRESS (0, 1), 1, d), -1);
+
+   // Max quantities exceeded
+   EXPECT_EQ (mbus_read_write (&mbus, 1, h, 126, d, h, 1, d), -1);
+   EXPECT_EQ (mbus_read_write (&mbus, 1, h, 1, d, h, 122, d), -1);
+
+   // No broadcast
+   EXPECT_EQ (mbus_read_write (&mbus, 0, h, 1, d, h, 1, d), -1);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 0u);
+}
+
+TEST_F (MbusTest, MbusWriteRangeShouldSplit)
+{
+   static uint8_t data[250];
+   uint8_t response[]    = {0x0F, 0x07, 0xB0, 0x00, 0x20};
+   uint8_t expected[253] = {0x0F, 0x07, 0xB0, 0x00, 0x20, 0x04};
+
+   for (int i = 0; i < 250; i++)
+   {
+      data[i] = (uint8_t)i;
+   }
+   memcpy (&expected[6], &data[246], 4);
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   // 1968 + 32 coils
+   EXPECT_EQ (mbus_write_range (&mbus, 1, MB_ADDRESS (0, 1), 2000, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+}
+
+TEST_F (MbusTest, MbusRangeShouldValidateRange)
+{
+   uint16_t data[1];
+
+   EXPECT_EQ (mbus_read_range (&mbus, 1, MB_ADDRESS (4, 1), 0, data), -1);
+   EXPECT_EQ (mbus_read_range (&mbus, 1, MB_ADDRESS (4, 2), 65535, data), -1);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 0u);
+}
+
+TEST_F (MbusTest, MbusRangeShouldStopOnError)
+{
+   static uint16_t data[300];
+   uint8_t response[] = {0x83, 0x02};
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   EXPECT_EQ (
+      mbus_read_range (&mbus, 1, MB_ADDRESS (4, 1), 300, data),
+      EILLEGAL_DATA_ADDRESS);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+}
+
 TEST_F (MbusTest, MbusLoopback)
 {
    int error;
@@ -535,3 +666,338 @@ TEST_F (MbusTest, MbusGetMsg)
    EXPECT_EQ (mock_mb_pdu_rx_calls, 1u);
    EXPECT_TRUE (ArraysMatch (data, response));
 }
+
+TEST_F (MbusPipelineTest, MbusSubmitShouldPipelineRequests)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data1[1]    = {0};
+   uint16_t data2[1]    = {0};
+   uint8_t response1[]  = {0x03, 0x02, 0x11, 0x22};
+   uint8_t response2[]  = {0x03, 0x02, 0x33, 0x44};
+   int h1, h2;
+
+   h1 = mbus_read_submit (&mbus, 1, address, 1, data1);
+   h2 = mbus_read_submit (&mbus, 1, address, 1, data2);
+   EXPECT_GE (h1, 0);
+   EXPECT_GE (h2, 0);
+   EXPECT_NE (h1, h2);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 0u);
+
+   // Responses arrive out of order
+   mock_mb_pdu_rx_data   = response2;
+   mock_mb_pdu_rx_size   = sizeof (response2);
+   mock_mb_pdu_rx_result = sizeof (response2);
+   mock_mb_pdu_rx_id     = mbus.pending[h2].id;
+
+   EXPECT_EQ (mbus_wait (&mbus, h2), 0);
+   EXPECT_EQ (data2[0], 0x3344);
+   EXPECT_EQ (data1[0], 0x0000);
+
+   mock_mb_pdu_rx_data   = response1;
+   mock_mb_pdu_rx_size   = sizeof (response1);
+   mock_mb_pdu_rx_result = sizeof (response1);
+   mock_mb_pdu_rx_id     = mbus.pending[h1].id;
+
+   EXPECT_EQ (mbus_wait (&mbus, h1), 0);
+   EXPECT_EQ (data1[0], 0x1122);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 2u);
+}
+
+TEST_F (MbusPipelineTest, MbusSubmitShouldBlockWhenWindowFull)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[5];
+   uint8_t response[] = {0x03, 0x02, 0x11, 0x22};
+   int handle[5];
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   for (int i = 0; i < 4; i++)
+   {
+      handle[i] = mbus_read_submit (&mbus, 1, address, 1, &data[i]);
+   }
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 0u);
+
+   // Oldest request must complete before the fifth is sent
+   mock_mb_pdu_rx_id = mbus.pending[handle[0]].id;
+   handle[4]         = mbus_read_submit (&mbus, 1, address, 1, &data[4]);
+   EXPECT_GE (handle[4], 0);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 1u);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 5u);
+   EXPECT_EQ (mbus_wait (&mbus, handle[0]), 0);
+   EXPECT_EQ (data[0], 0x1122);
+}
+
+TEST_F (MbusPipelineTest, MbusSubmitShouldNotReuseIdsInFlight)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[8]     = {0};
+   int handle[8];
+
+   mock_mb_pdu_rx_fifo = true;
+
+   // Window is full after four requests, each further request waits
+   // for the oldest response
+   for (int i = 0; i < 8; i++)
+   {
+      handle[i] = mbus_read_submit (&mbus, 1, address, 1, &data[i]);
+      EXPECT_GE (handle[i], 0);
+   }
+
+   for (int i = 0; i < 8; i++)
+   {
+      EXPECT_EQ (mbus_wait (&mbus, handle[i]), 0);
+   }
+
+   // Each buffer holds the response to its own request
+   ASSERT_EQ (mock_mb_pdu_tx_num_ids, 8u);
+   for (int i = 0; i < 8; i++)
+   {
+      for (int j = 0; j < i; j++)
+      {
+         EXPECT_NE (mock_mb_pdu_tx_ids[i], mock_mb_pdu_tx_ids[j]);
+      }
+      EXPECT_EQ (data[i], mock_mb_pdu_tx_ids[i] << 8);
+   }
+}
+
+TEST_F (MbusPipelineTest, MbusSubmitShouldRejectShortResponse)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[2]     = {0xAAAA, 0xBBBB};
+   uint8_t response[]   = {0x03, 0x02, 0x11, 0x22};
+   int handle;
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   // One register returned, two requested
+   handle = mbus_read_submit (&mbus, 1, address, 2, data);
+   ASSERT_GE (handle, 0);
+   mock_mb_pdu_rx_id = mbus.pending[handle].id;
+   EXPECT_EQ (mbus_wait (&mbus, handle), -1);
+
+   // Byte count is right, but the data was not received
+   response[1] = 0x04;
+   handle      = mbus_read_submit (&mbus, 1, address, 2, data);
+   ASSERT_GE (handle, 0);
+   mock_mb_pdu_rx_id = mbus.pending[handle].id;
+   EXPECT_EQ (mbus_wait (&mbus, handle), -1);
+   EXPECT_EQ (data[1], 0xBBBB);
+}
+
+TEST_F (MbusPipelineTest, MbusSubmitShouldRejectLongResponse)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[2]     = {0xAAAA, 0xBBBB};
+   uint8_t response[]   = {0x03, 0x04, 0x11, 0x22, 0x33, 0x44};
+   int handle;
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   // Two registers returned, one requested
+   handle = mbus_read_submit (&mbus, 1, address, 1, data);
+   ASSERT_GE (handle, 0);
+   mock_mb_pdu_rx_id = mbus.pending[handle].id;
+   EXPECT_EQ (mbus_wait (&mbus, handle), -1);
+   EXPECT_EQ (data[1], 0xBBBB);
+}
+
+TEST_F (MbusPipelineTest, MbusWaitShouldRejectInvalidHandle)
+{
+   EXPECT_EQ (mbus_wait (&mbus, -1), -1);
+   EXPECT_EQ (mbus_wait (&mbus, MBUS_MAX_PENDING), -1);
+   EXPECT_EQ (mbus_wait (&mbus, 0), -1);
+}
+
+TEST_F (MbusPipelineTest, MbusReadRangeShouldSplitAndReassemble)
+{
+   static uint16_t data[250];
+   uint8_t expected[253] = {0x03, 0x00, 0x7D, 0x00, 0x7D};
+   uint16_t id[2];
+
+   mock_mb_pdu_rx_fifo = true;
+
+   EXPECT_EQ (mbus_read_range (&mbus, 1, MB_ADDRESS (4, 1), 250, data), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+
+   // Each chunk is stored at its own offset
+   id[0] = mock_mb_pdu_tx_ids[0];
+   id[1] = mock_mb_pdu_tx_ids[1];
+   EXPECT_NE (id[0], id[1]);
+   EXPECT_EQ (data[0], id[0] << 8);
+   EXPECT_EQ (data[124], (id[0] << 8) + 124);
+   EXPECT_EQ (data[125], id[1] << 8);
+   EXPECT_EQ (data[249], (id[1] << 8) + 124);
+}
+
+TEST_F (MbusPipelineTest, MbusReadRangeShouldStayInTable)
+{
+   static uint16_t data[250];
+   uint8_t expected[253] = {0x03, 0xFF, 0x82, 0x00, 0x7D};
+
+   mock_mb_pdu_rx_fifo = true;
+
+   // Range ends at the last address of the table
+   EXPECT_EQ (
+      mbus_read_range (&mbus, 1, MB_ADDRESS (4, 0xFFFF - 249), 250, data),
+      0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+   EXPECT_EQ (data[249], (mock_mb_pdu_tx_ids[1] << 8) + 124);
+
+   // Range would continue into the next table
+   EXPECT_EQ (
+      mbus_read_range (&mbus, 1, MB_ADDRESS (3, 0xFFFF - 124), 126, data),
+      -1);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+}
+
+TEST_F (MbusPipelineTest, MbusExecuteBatchShouldRunAllOperations)
+{
+   uint16_t data[6];
+   uint8_t response[] = {0x03, 0x02, 0x11, 0x22};
+   mbus_op_t ops[6];
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   for (int i = 0; i < 6; i++)
+   {
+      ops[i].type     = MBUS_OP_READ;
+      ops[i].slave    = 1;
+      ops[i].address  = MB_ADDRESS (4, 1 + i);
+      ops[i].quantity = 1;
+      ops[i].buffer   = &data[i];
+   }
+
+   EXPECT_EQ (mbus_execute_batch (&mbus, ops, NELEMENTS (ops)), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 6u);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 6u);
+   for (int i = 0; i < 6; i++)
+   {
+      EXPECT_EQ (ops[i].result, 0);
+      EXPECT_EQ (data[i], 0x1122);
+   }
+}
+
+TEST_F (MbusTest, MbusExecuteBatchShouldReportPerItemResults)
+{
+   uint16_t data[2]   = {0x1234, 0x5678};
+   uint8_t response[] = {0x10, 0x00, 0x00, 0x00, 0x02};
+   mbus_op_t ops[] = {
+      {MBUS_OP_WRITE, 1, MB_ADDRESS (4, 1), 2, data, -1},
+      {MBUS_OP_READ, 1, MB_ADDRESS (4, 1), 126, data, 0},
+      {MBUS_OP_WRITE, 1, MB_ADDRESS (4, 3), 2, data, -1},
+   };
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   EXPECT_EQ (mbus_execute_batch (&mbus, ops, NELEMENTS (ops)), 1);
+   EXPECT_EQ (ops[0].result, 0);
+   EXPECT_EQ (ops[1].result, -1);
+   EXPECT_EQ (ops[2].result, 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+   EXPECT_EQ (mbus_cycle_time (&mbus), mbus.cycle_time);
+}
+
+static int async_calls;
+
+extern "C" void async_done (int result, void * arg)
+{
+   async_calls++;
+   *(int *)arg = result;
+}
+
+TEST_F (MbusPipelineTest, MbusReadAsyncShouldCallCallback)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[1]     = {0};
+   uint8_t response[]   = {0x03, 0x02, 0x11, 0x22};
+   int result           = -999;
+   int error;
+
+   async_calls = 0;
+
+   error = mbus_read_async (&mbus, 1, address, 1, data, async_done, &result);
+   EXPECT_EQ (error, 0);
+   EXPECT_EQ (async_calls, 0);
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+   mock_mb_pdu_rx_id     = mbus.transaction.id;
+
+   EXPECT_EQ (mbus_process (&mbus, 10), 0);
+   EXPECT_EQ (async_calls, 1);
+   EXPECT_EQ (result, 0);
+   EXPECT_EQ (data[0], 0x1122);
+
+   // Nothing outstanding
+   EXPECT_EQ (mbus_process (&mbus, 10), 0);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 1u);
+}
+
+TEST_F (MbusPipelineTest, MbusAsyncShouldNotBlockWhenWindowFull)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[5];
+   int result;
+   int error;
+
+   for (int i = 0; i < 4; i++)
+   {
+      error =
+         mbus_read_async (&mbus, 1, address, 1, &data[i], async_done, &result);
+      EXPECT_EQ (error, 0);
+   }
+
+   error = mbus_read_async (&mbus, 1, address, 1, &data[4], async_done, &result);
+   EXPECT_EQ (error, EWINDOW_FULL);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 4u);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 0u);
+}
+
+TEST_F (MbusPipelineTest, MbusProcessShouldKeepRequestOnCallerTimeout)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   uint16_t data[1];
+   int result = -999;
+
+   async_calls = 0;
+
+   mbus_read_async (&mbus, 1, address, 1, data, async_done, &result);
+
+   mock_mb_pdu_rx_data   = NULL;
+   mock_mb_pdu_rx_size   = 0;
+   mock_mb_pdu_rx_result = ETIMEOUT;
+
+   EXPECT_EQ (mbus_process (&mbus, 1), 1);
+   EXPECT_EQ (async_calls, 0);
+}
+
+TEST_F (MbusPipelineTest, MbusWriteSingleAsyncBroadcastShouldComplete)
+{
+   mb_address_t address = MB_ADDRESS (4, 0x0001);
+   int result           = -999;
+   int error;
+
+   async_calls = 0;
+
+   error =
+      mbus_write_single_async (&mbus, 0, address, 0x1234, async_done, &result);
+   EXPECT_EQ (error, 0);
+   EXPECT_EQ (async_calls, 1);
+   EXPECT_EQ (result, 0);
+   EXPECT_EQ (mock_mb_pdu_rx_calls, 0u);
+}
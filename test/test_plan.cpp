@@ -0,0 +1,185 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_plan.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "mocks.h"
+#include "test_util.h"
+
+// Test fixture
+
+class MbusPlanTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      TestBase::SetUp();
+      transport.has_txn_id = false;
+      mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+   }
+
+   mbus_cfg_t mbus_cfg = {
+      .timeout = 1000,
+      .window = 1,
+   };
+   mbus_t mbus;
+   uint8_t scratch[MAX_PDU_SIZE];
+   mb_transport_t transport;
+   mbus_plan_cfg_t plan_cfg = {
+      .request_cost = 8,
+   };
+};
+
+// Tests
+
+TEST_F (MbusPlanTest, MbusPlanShouldMergeCheapGaps)
+{
+   uint16_t data[4];
+   mbus_tag_t tags[] = {
+      {MB_ADDRESS (4, 100), 1, &data[0], 0},
+      {MB_ADDRESS (0, 5), 3, &data[1], 0},
+      {MB_ADDRESS (4, 3), 2, &data[2], 0},
+      {MB_ADDRESS (4, 1), 1, &data[3], 0},
+   };
+   mbus_plan_t * plan;
+
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+
+   // Coils 5-7, registers 1-4 and register 100
+   EXPECT_EQ (mbus_plan_num_requests (plan), 3u);
+   mbus_plan_destroy (plan);
+
+   // Never read unused registers
+   plan_cfg.request_cost = 0;
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+   EXPECT_EQ (mbus_plan_num_requests (plan), 4u);
+   mbus_plan_destroy (plan);
+}
+
+TEST_F (MbusPlanTest, MbusPlanShouldRespectMaxQuantity)
+{
+   uint16_t data[200];
+   mbus_tag_t tags[] = {
+      {MB_ADDRESS (3, 1), 100, &data[0], 0},
+      {MB_ADDRESS (3, 101), 100, &data[100], 0},
+   };
+   mbus_plan_t * plan;
+
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+   EXPECT_EQ (mbus_plan_num_requests (plan), 2u);
+   mbus_plan_destroy (plan);
+}
+
+TEST_F (MbusPlanTest, MbusPlanShouldRejectInvalidTags)
+{
+   uint16_t data[126];
+   mbus_tag_t too_long[] = {
+      {MB_ADDRESS (4, 1), 126, data, 0},
+   };
+   mbus_tag_t bad_table[] = {
+      {MB_ADDRESS (2, 1), 1, data, 0},
+   };
+
+   EXPECT_TRUE (mbus_plan_create (&plan_cfg, too_long, 1) == NULL);
+   EXPECT_TRUE (mbus_plan_create (&plan_cfg, bad_table, 1) == NULL);
+}
+
+TEST_F (MbusPlanTest, MbusPlanShouldScatterRegisters)
+{
+   uint16_t value1;
+   uint16_t value2[2];
+   uint8_t expected[253] = {0x03, 0x00, 0x00, 0x00, 0x04};
+   uint8_t response[]    = {0x03, 0x08, 0x11, 0x22, 0x33, 0x44,
+                            0x55, 0x66, 0x77, 0x88};
+   mbus_tag_t tags[] = {
+      {MB_ADDRESS (4, 3), 2, value2, -1},
+      {MB_ADDRESS (4, 1), 1, &value1, -1},
+   };
+   mbus_plan_t * plan;
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+
+   EXPECT_EQ (mbus_plan_execute (&mbus, 1, plan), 0);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 1u);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+   EXPECT_EQ (tags[0].result, 0);
+   EXPECT_EQ (tags[1].result, 0);
+   EXPECT_EQ (value1, 0x1122);
+   EXPECT_EQ (value2[0], 0x5566);
+   EXPECT_EQ (value2[1], 0x7788);
+
+   mbus_plan_destroy (plan);
+}
+
+TEST_F (MbusPlanTest, MbusPlanShouldScatterBits)
+{
+   uint8_t value1;
+   uint8_t value2;
+   uint8_t expected[253] = {0x01, 0x00, 0x00, 0x00, 0x06};
+   uint8_t response[]    = {0x01, 0x01, 0x2D};
+   mbus_tag_t tags[] = {
+      {MB_ADDRESS (0, 1), 2, &value1, -1},
+      {MB_ADDRESS (0, 4), 3, &value2, -1},
+   };
+   mbus_plan_t * plan;
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+
+   EXPECT_EQ (mbus_plan_execute (&mbus, 1, plan), 0);
+   EXPECT_TRUE (ArraysMatch (expected, mock_mb_pdu_tx_data));
+   EXPECT_EQ (value1, 0x01);
+   EXPECT_EQ (value2, 0x05);
+
+   mbus_plan_destroy (plan);
+}
+
+TEST_F (MbusPlanTest, MbusPlanShouldReportErrorPerTag)
+{
+   uint16_t value;
+   uint8_t response[] = {0x83, 0x02};
+   mbus_tag_t tags[]  = {
+      {MB_ADDRESS (4, 1), 1, &value, 0},
+   };
+   mbus_plan_t * plan;
+
+   mock_mb_pdu_rx_data   = response;
+   mock_mb_pdu_rx_size   = sizeof (response);
+   mock_mb_pdu_rx_result = sizeof (response);
+
+   plan = mbus_plan_create (&plan_cfg, tags, NELEMENTS (tags));
+   ASSERT_TRUE (plan != NULL);
+
+   EXPECT_EQ (mbus_plan_execute (&mbus, 1, plan), EILLEGAL_DATA_ADDRESS);
+   EXPECT_EQ (tags[0].result, EILLEGAL_DATA_ADDRESS);
+
+   mbus_plan_destroy (plan);
+}
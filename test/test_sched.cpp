@@ -0,0 +1,118 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mbus_sched.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "mocks.h"
+#include "test_util.h"
+
+// Test fixture
+
+class MbusSchedTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      TestBase::SetUp();
+      transport.has_txn_id = false;
+      mbus_init (&mbus, &mbus_cfg, &transport, scratch);
+
+      mock_mb_pdu_rx_data   = response;
+      mock_mb_pdu_rx_size   = sizeof (response);
+      mock_mb_pdu_rx_result = sizeof (response);
+   }
+
+   mbus_cfg_t mbus_cfg = {
+      .timeout = 1000,
+      .window = 1,
+   };
+   mbus_t mbus;
+   uint8_t scratch[MAX_PDU_SIZE];
+   mb_transport_t transport;
+   uint8_t response[4] = {0x03, 0x02, 0x11, 0x22};
+   uint16_t data[3];
+   mbus_sched_t sched;
+};
+
+// Tests
+
+TEST_F (MbusSchedTest, MbusSchedShouldRunEarliestDeadlineFirst)
+{
+   mbus_poll_t polls[] = {
+      {1, MB_ADDRESS (4, 1), 1, &data[0], 1000, 0, NULL, NULL, 0, 0, false},
+      {1, MB_ADDRESS (4, 2), 1, &data[1], 100, 0, NULL, NULL, 0, 0, false},
+      {1, MB_ADDRESS (4, 3), 1, &data[2], 1000, 1, NULL, NULL, 0, 0, false},
+   };
+
+   mbus_sched_init (&sched, &mbus, polls, NELEMENTS (polls));
+
+   // Shortest period first
+   EXPECT_EQ (mbus_sched_run_once (&sched), 0u);
+   EXPECT_EQ (mock_mb_pdu_tx_data[2], 0x01);
+
+   // Equal deadlines, highest priority first
+   EXPECT_EQ (mbus_sched_run_once (&sched), 0u);
+   EXPECT_EQ (mock_mb_pdu_tx_data[2], 0x02);
+
+   EXPECT_EQ (mbus_sched_run_once (&sched), 0u);
+   EXPECT_EQ (mock_mb_pdu_tx_data[2], 0x00);
+
+   // Nothing due until the shortest period has elapsed
+   uint32_t delay = mbus_sched_run_once (&sched);
+   EXPECT_GT (delay, 0u);
+   EXPECT_LE (delay, 100u * 1000);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 3u);
+
+   EXPECT_EQ (data[0], 0x1122);
+   EXPECT_EQ (polls[0].missed, 0u);
+   EXPECT_FALSE (polls[0].late);
+}
+
+TEST_F (MbusSchedTest, MbusSchedShouldReportMissedDeadlines)
+{
+   mbus_poll_t polls[] = {
+      {1, MB_ADDRESS (4, 1), 1, &data[0], 40, 0, NULL, NULL, 0, 0, false},
+   };
+
+   mbus_sched_init (&sched, &mbus, polls, NELEMENTS (polls));
+
+   // Pretend the poll was released 100 ms ago
+   polls[0].release -= 100 * 1000;
+
+   EXPECT_EQ (mbus_sched_run_once (&sched), 0u);
+   EXPECT_TRUE (polls[0].late);
+   EXPECT_EQ (polls[0].missed, 2u);
+
+   // The current period is due immediately
+   EXPECT_EQ (mbus_sched_run_once (&sched), 0u);
+   EXPECT_FALSE (polls[0].late);
+   EXPECT_EQ (polls[0].missed, 2u);
+
+   // The next period has not started yet
+   EXPECT_GT (mbus_sched_run_once (&sched), 0u);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 2u);
+}
+
+TEST_F (MbusSchedTest, MbusSchedShouldReportIdleWithoutPolls)
+{
+   mbus_sched_init (&sched, &mbus, NULL, 0);
+
+   EXPECT_EQ (mbus_sched_run_once (&sched), (uint32_t)MBUS_SCHED_IDLE);
+   EXPECT_EQ (mock_mb_pdu_tx_calls, 0u);
+}
@@ -14,6 +14,7 @@
  ********************************************************************/
 
 #include "mb_slave.h"
+#include "mb_slave_internal.h"
 
 #include "options.h"
 #include "osal.h"
@@ -22,6 +23,9 @@
 #include "mocks.h"
 #include "test_util.h"
 
+#include <atomic>
+#include <thread>
+
 using namespace std;
 using namespace testing;
 
@@ -132,19 +136,71 @@ extern "C" const mb_vendor_func_t vendor_funcs[] = {
 };
 
 extern "C" const mb_iomap_t slave_iomap = {
-   .coils = {16, coil_get, coil_set},            // 16 coils
-   .inputs = {2, input_get, NULL},               // 2 input status bits
-   .holding_registers = {4, hold_get, hold_set}, // 4 holding registers
-   .input_registers = {5, reg_get, NULL},        // 5 input registers
+   .coils = {16, coil_get, coil_set, NULL, NULL, 0, NULL}, // 16 coils
+   .inputs = {2, input_get, NULL, NULL, NULL, 0, NULL},    // 2 input status bits
+   .holding_registers = {4, hold_get, hold_set, NULL, NULL, 0, NULL}, // 4 holding
+   .input_registers = {5, reg_get, NULL, NULL, NULL, 0, NULL}, // 5 input registers
    .num_vendor_funcs = NELEMENTS (vendor_funcs), // 1 vendor function
    .vendor_funcs = vendor_funcs,
 };
 
+// Same tables, with coils and holding registers served from memory
+extern "C" const mb_iomap_t slave_image_iomap = {
+   .coils = {16, NULL, NULL, coils, NULL, 0, NULL},
+   .inputs = {2, input_get, NULL, NULL, NULL, 0, NULL},
+   .holding_registers = {4, NULL, NULL, hold, NULL, 0, NULL},
+   .input_registers = {5, reg_get, NULL, NULL, NULL, 0, NULL},
+   .num_vendor_funcs = NELEMENTS (vendor_funcs),
+   .vendor_funcs = vendor_funcs,
+};
+
+// Holding registers protected by a sequence lock
+mb_seqlock_t hold_lock;
+
+extern "C" const mb_iomap_t slave_locked_iomap = {
+   .coils = {16, NULL, NULL, coils, NULL, 0, NULL},
+   .inputs = {2, input_get, NULL, NULL, NULL, 0, NULL},
+   .holding_registers = {4, NULL, NULL, hold, &hold_lock, 0, NULL},
+   .input_registers = {5, reg_get, NULL, NULL, NULL, 0, NULL},
+   .num_vendor_funcs = NELEMENTS (vendor_funcs),
+   .vendor_funcs = vendor_funcs,
+};
+
+// Holding registers in two segments, at 0 and 30000
+uint16_t hold_high[2];
+
+extern "C" const mb_iosegment_t hold_segments[] = {
+   {0, {4, NULL, NULL, hold, NULL, 0, NULL}},
+   {30000, {2, NULL, NULL, hold_high, NULL, 0, NULL}},
+};
+
+extern "C" const mb_iomap_t slave_segmented_iomap = {
+   .coils = {16, NULL, NULL, coils, NULL, 0, NULL},
+   .inputs = {2, input_get, NULL, NULL, NULL, 0, NULL},
+   .holding_registers =
+      {0, NULL, NULL, NULL, NULL, NELEMENTS (hold_segments), hold_segments},
+   .input_registers = {5, reg_get, NULL, NULL, NULL, 0, NULL},
+   .num_vendor_funcs = NELEMENTS (vendor_funcs),
+   .vendor_funcs = vendor_funcs,
+};
+
+// Unit with input registers only
+extern "C" const mb_iomap_t slave_unit_iomap = {
+   .coils = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .inputs = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .holding_registers = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .input_registers = {5, reg_get, NULL, NULL, NULL, 0, NULL},
+   .num_vendor_funcs = 0,
+   .vendor_funcs = NULL,
+};
+
 extern "C" const mb_slave_cfg_t slave_cfg = {
    .id = 2, // Slave ID: 2
    .priority = 15,
    .stack_size = 2048,
    .iomap = &slave_iomap,
+   .num_units = 0,
+   .units = NULL,
 };
 
 class MbSlaveTest : public TestBase
@@ -154,7 +210,8 @@ class MbSlaveTest : public TestBase
    {
       TestBase::SetUp();
 
-      slave.iomap = &slave_iomap;
+      memset (&slave, 0, sizeof (slave));
+      mb_slave_iomap_set (&slave, &slave_iomap);
       slave.transport = NULL;
       slave.id = 2;
       slave.running = 1;
@@ -344,6 +401,20 @@ INSTANTIATE_TEST_SUITE_P (
          vector<uint8_t>{},
          vector<uint16_t>{0x1234, 0x1122, 0x3344, 0xAA55}
       ),
+      // Mask write holding register 1
+      make_tuple (
+         vector<uint8_t>{0x16, 0x00, 0x01, 0xF0, 0xF2, 0x00, 0x25},
+         vector<uint8_t>{0x16, 0x00, 0x01, 0xF0, 0xF2, 0x00, 0x25},
+         vector<uint8_t>{},
+         vector<uint16_t>{0x1234, 0x5075, 0x55AA, 0xAA55}
+      ),
+      // Mask write address error
+      make_tuple (
+         vector<uint8_t>{0x16, 0x00, 0x04, 0xF0, 0xF2, 0x00, 0x25},
+         vector<uint8_t>{0x96, 0x02},
+         vector<uint8_t>{},
+         vector<uint16_t>{0x1234, 0x5678, 0x55AA, 0xAA55}
+      ),
       // ReadWrite 2 holding registers
       make_tuple (
          vector<uint8_t>{0x17, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01, 0x00, 0x01, 0x02, 0x11, 0x22},
@@ -354,3 +425,303 @@ INSTANTIATE_TEST_SUITE_P (
    )
 );
 // clang-format on
+
+TEST_F (MbSlaveTest, MbSlaveImageShouldMatchCallbacks)
+{
+   // clang-format off
+   const vector<vector<uint8_t>> requests = {
+      {0x01, 0x00, 0x03, 0x00, 0x0A},                         // Read coils
+      {0x01, 0x00, 0x00, 0x00, 0x10},                         // Read all coils
+      {0x05, 0x00, 0x0E, 0xFF, 0x00},                         // Write coil
+      {0x0F, 0x00, 0x05, 0x00, 0x09, 0x02, 0x5A, 0x01},       // Write coils
+      {0x0F, 0x00, 0x08, 0x00, 0x03, 0x01, 0x05},             // Write coils
+      {0x03, 0x00, 0x01, 0x00, 0x03},                         // Read registers
+      {0x06, 0x00, 0x02, 0xBE, 0xEF},                         // Write register
+      {0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x01, 0x02, 0x03, 0x04},
+      {0x16, 0x00, 0x03, 0xF0, 0xF0, 0x0A, 0x0A},             // Mask write
+      {0x17, 0x00, 0x00, 0x00, 0x04, 0x00, 0x03, 0x00, 0x01, 0x02, 0xCA, 0xFE},
+   };
+   // clang-format on
+
+   for (const vector<uint8_t> & request : requests)
+   {
+      vector<uint8_t> expected_tx;
+      vector<uint8_t> expected_coils;
+      vector<uint16_t> expected_hold;
+
+      for (int pass = 0; pass < 2; pass++)
+      {
+         coils[0] = 0xA5;
+         coils[1] = 0x3C;
+         hold[0] = 0x1234;
+         hold[1] = 0x5678;
+         hold[2] = 0x55AA;
+         hold[3] = 0xAA55;
+
+         mb_slave_iomap_set (
+            &slave,
+            (pass == 0) ? &slave_iomap : &slave_image_iomap);
+
+         mock_mb_pdu_rx_data = &request[0];
+         mock_mb_pdu_rx_size = request.size();
+         mock_mb_pdu_rx_result = (int)request.size();
+
+         mb_slave_handle_request (&slave, &transaction);
+
+         vector<uint8_t> tx_data (
+            mock_mb_pdu_tx_data,
+            mock_mb_pdu_tx_data + mock_mb_pdu_tx_size);
+         vector<uint8_t> vect_coils (coils, coils + NELEMENTS (coils));
+         vector<uint16_t> vect_hold (hold, hold + NELEMENTS (hold));
+
+         if (pass == 0)
+         {
+            expected_tx = tx_data;
+            expected_coils = vect_coils;
+            expected_hold = vect_hold;
+         }
+         else
+         {
+            EXPECT_PRED_FORMAT2 (VectorsMatch, tx_data, expected_tx);
+            EXPECT_PRED_FORMAT2 (VectorsMatch, vect_coils, expected_coils);
+            EXPECT_PRED_FORMAT2 (VectorsMatch, vect_hold, expected_hold);
+         }
+      }
+   }
+}
+
+TEST_F (MbSlaveTest, MbSlaveSeqlockShouldNotTearRegisters)
+{
+   const vector<uint8_t> request = {0x03, 0x00, 0x00, 0x00, 0x02};
+   std::atomic<bool> done (false);
+   int torn = 0;
+
+   std::atomic<int> writes (0);
+
+   mb_seqlock_init (&hold_lock);
+   mb_slave_iomap_set (&slave, &slave_locked_iomap);
+   hold[0] = 0x0000;
+   hold[1] = 0xFFFF;
+
+   // Application thread updates a 32-bit value in two registers
+   std::thread writer ([&done, &writes] {
+      for (uint16_t i = 0; !done; i++)
+      {
+         mb_seqlock_write_begin (&hold_lock);
+         hold[0] = i;
+         hold[1] = ~i;
+         mb_seqlock_write_end (&hold_lock);
+         writes++;
+      }
+   });
+
+   while (writes == 0)
+      ;
+
+   for (int i = 0; i < 10000; i++)
+   {
+      mock_mb_pdu_rx_data = &request[0];
+      mock_mb_pdu_rx_size = request.size();
+      mock_mb_pdu_rx_result = (int)request.size();
+
+      mb_slave_handle_request (&slave, &transaction);
+
+      uint16_t high = (mock_mb_pdu_tx_data[2] << 8) | mock_mb_pdu_tx_data[3];
+      uint16_t low = (mock_mb_pdu_tx_data[4] << 8) | mock_mb_pdu_tx_data[5];
+      if (low != (uint16_t)~high)
+         torn++;
+   }
+
+   done = true;
+   writer.join();
+
+   EXPECT_EQ (torn, 0);
+}
+
+TEST_F (MbSlaveTest, MbSlaveShouldDispatchAndCountFunctions)
+{
+   const vector<vector<uint8_t>> requests = {
+      {0x65, 0x01, 0x02},             // Vendor function
+      {0x42, 0x00},                   // Unsupported function
+      {0x03, 0x00, 0x00, 0x00, 0x01}, // Read holding register
+      {0x03, 0x00, 0x00, 0x00, 0x01}, // Read holding register
+   };
+   const vector<vector<uint8_t>> expected = {
+      {0xE5, 0x81, 0x82},
+      {0xC2, 0x01},
+      {0x03, 0x02, 0x12, 0x34},
+      {0x03, 0x02, 0x12, 0x34},
+   };
+
+   for (size_t i = 0; i < requests.size(); i++)
+   {
+      mock_mb_pdu_rx_data = &requests[i][0];
+      mock_mb_pdu_rx_size = requests[i].size();
+      mock_mb_pdu_rx_result = (int)requests[i].size();
+
+      mb_slave_handle_request (&slave, &transaction);
+
+      vector<uint8_t> tx_data (
+         mock_mb_pdu_tx_data,
+         mock_mb_pdu_tx_data + mock_mb_pdu_tx_size);
+      EXPECT_PRED_FORMAT2 (VectorsMatch, tx_data, expected[i]);
+   }
+
+   EXPECT_EQ (mb_slave_request_count (&slave, 0x65), 1u);
+   EXPECT_EQ (mb_slave_request_count (&slave, 0x42), 1u);
+   EXPECT_EQ (mb_slave_request_count (&slave, 0x03), 2u);
+   EXPECT_EQ (mb_slave_request_count (&slave, 0x04), 0u);
+}
+
+TEST_F (MbSlaveTest, MbSlaveShouldRouteRequestsByUnit)
+{
+   const mb_slave_unit_t units[] = {
+      {3, &slave_unit_iomap},
+      {7, &slave_image_iomap},
+   };
+   const vector<uint8_t> request = {0x03, 0x00, 0x00, 0x00, 0x01};
+   const vector<uint8_t> expected_slave = {0x03, 0x02, 0x12, 0x34};
+   const vector<uint8_t> expected_unit = {0x83, 0x02};
+
+   ASSERT_EQ (mb_slave_units_set (&slave, units, NELEMENTS (units)), 0);
+
+   const struct
+   {
+      uint8_t unit;
+      unsigned int calls;
+      const vector<uint8_t> * expected;
+   } cases[] = {
+      {2, 1, &expected_slave}, // Slave ID, slave iomap
+      {3, 1, &expected_unit},  // No holding registers in unit 3
+      {7, 1, &expected_slave}, // Image of the same registers
+      {4, 0, NULL},            // Not served, no response
+   };
+
+   for (const auto & c : cases)
+   {
+      mock_mb_pdu_rx_data = &request[0];
+      mock_mb_pdu_rx_size = request.size();
+      mock_mb_pdu_rx_result = (int)request.size();
+      mock_mb_pdu_tx_calls = 0;
+
+      transaction.unit = c.unit;
+      mb_slave_handle_request (&slave, &transaction);
+
+      EXPECT_EQ (mock_mb_pdu_tx_calls, c.calls);
+      if (c.expected != NULL)
+      {
+         vector<uint8_t> tx_data (
+            mock_mb_pdu_tx_data,
+            mock_mb_pdu_tx_data + mock_mb_pdu_tx_size);
+         EXPECT_PRED_FORMAT2 (VectorsMatch, tx_data, *c.expected);
+      }
+   }
+
+   // Unit ID 0 is reserved for broadcasts
+   const mb_slave_unit_t broadcast[] = {{0, &slave_unit_iomap}};
+   EXPECT_EQ (mb_slave_units_set (&slave, broadcast, 1), -1);
+
+   EXPECT_EQ (mb_slave_units_set (&slave, NULL, 0), 0);
+}
+
+TEST_F (MbSlaveTest, MbSlaveShouldServeSegmentedTables)
+{
+   // clang-format off
+   const vector<vector<uint8_t>> requests = {
+      {0x03, 0x00, 0x02, 0x00, 0x02},                   // Read segment 0
+      {0x03, 0x75, 0x30, 0x00, 0x02},                   // Read segment 1
+      {0x03, 0x00, 0x03, 0x00, 0x02},                   // Past segment 0
+      {0x03, 0x75, 0x2F, 0x00, 0x01},                   // Before segment 1
+      {0x03, 0x75, 0x31, 0x00, 0x02},                   // Past segment 1
+      {0x06, 0x75, 0x31, 0xBE, 0xEF},                   // Write segment 1
+      {0x06, 0x00, 0x10, 0xBE, 0xEF},                   // Write in gap
+      {0x17, 0x00, 0x00, 0x00, 0x01, 0x75, 0x30, 0x00, 0x01, 0x02, 0xCA, 0xFE},
+   };
+   const vector<vector<uint8_t>> expected = {
+      {0x03, 0x04, 0x55, 0xAA, 0xAA, 0x55},
+      {0x03, 0x04, 0x11, 0x11, 0x22, 0x22},
+      {0x83, 0x02},
+      {0x83, 0x02},
+      {0x83, 0x02},
+      {0x06, 0x75, 0x31, 0xBE, 0xEF},
+      {0x86, 0x02},
+      {0x17, 0x02, 0x12, 0x34},
+   };
+   // clang-format on
+
+   mb_slave_iomap_set (&slave, &slave_segmented_iomap);
+   hold_high[0] = 0x1111;
+   hold_high[1] = 0x2222;
+
+   for (size_t i = 0; i < requests.size(); i++)
+   {
+      mock_mb_pdu_rx_data = &requests[i][0];
+      mock_mb_pdu_rx_size = requests[i].size();
+      mock_mb_pdu_rx_result = (int)requests[i].size();
+
+      mb_slave_handle_request (&slave, &transaction);
+
+      vector<uint8_t> tx_data (
+         mock_mb_pdu_tx_data,
+         mock_mb_pdu_tx_data + mock_mb_pdu_tx_size);
+      EXPECT_PRED_FORMAT2 (VectorsMatch, tx_data, expected[i]);
+   }
+
+   EXPECT_EQ (hold_high[0], 0xCAFE);
+   EXPECT_EQ (hold_high[1], 0xBEEF);
+}
+
+TEST_F (MbSlaveTest, MbSlaveShouldReturnDiagnosticCounters)
+{
+   // clang-format off
+   const vector<vector<uint8_t>> requests = {
+      {0x08, 0x00, 0x0B, 0x00, 0x00},         // Bus messages
+      {0x03, 0x00, 0x10, 0x00, 0x01},         // Exception
+      {0x08, 0x00, 0x0D, 0x00, 0x00},         // Exceptions
+      {0x08, 0x00, 0x0E, 0x00, 0x00},         // Slave messages
+      {0x08, 0x00, 0x0A, 0x00, 0x00},         // Clear counters
+      {0x08, 0x00, 0x0E, 0x00, 0x00},         // Slave messages
+      {0x08, 0x00, 0x12, 0x00, 0x00},         // Overruns
+      {0x08, 0x00, 0x0B, 0x00, 0x01},         // Invalid data
+      {0x08, 0x00, 0x13, 0x00, 0x00},         // Unsupported
+   };
+   const vector<vector<uint8_t>> expected = {
+      {0x08, 0x00, 0x0B, 0x23, 0x45},
+      {0x83, 0x02},
+      {0x08, 0x00, 0x0D, 0x00, 0x01},
+      {0x08, 0x00, 0x0E, 0x00, 0x04},
+      {0x08, 0x00, 0x0A, 0x00, 0x00},
+      {0x08, 0x00, 0x0E, 0x00, 0x01},
+      {0x08, 0x00, 0x12, 0x00, 0x00},
+      {0x88, 0x03},
+      {0x88, 0x01},
+   };
+   // clang-format on
+   mb_diag_t diag;
+
+   memset (&diag, 0, sizeof (diag));
+   diag.counter[MB_DIAG_BUS_MESSAGES] = 0x12345;
+   diag.counter[MB_DIAG_OVERRUNS] = 7;
+   slave.diag = &diag;
+
+   for (size_t i = 0; i < requests.size(); i++)
+   {
+      mock_mb_pdu_rx_data = &requests[i][0];
+      mock_mb_pdu_rx_size = requests[i].size();
+      mock_mb_pdu_rx_result = (int)requests[i].size();
+
+      mb_slave_handle_request (&slave, &transaction);
+
+      vector<uint8_t> tx_data (
+         mock_mb_pdu_tx_data,
+         mock_mb_pdu_tx_data + mock_mb_pdu_tx_size);
+      EXPECT_PRED_FORMAT2 (VectorsMatch, tx_data, expected[i]);
+   }
+
+   EXPECT_EQ (mb_slave_diag_get (&slave, MB_DIAG_SLAVE_MESSAGES), 4u);
+   EXPECT_EQ (mb_slave_diag_get (&slave, MB_DIAG_EXCEPTIONS), 2u);
+   EXPECT_EQ (mb_slave_diag_get (&slave, MB_DIAG_BUS_MESSAGES), 0u);
+
+   mb_slave_diag_clear (&slave);
+   EXPECT_EQ (mb_slave_diag_get (&slave, MB_DIAG_SLAVE_MESSAGES), 0u);
+}
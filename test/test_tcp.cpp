@@ -0,0 +1,161 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_tcp.h"
+#include "mb_pdu.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "test_util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Test fixture
+
+class TcpTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof (addr);
+      mb_tcp_cfg_t cfg;
+
+      TestBase::SetUp();
+
+      // Listen on an ephemeral loopback port
+      listener = socket (AF_INET, SOCK_STREAM, 0);
+      ASSERT_GE (listener, 0);
+
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family      = AF_INET;
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      addr.sin_port        = 0;
+      ASSERT_EQ (bind (listener, (struct sockaddr *)&addr, sizeof (addr)), 0);
+      ASSERT_EQ (listen (listener, 8), 0);
+      getsockname (listener, (struct sockaddr *)&addr, &len);
+
+      cfg.port  = ntohs (addr.sin_port);
+      transport = mb_tcp_init (&cfg);
+      ASSERT_TRUE (transport != NULL);
+      transport->is_server = false;
+   }
+
+   virtual void TearDown()
+   {
+      close (listener);
+   }
+
+   // Connect the transport, return the transport and slave sockets
+   void Connect (int * peer, int * slave)
+   {
+      *peer  = transport->bringup (transport, "127.0.0.1");
+      *slave = accept (listener, NULL, NULL);
+   }
+
+   int Receive (int peer, uint8_t * pdu)
+   {
+      pdu_txn_t transaction;
+
+      memset (&transaction, 0, sizeof (transaction));
+      transaction.arg  = peer;
+      transaction.data = pdu;
+      return transport->rx (transport, &transaction, 100);
+   }
+
+   int listener;
+   mb_transport_t * transport;
+};
+
+// Responses to a read of one holding register, from two slaves
+static const uint8_t response_a[] =
+   {0x00, 0x01, 0x00, 0x00, 0x00, 0x05, 0x0A, 0x03, 0x02, 0x12, 0x34};
+static const uint8_t response_b[] =
+   {0x00, 0x02, 0x00, 0x00, 0x00, 0x05, 0x0B, 0x03, 0x02, 0x56, 0x78};
+
+// Tests
+
+TEST_F (TcpTest, TcpShouldKeepStatePerPeer)
+{
+   uint8_t pdu[MAX_PDU_SIZE];
+   int peer_a;
+   int peer_b;
+   int slave_a;
+   int slave_b;
+
+   Connect (&peer_a, &slave_a);
+   Connect (&peer_b, &slave_b);
+   ASSERT_GT (peer_a, 0);
+   ASSERT_GT (peer_b, 0);
+   ASSERT_GE (slave_a, 0);
+   ASSERT_GE (slave_b, 0);
+
+   // First slave sends the start of its response
+   EXPECT_EQ (send (slave_a, response_a, 4, 0), 4);
+   EXPECT_EQ (send (slave_b, response_b, sizeof (response_b), 0), 11);
+
+   // Framing of the second peer is not disturbed by the first
+   EXPECT_EQ (Receive (peer_b, pdu), 4);
+   EXPECT_EQ (pdu[2], 0x56);
+
+   EXPECT_EQ (send (slave_a, response_a + 4, 7, 0), 7);
+   EXPECT_EQ (Receive (peer_a, pdu), 4);
+   EXPECT_EQ (pdu[2], 0x12);
+
+   // Losing one peer does not bring the transport down
+   close (slave_a);
+   EXPECT_EQ (Receive (peer_a, pdu), EFRAME_NOK);
+   EXPECT_FALSE (transport->is_down (transport));
+
+   EXPECT_EQ (send (slave_b, response_b, sizeof (response_b), 0), 11);
+   EXPECT_EQ (Receive (peer_b, pdu), 4);
+   EXPECT_EQ (pdu[3], 0x78);
+
+   transport->shutdown (transport, peer_b);
+   EXPECT_TRUE (transport->is_down (transport));
+   close (slave_b);
+}
+
+TEST_F (TcpTest, TcpShouldCloseSharedPeerWhenReleased)
+{
+   uint8_t pdu[MAX_PDU_SIZE];
+   uint8_t byte;
+   int result = 0;
+   int peer;
+   int slave;
+
+   Connect (&peer, &slave);
+   ASSERT_GT (peer, 0);
+   ASSERT_GE (slave, 0);
+
+   // Shut down the peer while another task waits for a response
+   std::thread task ([&] { result = Receive (peer, pdu); });
+   os_usleep (20 * 1000);
+   transport->shutdown (transport, peer);
+   EXPECT_TRUE (transport->is_down (transport));
+
+   // Connection remains open until the waiting task is done
+   EXPECT_EQ (recv (slave, &byte, 1, MSG_DONTWAIT), -1);
+   task.join();
+   EXPECT_EQ (result, ETIMEOUT);
+   EXPECT_EQ (recv (slave, &byte, 1, 0), 0);
+   close (slave);
+}
@@ -0,0 +1,345 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_tcp_pool.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "test_util.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Test fixture
+
+struct completion
+{
+   int calls;
+   int result;
+};
+
+extern "C" void pool_done (int result, void * arg)
+{
+   struct completion * c = (struct completion *)arg;
+
+   c->calls++;
+   c->result = result;
+}
+
+class TcpPoolTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof (addr);
+
+      TestBase::SetUp();
+
+      // Listen on an ephemeral loopback port
+      listener = socket (AF_INET, SOCK_STREAM, 0);
+      ASSERT_GE (listener, 0);
+
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family      = AF_INET;
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      addr.sin_port        = 0;
+      ASSERT_EQ (bind (listener, (struct sockaddr *)&addr, sizeof (addr)), 0);
+      ASSERT_EQ (listen (listener, 8), 0);
+      getsockname (listener, (struct sockaddr *)&addr, &len);
+
+      cfg.port            = ntohs (addr.sin_port);
+      cfg.max_connections = 4;
+      cfg.timeout         = 50;
+      cfg.send_buffer     = 0;
+      pool                = mb_tcp_pool_create (&cfg);
+      ASSERT_TRUE (pool != NULL);
+   }
+
+   virtual void TearDown()
+   {
+      mb_tcp_pool_destroy (pool);
+      if (listener >= 0)
+         close (listener);
+   }
+
+   int Read (
+      int conn,
+      uint8_t unit,
+      uint16_t quantity,
+      void * data,
+      struct completion * c)
+   {
+      return mb_tcp_pool_read (
+         pool,
+         conn,
+         unit,
+         MB_ADDRESS (4, 1),
+         quantity,
+         data,
+         pool_done,
+         c);
+   }
+
+   void Process (struct completion * c)
+   {
+      for (int i = 0; i < 20 && c->calls == 0; i++)
+      {
+         mb_tcp_pool_process (pool, 10);
+      }
+   }
+
+   int listener;
+   mb_tcp_pool_cfg_t cfg;
+   mb_tcp_pool_t * pool;
+};
+
+// Tests
+
+TEST_F (TcpPoolTest, TcpPoolShouldReadFromSlave)
+{
+   struct completion c = {0, 0};
+   uint8_t request[12];
+   uint16_t data[2];
+   int conn;
+   int peer;
+
+   conn = mb_tcp_pool_connect (pool, "127.0.0.1");
+   ASSERT_GE (conn, 0);
+
+   EXPECT_EQ (Read (conn, 7, 2, data, &c), 0);
+
+   // Only one request per connection
+   EXPECT_EQ (Read (conn, 7, 2, data, &c), EWINDOW_FULL);
+
+   peer = accept (listener, NULL, NULL);
+   ASSERT_GE (peer, 0);
+
+   // Request is sent when connected
+   mb_tcp_pool_process (pool, 10);
+   EXPECT_EQ (recv (peer, request, sizeof (request), MSG_WAITALL), 12);
+   EXPECT_EQ (request[6], 7);    // Unit
+   EXPECT_EQ (request[7], 0x03); // Function
+   EXPECT_EQ (request[11], 2);   // Quantity
+
+   // Respond in two segments
+   uint8_t response[] = {
+      request[0], request[1], 0x00, 0x00, 0x00, 0x07, 0x07,
+      0x03,       0x04,       0x11, 0x22, 0x33, 0x44};
+   EXPECT_EQ (send (peer, response, 5, 0), 5);
+   mb_tcp_pool_process (pool, 10);
+   EXPECT_EQ (c.calls, 0);
+   EXPECT_EQ (send (peer, response + 5, sizeof (response) - 5, 0), 8);
+
+   Process (&c);
+   EXPECT_EQ (c.calls, 1);
+   EXPECT_EQ (c.result, 0);
+   EXPECT_EQ (data[0], 0x1122);
+   EXPECT_EQ (data[1], 0x3344);
+   EXPECT_FALSE (mb_tcp_pool_is_down (pool, conn));
+
+   close (peer);
+}
+
+TEST_F (TcpPoolTest, TcpPoolShouldTimeOut)
+{
+   struct completion c = {0, 0};
+   uint16_t data;
+   int conn;
+   int peer;
+
+   conn = mb_tcp_pool_connect (pool, "127.0.0.1");
+   ASSERT_GE (conn, 0);
+   peer = accept (listener, NULL, NULL);
+
+   EXPECT_EQ (Read (conn, 1, 1, &data, &c), 0);
+
+   Process (&c);
+   EXPECT_EQ (c.calls, 1);
+   EXPECT_EQ (c.result, ETIMEOUT);
+   EXPECT_EQ (mb_tcp_pool_process (pool, 0), 0);
+
+   close (peer);
+}
+
+TEST_F (TcpPoolTest, TcpPoolShouldNotSendTimedOutRequest)
+{
+   struct completion c = {0, 0};
+   struct sockaddr_in addr;
+   uint8_t request[12];
+   int option = 1;
+   int filler;
+   int conn;
+   int peer = -1;
+
+   // Listen with a full accept queue, so that connecting stalls
+   close (listener);
+   listener = socket (AF_INET, SOCK_STREAM, 0);
+   ASSERT_GE (listener, 0);
+   setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &option, sizeof (option));
+
+   memset (&addr, 0, sizeof (addr));
+   addr.sin_family      = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   addr.sin_port        = htons (cfg.port);
+   ASSERT_EQ (bind (listener, (struct sockaddr *)&addr, sizeof (addr)), 0);
+   ASSERT_EQ (listen (listener, 0), 0);
+
+   filler = socket (AF_INET, SOCK_STREAM, 0);
+   ASSERT_EQ (connect (filler, (struct sockaddr *)&addr, sizeof (addr)), 0);
+
+   conn = mb_tcp_pool_connect (pool, "127.0.0.1");
+   ASSERT_GE (conn, 0);
+
+   // Write times out before the slave accepts the connection
+   EXPECT_EQ (
+      mb_tcp_pool_write_single (
+         pool,
+         conn,
+         1,
+         MB_ADDRESS (4, 1),
+         0x1234,
+         pool_done,
+         &c),
+      0);
+   Process (&c);
+   EXPECT_EQ (c.calls, 1);
+   EXPECT_EQ (c.result, ETIMEOUT);
+
+   // Make room for the connection, which completes on a SYN retry
+   close (accept (listener, NULL, NULL));
+   close (filler);
+   fcntl (listener, F_SETFL, O_NONBLOCK);
+   for (int i = 0; i < 500 && peer < 0; i++)
+   {
+      mb_tcp_pool_process (pool, 10);
+      peer = accept (listener, NULL, NULL);
+   }
+   ASSERT_GE (peer, 0);
+
+   for (int i = 0; i < 10; i++)
+   {
+      mb_tcp_pool_process (pool, 10);
+   }
+
+   // The timed out write is never sent
+   EXPECT_EQ (recv (peer, request, sizeof (request), MSG_DONTWAIT), -1);
+   EXPECT_FALSE (mb_tcp_pool_is_down (pool, conn));
+   EXPECT_EQ (c.calls, 1);
+
+   close (peer);
+}
+
+TEST_F (TcpPoolTest, TcpPoolShouldFailWhenPeerCloses)
+{
+   struct completion c = {0, 0};
+   uint16_t data;
+   int conn;
+   int peer;
+
+   conn = mb_tcp_pool_connect (pool, "127.0.0.1");
+   ASSERT_GE (conn, 0);
+   peer = accept (listener, NULL, NULL);
+
+   EXPECT_EQ (Read (conn, 1, 1, &data, &c), 0);
+   close (peer);
+
+   Process (&c);
+   EXPECT_EQ (c.calls, 1);
+   EXPECT_EQ (c.result, ECONNECTION);
+   EXPECT_TRUE (mb_tcp_pool_is_down (pool, conn));
+   EXPECT_EQ (Read (conn, 1, 1, &data, &c), ECONNECTION);
+
+   // Handle is reused after close
+   mb_tcp_pool_close (pool, conn);
+   EXPECT_EQ (mb_tcp_pool_connect (pool, "127.0.0.1"), conn);
+}
+
+TEST_F (TcpPoolTest, TcpPoolShouldReconnectAfterPartialSend)
+{
+   uint16_t values[123] = {0};
+   uint8_t drain[100];
+   int rcvbuf      = 1024;
+   int reconnected = -1;
+   int conn;
+   int peer;
+
+   // Slave with a small receive buffer that never reads
+   setsockopt (listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+   cfg.timeout     = 5;
+   cfg.send_buffer = 1024;
+   mb_tcp_pool_destroy (pool);
+   pool = mb_tcp_pool_create (&cfg);
+   ASSERT_TRUE (pool != NULL);
+
+   conn = mb_tcp_pool_connect (pool, "127.0.0.1");
+   ASSERT_GE (conn, 0);
+   peer = accept (listener, NULL, NULL);
+   ASSERT_GE (peer, 0);
+
+   // Fill the socket buffers until a request is only partly sent and
+   // times out. The pool must then connect again.
+   fcntl (listener, F_SETFL, O_NONBLOCK);
+   for (int i = 0; i < 1000 && reconnected < 0; i++)
+   {
+      struct completion c = {0, 0};
+
+      ASSERT_EQ (
+         mb_tcp_pool_write (
+            pool,
+            conn,
+            1,
+            MB_ADDRESS (4, 1),
+            NELEMENTS (values),
+            values,
+            pool_done,
+            &c),
+         0);
+      Process (&c);
+      ASSERT_EQ (c.calls, 1);
+      EXPECT_EQ (c.result, ETIMEOUT);
+
+      mb_tcp_pool_process (pool, 1);
+      reconnected = accept (listener, NULL, NULL);
+
+      // Let a little data through, so that the buffers fill up again
+      recv (peer, drain, sizeof (drain), MSG_DONTWAIT);
+   }
+
+   ASSERT_GE (reconnected, 0);
+   EXPECT_FALSE (mb_tcp_pool_is_down (pool, conn));
+
+   // Next request starts on a frame boundary of the new connection
+   struct completion c = {0, 0};
+   uint8_t request[12];
+   uint16_t data;
+
+   EXPECT_EQ (Read (conn, 7, 1, &data, &c), 0);
+   for (int i = 0; i < 5; i++)
+   {
+      mb_tcp_pool_process (pool, 1);
+   }
+   EXPECT_EQ (recv (reconnected, request, sizeof (request), 0), 12);
+   EXPECT_EQ (request[6], 7);    // Unit
+   EXPECT_EQ (request[7], 0x03); // Function
+
+   close (reconnected);
+   close (peer);
+}
@@ -0,0 +1,402 @@
+/*********************************************************************
+ *        _       _         _
+ *  _ __ | |_  _ | |  __ _ | |__   ___
+ * | '__|| __|(_)| | / _` || '_ \ / __|
+ * | |   | |_  _ | || (_| || |_) |\__ \
+ * |_|    \__|(_)|_| \__,_||_.__/ |___/
+ *
+ * www.rt-labs.com
+ * Copyright 2021 rt-labs AB, Sweden.
+ *
+ * This software is dual-licensed under GPLv3 and a commercial
+ * license. See the file LICENSE.md distributed with this software for
+ * full license information.
+ ********************************************************************/
+
+#include "mb_tcp_server.h"
+
+#include "options.h"
+#include "osal.h"
+#include <gtest/gtest.h>
+
+#include "test_util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Test fixture
+
+static uint32_t server_delay;
+
+static int server_hold_get (uint16_t address, uint8_t * data, size_t quantity)
+{
+   // Simulate a slow device
+   if (server_delay > 0)
+      os_usleep (server_delay);
+
+   for (size_t i = 0; i < quantity; i++)
+   {
+      mb_slave_reg_set (data, i, 0x1000 + address + i);
+   }
+   return 0;
+}
+
+static const mb_iomap_t server_iomap = {
+   .coils             = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .inputs            = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .holding_registers = {16, server_hold_get, NULL, NULL, NULL, 0, NULL},
+   .input_registers   = {0, NULL, NULL, NULL, NULL, 0, NULL},
+   .num_vendor_funcs  = 0,
+   .vendor_funcs      = NULL,
+};
+
+class TcpServerTest : public TestBase
+{
+ protected:
+   virtual void SetUp()
+   {
+      struct sockaddr_in addr;
+      socklen_t len = sizeof (addr);
+      int sock;
+
+      TestBase::SetUp();
+
+      // Find a free port
+      sock = socket (AF_INET, SOCK_STREAM, 0);
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family      = AF_INET;
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      addr.sin_port        = 0;
+      ASSERT_EQ (bind (sock, (struct sockaddr *)&addr, sizeof (addr)), 0);
+      getsockname (sock, (struct sockaddr *)&addr, &len);
+      close (sock);
+
+      port         = ntohs (addr.sin_port);
+      server_delay = 0;
+
+      memset (&cfg, 0, sizeof (cfg));
+      cfg.port        = port;
+      cfg.max_clients = 2;
+      cfg.iomap       = &server_iomap;
+      server          = mb_tcp_server_create (&cfg);
+      ASSERT_TRUE (server != NULL);
+   }
+
+   virtual void TearDown()
+   {
+      mb_tcp_server_destroy (server);
+   }
+
+   void Restart (size_t num_workers)
+   {
+      mb_tcp_server_destroy (server);
+      cfg.num_workers = num_workers;
+      server          = mb_tcp_server_create (&cfg);
+      ASSERT_TRUE (server != NULL);
+   }
+
+   int Connect()
+   {
+      struct sockaddr_in addr;
+      int sock;
+
+      sock = socket (AF_INET, SOCK_STREAM, 0);
+      memset (&addr, 0, sizeof (addr));
+      addr.sin_family      = AF_INET;
+      addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      addr.sin_port        = htons (port);
+      if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+      {
+         close (sock);
+         return -1;
+      }
+      return sock;
+   }
+
+   // Process until the expected number of bytes can be received
+   int Receive (int sock, uint8_t * buffer, size_t size)
+   {
+      for (int i = 0; i < 20; i++)
+      {
+         mb_tcp_server_process (server, 10);
+         if (recv (sock, buffer, size, MSG_PEEK | MSG_DONTWAIT) == (int)size)
+            break;
+      }
+      return recv (sock, buffer, size, MSG_DONTWAIT);
+   }
+
+   uint16_t port;
+   mb_tcp_server_cfg_t cfg;
+   mb_tcp_server_t * server;
+};
+
+// Read two holding registers starting at 0-based address 2
+static const uint8_t read_request[] =
+   {0x12, 0x34, 0x00, 0x00, 0x00, 0x06, 0x05, 0x03, 0x00, 0x02, 0x00, 0x02};
+
+// Tests
+
+TEST_F (TcpServerTest, TcpServerShouldServeManyClients)
+{
+   uint8_t response[13];
+   int a;
+   int b;
+
+   a = Connect();
+   b = Connect();
+   ASSERT_GE (a, 0);
+   ASSERT_GE (b, 0);
+
+   EXPECT_EQ (send (b, read_request, sizeof (read_request), 0), 12);
+   EXPECT_EQ (Receive (b, response, sizeof (response)), 13);
+   EXPECT_EQ (mb_tcp_server_process (server, 0), 2);
+
+   const uint8_t expected[] = {
+      0x12, 0x34, 0x00, 0x00, 0x00, 0x07, 0x05,
+      0x03, 0x04, 0x10, 0x02, 0x10, 0x03};
+   EXPECT_TRUE (ArraysMatch (expected, response));
+
+   // Request split in two segments, other client still connected
+   EXPECT_EQ (send (a, read_request, 5, 0), 5);
+   mb_tcp_server_process (server, 10);
+   EXPECT_EQ (send (a, read_request + 5, 7, 0), 7);
+   EXPECT_EQ (Receive (a, response, sizeof (response)), 13);
+   EXPECT_TRUE (ArraysMatch (expected, response));
+
+   close (a);
+   close (b);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldServePipelinedRequests)
+{
+   uint8_t requests[2 * sizeof (read_request)];
+   uint8_t responses[2 * 13];
+   int sock;
+
+   memcpy (requests, read_request, sizeof (read_request));
+   memcpy (requests + 12, read_request, sizeof (read_request));
+   requests[12 + 1] = 0x35; // Transaction ID
+   requests[12 + 7] = 0x10; // Illegal function
+
+   sock = Connect();
+   ASSERT_GE (sock, 0);
+   EXPECT_EQ (send (sock, requests, sizeof (requests), 0), 24);
+
+   // Second response is an exception
+   EXPECT_EQ (Receive (sock, responses, 13 + 9), 13 + 9);
+   EXPECT_EQ (responses[1], 0x34);
+   EXPECT_EQ (responses[13 + 1], 0x35);
+   EXPECT_EQ (responses[13 + 5], 3);
+   EXPECT_EQ (responses[13 + 7], 0x90);
+
+   close (sock);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldServeRequestsBeforeClose)
+{
+   uint8_t response[13];
+   int sock;
+
+   sock = Connect();
+   ASSERT_GE (sock, 0);
+   EXPECT_EQ (send (sock, read_request, sizeof (read_request), 0), 12);
+   shutdown (sock, SHUT_WR);
+
+   // Request is served before the connection is closed
+   EXPECT_EQ (Receive (sock, response, sizeof (response)), 13);
+   EXPECT_EQ (response[1], 0x34);
+   mb_tcp_server_process (server, 10);
+   EXPECT_EQ (mb_tcp_server_process (server, 0), 0);
+   EXPECT_EQ (recv (sock, response, sizeof (response), MSG_DONTWAIT), 0);
+
+   close (sock);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldServeManyPipelinedRequests)
+{
+   const size_t n = 400;
+   uint8_t requests[n * sizeof (read_request)];
+   uint8_t responses[n * 13];
+   size_t received = 0;
+   int sock;
+
+   Restart (1);
+
+   for (size_t i = 0; i < n; i++)
+   {
+      memcpy (&requests[i * 12], read_request, sizeof (read_request));
+      requests[i * 12 + 0] = (uint8_t)(i >> 8); // Transaction ID
+      requests[i * 12 + 1] = (uint8_t)i;
+   }
+
+   sock = Connect();
+   ASSERT_GE (sock, 0);
+   EXPECT_EQ (send (sock, requests, sizeof (requests), 0), 4800);
+
+   // More is received than is buffered while the worker is busy
+   for (int i = 0; i < 1000 && received < sizeof (responses); i++)
+   {
+      int size;
+
+      mb_tcp_server_process (server, 10);
+      size = recv (
+         sock,
+         responses + received,
+         sizeof (responses) - received,
+         MSG_DONTWAIT);
+      if (size > 0)
+         received += size;
+   }
+
+   // Responses are in order
+   ASSERT_EQ (received, sizeof (responses));
+   for (size_t i = 0; i < n; i++)
+   {
+      EXPECT_EQ (responses[i * 13 + 0], (uint8_t)(i >> 8));
+      EXPECT_EQ (responses[i * 13 + 1], (uint8_t)i);
+   }
+
+   close (sock);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldLimitClients)
+{
+   uint8_t response[13];
+   int a = Connect();
+   int b = Connect();
+   int c = Connect();
+
+   mb_tcp_server_process (server, 10);
+   EXPECT_EQ (mb_tcp_server_process (server, 0), 2);
+
+   // Third client is accepted when a slot is free
+   close (a);
+   EXPECT_EQ (send (c, read_request, sizeof (read_request), 0), 12);
+   EXPECT_EQ (Receive (c, response, sizeof (response)), 13);
+   EXPECT_EQ (mb_tcp_server_process (server, 0), 2);
+
+   close (b);
+   close (c);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldAcceptBacklogAtOnce)
+{
+   int a = Connect();
+   int b = Connect();
+
+   // Both pending connections are accepted in one call
+   EXPECT_EQ (mb_tcp_server_process (server, 100), 2);
+
+   close (a);
+   close (b);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldUseWorkersInOrder)
+{
+   uint8_t requests[2 * sizeof (read_request)];
+   uint8_t responses[2 * 13];
+   uint8_t response[13];
+   int a;
+   int b;
+
+   Restart (2);
+   server_delay = 20 * 1000;
+
+   memcpy (requests, read_request, sizeof (read_request));
+   memcpy (requests + 12, read_request, sizeof (read_request));
+   requests[12 + 1] = 0x35; // Transaction ID
+   requests[12 + 9] = 0x04; // Address
+
+   a = Connect();
+   b = Connect();
+   ASSERT_GE (a, 0);
+   ASSERT_GE (b, 0);
+   EXPECT_EQ (send (a, requests, sizeof (requests), 0), 24);
+   EXPECT_EQ (send (b, read_request, sizeof (read_request), 0), 12);
+
+   // Responses to one client are in order
+   EXPECT_EQ (Receive (a, responses, sizeof (responses)), 26);
+   EXPECT_EQ (responses[1], 0x34);
+   EXPECT_EQ (responses[10], 0x02);
+   EXPECT_EQ (responses[13 + 1], 0x35);
+   EXPECT_EQ (responses[13 + 10], 0x04);
+
+   EXPECT_EQ (Receive (b, response, sizeof (response)), 13);
+   EXPECT_EQ (response[1], 0x34);
+   EXPECT_EQ (response[10], 0x02);
+
+   close (a);
+   close (b);
+}
+
+TEST_F (TcpServerTest, TcpServerShouldShareItsPortBetweenShards)
+{
+   uint8_t response[13];
+   mb_tcp_server_t * other;
+   int socks[4];
+
+   // Only shards can listen on the same port
+   EXPECT_TRUE (mb_tcp_server_create (&cfg) == NULL);
+
+   // Either shard may get all clients
+   mb_tcp_server_destroy (server);
+   cfg.num_shards  = 2;
+   cfg.max_clients = 4;
+   server          = mb_tcp_server_create (&cfg);
+   other           = mb_tcp_server_create (&cfg);
+   ASSERT_TRUE (server != NULL);
+   ASSERT_TRUE (other != NULL);
+
+   for (auto & sock : socks)
+   {
+      sock = Connect();
+      ASSERT_GE (sock, 0);
+      EXPECT_EQ (send (sock, read_request, sizeof (read_request), 0), 12);
+   }
+
+   // Each client is served by one of the shards
+   for (int i = 0; i < 20; i++)
+   {
+      mb_tcp_server_process (server, 5);
+      mb_tcp_server_process (other, 5);
+   }
+
+   for (auto & sock : socks)
+   {
+      EXPECT_EQ (recv (sock, response, sizeof (response), MSG_DONTWAIT), 13);
+      EXPECT_EQ (response[1], 0x34);
+      close (sock);
+   }
+
+   EXPECT_EQ (
+      mb_tcp_server_diag_get (server, MB_DIAG_BUS_MESSAGES) +
+         mb_tcp_server_diag_get (other, MB_DIAG_BUS_MESSAGES),
+      4u);
+
+   mb_tcp_server_destroy (other);
+}
+
+TEST_F (TcpServerTest, TcpServerShutdownShouldWakeServerTask)
+{
+   mb_tcp_server_t * task;
+   uint32_t start;
+
+   mb_tcp_server_destroy (server);
+   cfg.num_workers = 1;
+   cfg.stack_size  = 8192;
+   task            = mb_tcp_server_init (&cfg);
+   ASSERT_TRUE (task != NULL);
+
+   // Let the task wait for socket events
+   os_usleep (20 * 1000);
+
+   // Shutdown does not wait for the poll timeout
+   start = os_get_current_time_us();
+   mb_tcp_server_shutdown (task);
+   EXPECT_LT (os_get_current_time_us() - start, 50 * 1000u);
+
+   server = mb_tcp_server_create (&cfg);
+   ASSERT_TRUE (server != NULL);
+}
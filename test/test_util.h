@@ -29,6 +29,10 @@ class TestBase : public ::testing::Test
       /* Reset mock call counters */
       mock_mb_pdu_tx_calls = 0;
       mock_mb_pdu_rx_calls = 0;
+      mock_mb_pdu_rx_id = 0;
+      mock_mb_pdu_rx_fifo = false;
+      mock_mb_pdu_rx_num_ids = 0;
+      mock_mb_pdu_tx_num_ids = 0;
    }
 };
 